@@ -0,0 +1,86 @@
+/**	Frame build benchmark. Times Draw_Frame over a screen of	**/
+/**	highlighted C without a terminal:					**/
+/**		cc -O2 -pthread -o frame_bench bench/frame.c && ./frame_bench		**/
+#define TEDIT_NO_MAIN
+#include "../main.c"
+
+#define BENCH_COLS 200
+#define BENCH_ROWS 60
+#define BENCH_FRAMES 2000
+
+static const char *bench_lines[] = {
+	"static int parse_header( struct header *h, const char *buf, size_t len ) /* checked */",
+	"\tfor(int i = 0; i < 64; i++){ total += table[i] * 3.25; } // unrolled by the compiler",
+	"\tif(h->magic != 0x7f454c46 && strncmp(buf, \"#!\", 2) != 0){ return -1; }",
+	"\tchar *name = \"frame\\tbuffer\"; unsigned long size = sizeof(struct header) + 16;",
+	"\t/* a comment that runs across the whole width of the screen to fill the row with one colour */",
+	"\twhile(node != NULL && node->next != NULL){ node = node->next; count++; }",
+	"\tswitch(kind){ case 1: return 'a'; case 2: return 'b'; default: break; }",
+	"",
+};
+
+double Bench_Now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void Bench_Frames( const char *name, void (*step)(int) )
+{
+	long bytes = 0;
+	int i = 0;
+	double start = Bench_Now();
+	for(i = 0; i < BENCH_FRAMES; i++){
+		step(i);
+		Draw_Frame();
+		bytes += config->screen->frame.length;
+	}
+	double elapsed = Bench_Now() - start;
+	printf("%-12s %8.2f us/frame %8ld bytes/frame\n", name, elapsed * 1e6 / BENCH_FRAMES, bytes / BENCH_FRAMES);
+}
+
+void Step_Full( int i )
+{
+	(void)i;
+	config->screen->valid = 0;
+}
+
+void Step_Type( int i )
+{
+	Editor_Insert_Char((i % 26) + 'a');
+}
+
+void Step_Scroll( int i )
+{
+	*config->cursor_y = BENCH_ROWS + (i % 200);
+}
+
+int main( void )
+{
+	char path[] = "/tmp/tedit_frameXXXXXX.c";
+	int fd = mkstemps(path, 2);
+	if(fd == -1){
+		die("mkstemps");
+	}
+	FILE *fp = fdopen(fd, "w");
+	int i = 0;
+	for(i = 0; i < 4000; i++){
+		fprintf(fp, "%s\n", bench_lines[i % (sizeof(bench_lines) / sizeof(bench_lines[0]))]);
+	}
+	fclose(fp);
+
+	Alloc_Config();
+	Reset_Editor();
+	*config->screen_cols = BENCH_COLS;
+	*config->screen_rows = BENCH_ROWS - 2;
+	Open_File(path);
+	unlink(path);
+
+	Draw_Frame();
+	Bench_Frames("full", Step_Full);
+	Bench_Frames("scroll", Step_Scroll);
+	*config->cursor_y = 10;
+	Bench_Frames("type", Step_Type);
+	return 0;
+}
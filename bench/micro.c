@@ -0,0 +1,411 @@
+/**	Microbenchmarks for the row, syntax, search and draw primitives	**/
+/**	over generated C with a set line length, tab and token mix, and	**/
+/**	for the lexer the size of the keyword list. Prints			**/
+/**	JSON, one result per case, so runs of two versions can be diffed:	**/
+/**		make -s micro > before.json					**/
+/**	The journal is closed so the numbers are of the core alone.		**/
+#define TEDIT_NO_MAIN
+#include "../main.c"
+
+#define MICRO_COLS 200
+#define MICRO_ROWS 60
+#define MICRO_MIN_RUNS 5
+#define MICRO_MIN_TIME 0.2
+#define MICRO_EDITS 1000
+#define MICRO_KEYWORDS 400
+
+/**	Percentages of the tokens a generated row is made of, the rest	**/
+/**	are identifiers; tabs is the share of separators that are tabs.	**/
+struct Micro_Mix {
+	const char *name;
+	int keywords;
+	int numbers;
+	int strings;
+	int comments;
+	int tabs;
+};
+
+/**	One case: run is timed and returns the bytes or ops it did,	**/
+/**	prepare runs untimed before each run.				**/
+struct Micro_Bench {
+	const char *name;
+	const char *unit;
+	double (*run)();
+	void (*prepare)();
+};
+
+static const char *micro_keywords[] = { "switch", "if", "while", "for", "return", "static", "struct", "int", "char", "void" };
+static unsigned int micro_seed = 1;
+static int micro_results = 0;
+static char micro_params[128];
+static int micro_at = 0;
+static int micro_base = 0;
+static const char *micro_query = "return";
+
+double Bench_Now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int Compare_Double( const void *a, const void *b )
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+unsigned int Micro_Rand()
+{
+	micro_seed ^= micro_seed << 13;
+	micro_seed ^= micro_seed >> 17;
+	micro_seed ^= micro_seed << 5;
+	return micro_seed;
+}
+
+/**	Fills out with one row of exactly len bytes.			**/
+void Micro_Line( char *out, int len, const struct Micro_Mix *mix )
+{
+	char token[32];
+	int at = 0;
+	while(at < len){
+		int pick = Micro_Rand() % 100;
+		int n = 0;
+		if(pick < mix->keywords){
+			n = snprintf(token, sizeof(token), "%s", micro_keywords[Micro_Rand() % 10]);
+		}else if((pick -= mix->keywords) < mix->numbers){
+			n = snprintf(token, sizeof(token), "%u", Micro_Rand() % 100000);
+		}else if((pick -= mix->numbers) < mix->strings){
+			n = snprintf(token, sizeof(token), "\"text %u\"", Micro_Rand() % 1000);
+		}else if((pick - mix->strings) < mix->comments){
+			n = snprintf(token, sizeof(token), "/* note %u */", Micro_Rand() % 1000);
+		}else{
+			n = snprintf(token, sizeof(token), "name_%u", Micro_Rand() % 1000);
+		}
+		if(at + n + 1 > len){
+			memset(&out[at], 'x', len - at);
+			break;
+		}
+		memcpy(&out[at], token, n);
+		at += n;
+		out[at++] = (int)(Micro_Rand() % 100) < mix->tabs ? '\t' : ' ';
+	}
+	out[len] = '\0';
+}
+
+/**	Starts a fresh editor on rows generated from mix.		**/
+void Micro_Load( int rows, int len, const struct Micro_Mix *mix )
+{
+	char path[] = "/tmp/tedit_microXXXXXX.c";
+	int fd = mkstemps(path, 2);
+	if(fd == -1){
+		die("mkstemps");
+	}
+	FILE *fp = fdopen(fd, "w");
+	char *line = malloc(len + 1);
+	Check_Mem(line, "micro line");
+	int i = 0;
+	micro_seed = 1;
+	for(i = 0; i < rows; i++){
+		Micro_Line(line, len, mix);
+		fprintf(fp, "%s\n", line);
+	}
+	fclose(fp);
+	free_mem(line, "micro line");
+
+	Journal_Close(1);
+	Free_Rows();
+	if(config->filename){
+		free_mem(config->filename, "filename");
+	}
+	Reset_Editor();
+	Open_File(path);
+	Journal_Close(1);
+	Map_Index_Lines(INT_MAX);
+	unlink(path);
+	micro_base = *config->num_of_rows;
+}
+
+/**	Times run until it has had MICRO_MIN_RUNS runs and MICRO_MIN_TIME	**/
+/**	seconds, and prints the best and the median per byte or op.		**/
+void Micro_Run( const struct Micro_Bench *bench )
+{
+	double times[256];
+	double total = 0;
+	int runs = 0;
+	while(runs < 256 && (runs < MICRO_MIN_RUNS || total < MICRO_MIN_TIME)){
+		if(bench->prepare){
+			bench->prepare();
+		}
+		double start = Bench_Now();
+		double units = bench->run();
+		double elapsed = Bench_Now() - start;
+		total += elapsed;
+		times[runs++] = elapsed * 1e9 / (units > 0 ? units : 1);
+	}
+	qsort(times, runs, sizeof(double), Compare_Double);
+	printf("%s\n    {\"name\": \"%s\", \"params\": {%s}, \"unit\": \"%s\", \"best\": %.3f, \"median\": %.3f, \"runs\": %d}",
+	       micro_results++ ? "," : "", bench->name, micro_params, bench->unit, times[0], times[runs / 2], runs);
+	fflush(stdout);
+}
+
+double Micro_Render()
+{
+	struct Row_Iter iter;
+	File_row *row = Row_Iter_Seek(&iter, 0);
+	double bytes = 0;
+	for(; row; row = Row_Iter_Next(&iter)){
+		Row_Render(row);
+		bytes += row->size;
+	}
+	return bytes;
+}
+
+double Micro_Syntax()
+{
+	struct Row_Iter iter;
+	File_row *row = Row_Iter_Seek(&iter, 0);
+	double bytes = 0;
+	int state = 0;
+	for(; row; row = Row_Iter_Next(&iter)){
+		Update_Syntax(row, state);
+		state = row->hl_open_comment;
+		bytes += row->render_size;
+	}
+	return bytes;
+}
+
+/**	The syntax of the loaded file with its keyword list padded to count	**/
+/**	entries, sharing prefixes with the real ones. Freed by passing 0.	**/
+void Micro_Keywords( int count )
+{
+	static struct Syntax syntax;
+	static char names[MICRO_KEYWORDS][32];
+	if(syntax.keyword_trie){
+		Keyword_Free(&syntax);
+		free_mem(syntax.key_words, "keyword list");
+	}
+	if(count == 0){
+		config->syntax = &HLDB[0];
+		return;
+	}
+	int real = 0, i = 0;
+	while(C_HL_Keywords[real]){
+		real++;
+	}
+	syntax = HLDB[0];
+	syntax.key_words = calloc(count + 1, sizeof(char *));
+	Check_Mem(syntax.key_words, "keyword list");
+	for(i = 0; i < count; i++){
+		if(i < real){
+			syntax.key_words[i] = C_HL_Keywords[i];
+			continue;
+		}
+		const char *base = C_HL_Keywords[i % real];
+		snprintf(names[i], sizeof(names[i]), "%.*s_%d%s", (int)strcspn(base, "|"), base, i, (i & 1) ? "|" : "");
+		syntax.key_words[i] = names[i];
+	}
+	Keyword_Compile(&syntax);
+	config->syntax = &syntax;
+}
+
+/**	Insert and delete keep the file at micro_base rows between runs.	**/
+void Micro_Trim()
+{
+	while(*config->num_of_rows > micro_base){
+		Del_Whole_Row(micro_at);
+	}
+	Undo_Clear();
+}
+
+void Micro_Fill()
+{
+	while(*config->num_of_rows < micro_base + MICRO_EDITS){
+		Insert_Row(micro_at, "\tint inserted = 0; /* row */", 28);
+	}
+	Undo_Clear();
+}
+
+double Micro_Insert()
+{
+	int i = 0;
+	for(i = 0; i < MICRO_EDITS; i++){
+		Insert_Row(micro_at, "\tint inserted = 0; /* row */", 28);
+	}
+	return MICRO_EDITS;
+}
+
+double Micro_Delete()
+{
+	int i = 0;
+	for(i = 0; i < MICRO_EDITS; i++){
+		Del_Whole_Row(micro_at);
+	}
+	return MICRO_EDITS;
+}
+
+/**	Every 7th offset of the first 2000 rows, or of a long row.	**/
+double Micro_Cursor()
+{
+	struct Row_Iter iter;
+	File_row *row = Row_Iter_Seek(&iter, 0);
+	double ops = 0;
+	unsigned int sum = 0;		/* only keeps the calls, wraps on long rows */
+	int y = 0, cx = 0;
+	for(y = 0; row && y < 2000; y++, row = Row_Iter_Next(&iter)){
+		int step = row->size > ROW_LONG ? row->size / 4000 : 7;
+		for(cx = 0; cx <= row->size; cx += step){
+			sum += Row_Cursor_2_Render(row, cx);
+			ops++;
+		}
+	}
+	__asm__ volatile("" : : "r"(sum));
+	return ops;
+}
+
+double Micro_Save()
+{
+	char path[] = "/tmp/tedit_micro_saveXXXXXX";
+	int fd = mkstemp(path);
+	if(fd == -1){
+		die("mkstemp");
+	}
+	close(fd);
+	if(!Save_Start(path)){
+		die("Save_Start");
+	}
+	Save_Poll(1);
+	Journal_Close(1);		/* a clean save reopens it */
+	unlink(path);
+	return config->map->length;
+}
+
+void Micro_Find_Clear()
+{
+	Search_Clear();
+}
+
+double Micro_Find()
+{
+	Find_Call_Back((char *)micro_query, micro_query[strlen(micro_query) - 1]);
+	Search_Poll(1);
+	return config->map->length;
+}
+
+double Micro_Draw()
+{
+	int i = 0;
+	for(i = 0; i < 100; i++){
+		Draw_Rows(config->screen);
+	}
+	return 100;
+}
+
+/**	A new page each op, so every row drawn is rendered and lexed.	**/
+double Micro_Draw_Scroll()
+{
+	int i = 0;
+	for(i = 0; i < 100; i++){
+		*config->current_row += *config->screen_rows;
+		if(*config->current_row + *config->screen_rows > *config->num_of_rows){
+			*config->current_row = 0;
+		}
+		Draw_Rows(config->screen);
+	}
+	return 100;
+}
+
+static const struct Micro_Mix micro_mixes[] = {
+	{ "plain",	0,	0,	0,	0,	0 },
+	{ "keywords",	50,	0,	0,	0,	0 },
+	{ "numbers",	0,	50,	0,	0,	0 },
+	{ "strings",	0,	0,	50,	0,	0 },
+	{ "comments",	0,	0,	0,	50,	0 },
+	{ "mixed",	20,	10,	10,	10,	10 },
+};
+
+int main( void )
+{
+	static const struct Micro_Bench render = { "Row_Render", "ns/byte", Micro_Render, NULL };
+	static const struct Micro_Bench syntax = { "Update_Syntax", "ns/byte", Micro_Syntax, NULL };
+	static const struct Micro_Bench insert = { "Insert_Row", "ns/op", Micro_Insert, Micro_Trim };
+	static const struct Micro_Bench delete = { "Del_Whole_Row", "ns/op", Micro_Delete, Micro_Fill };
+	static const struct Micro_Bench cursor = { "Row_Cursor_2_Render", "ns/op", Micro_Cursor, NULL };
+	static const struct Micro_Bench save = { "Save", "ns/byte", Micro_Save, NULL };
+	static const struct Micro_Bench find = { "Find_Call_Back", "ns/byte", Micro_Find, Micro_Find_Clear };
+	static const struct Micro_Bench draw = { "Draw_Rows", "ns/op", Micro_Draw, NULL };
+	static const struct Micro_Bench scroll = { "Draw_Rows_Scroll", "ns/op", Micro_Draw_Scroll, NULL };
+	static const int lengths[] = { 16, 80, 1024 };
+	static const int tab_shares[] = { 0, 25, 75 };
+	static const int keyword_counts[] = { 100, 200, 400 };	/* 23, the C list itself, is the mixed case above */
+	static const char *positions[] = { "front", "middle", "end" };
+	unsigned int i = 0, j = 0;
+
+	Alloc_Config();
+	Reset_Editor();
+	*config->screen_cols = MICRO_COLS;
+	*config->screen_rows = MICRO_ROWS - 2;
+	printf("{\n  \"bench\": \"tedit-micro\",\n  \"results\": [");
+
+	for(i = 0; i < 3; i++){
+		for(j = 0; j < 3; j++){
+			struct Micro_Mix mix = { "tabs", 0, 0, 0, 0, tab_shares[j] };
+			Micro_Load((4 << 20) / (lengths[i] + 1), lengths[i], &mix);
+			snprintf(micro_params, sizeof(micro_params), "\"len\": %d, \"tabs\": %d", lengths[i], tab_shares[j]);
+			Micro_Run(&render);
+		}
+	}
+
+	for(i = 0; i < sizeof(micro_mixes) / sizeof(micro_mixes[0]); i++){
+		Micro_Load(50000, 80, &micro_mixes[i]);
+		Micro_Render();
+		snprintf(micro_params, sizeof(micro_params), "\"mix\": \"%s\", \"len\": 80, \"keywords\": 23", micro_mixes[i].name);
+		Micro_Run(&syntax);
+	}
+	for(i = 0; i < sizeof(keyword_counts) / sizeof(keyword_counts[0]); i++){
+		Micro_Keywords(keyword_counts[i]);
+		snprintf(micro_params, sizeof(micro_params), "\"mix\": \"mixed\", \"len\": 80, \"keywords\": %d", keyword_counts[i]);
+		Micro_Run(&syntax);
+	}
+	Micro_Keywords(0);
+
+	Micro_Load(100000, 80, &micro_mixes[5]);
+	for(i = 0; i < 3; i++){
+		micro_at = i == 0 ? 0 : i == 1 ? micro_base / 2 : micro_base;
+		snprintf(micro_params, sizeof(micro_params), "\"at\": \"%s\", \"rows\": %d", positions[i], micro_base);
+		Micro_Run(&insert);
+		Micro_Run(&delete);
+		Micro_Trim();
+	}
+
+	for(i = 0; i < 3; i++){
+		struct Micro_Mix mix = { "tabs", 0, 0, 0, 0, tab_shares[i] };
+		Micro_Load(2000, 80, &mix);
+		snprintf(micro_params, sizeof(micro_params), "\"len\": 80, \"tabs\": %d", tab_shares[i]);
+		Micro_Run(&cursor);
+	}
+	Micro_Load(1, 1 << 20, &micro_mixes[5]);
+	Row_Long(Row_At(0));
+	snprintf(micro_params, sizeof(micro_params), "\"len\": %d, \"tabs\": 10", 1 << 20);
+	Micro_Run(&cursor);
+
+	Micro_Load(400000, 80, &micro_mixes[5]);
+	snprintf(micro_params, sizeof(micro_params), "\"rows\": %d, \"len\": 80", micro_base);
+	Micro_Run(&save);
+	Micro_Run(&find);
+	config->search->regex_mode = 1;
+	micro_query = "st[a-z]+c";
+	snprintf(micro_params, sizeof(micro_params), "\"rows\": %d, \"len\": 80, \"regex\": 1", micro_base);
+	Micro_Run(&find);
+	Search_Clear();
+	config->search->regex_mode = 0;
+
+	*config->current_row = 0;
+	Draw_Frame();
+	snprintf(micro_params, sizeof(micro_params), "\"cols\": %d, \"rows\": %d", MICRO_COLS, MICRO_ROWS - 2);
+	Micro_Run(&draw);
+	Micro_Run(&scroll);
+
+	printf("\n  ]\n}\n");
+	return 0;
+}
@@ -0,0 +1,267 @@
+/**	Keystroke latency benchmark. Replays a key script through		**/
+/**	Process_Key_Press and Refresh_Screen on a fixed size screen with	**/
+/**	no terminal: stdin is a pipe the script is written into and stdout	**/
+/**	is /dev/null. Generates its corpora unless files are given, which	**/
+/**	are replayed from a copy so their own journal is never touched:	**/
+/**		cc -O2 -pthread -o replay_bench bench/replay.c && ./replay_bench [file...]	**/
+#define TEDIT_NO_MAIN
+#include "../main.c"
+#include <sys/wait.h>
+
+#define BENCH_COLS 200
+#define BENCH_ROWS 60
+#define BENCH_PASTE 4096
+
+/**	One timed operation: the keys written for each of 'count' reps,	**/
+/**	alternating with 'undo_keys' when set, after an untimed setup.		**/
+struct Replay_Op {
+	const char *name;
+	const char *keys;
+	const char *undo_keys;
+	int count;
+	void (*setup)();
+};
+
+void Replay_Middle()
+{
+	*config->cursor_y = *config->num_of_rows / 2;
+	*config->cursor_x = 0;
+}
+
+void Replay_Top()
+{
+	*config->cursor_y = 0;
+	*config->cursor_x = 0;
+}
+
+static char replay_paste[BENCH_PASTE + 16];
+
+static struct Replay_Op replay_ops[] = {
+	{ "down",	"\x1b[B",	NULL,		2000,	Replay_Middle },
+	{ "right",	"\x1b[C",	NULL,		2000,	NULL },
+	{ "page_down",	"\x1b[6~",	NULL,		200,	NULL },
+	{ "page_up",	"\x1b[5~",	NULL,		200,	NULL },
+	{ "end_home",	"\x1b[F",	"\x1b[H",	400,	Replay_Middle },
+	{ "type",	"x",		NULL,		2000,	NULL },
+	{ "newline",	"\r",		NULL,		300,	NULL },
+	{ "backspace",	"\x7f",		NULL,		2000,	NULL },
+	{ "paste",	replay_paste,	NULL,		50,	NULL },
+	{ "undo",	"\x1a",		NULL,		200,	NULL },
+	{ "redo",	"\x19",		NULL,		200,	NULL },
+	{ "find",	"\x06static\r",	NULL,		20,	Replay_Middle },
+	{ "comment",	"/*",		"\x7f\x7f",	40,	Replay_Top },
+};
+
+static FILE *report;
+
+double Bench_Now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int Compare_Double( const void *a, const void *b )
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/**	Lets the background work Read_Key would do between keys finish,	**/
+/**	so each rep starts from an idle editor.				**/
+void Replay_Idle()
+{
+	while(Map_Pending() || Syntax_Pending() || Save_Pending() || Search_Pending()){
+		Save_Poll(1);
+		Search_Poll(1);
+		if(Map_Pending()){
+			Map_Index_Lines(MAP_IDLE_LINES);
+		}else if(Syntax_Pending()){
+			Syntax_Validate(*config->syntax_valid + SYNTAX_IDLE_ROWS);
+		}
+	}
+}
+
+void Replay_Write( int fd, const char *keys )
+{
+	size_t len = strlen(keys);
+	if(write(fd, keys, len) != (ssize_t)len){
+		die("Replay_Write");
+	}
+}
+
+/**	Times each rep from the first key to the frame written after the	**/
+/**	last, the way main's loop redraws once per batch of keys.		**/
+void Replay_Op( struct Replay_Op *op, int keys_fd )
+{
+	double *times = malloc(op->count * sizeof(double));
+	Check_Mem(times, "times");
+	long bytes = 0;
+	int i = 0;
+	if(op->setup){
+		op->setup();
+	}
+	for(i = 0; i < op->count; i++){
+		Replay_Idle();
+		double start = Bench_Now();
+		Replay_Write(keys_fd, op->undo_keys && (i & 1) ? op->undo_keys : op->keys);
+		do{
+			Process_Key_Press();
+		}while(Input_Pending());
+		Refresh_Screen();
+		times[i] = Bench_Now() - start;
+		bytes += config->screen->frame.length;
+	}
+	qsort(times, op->count, sizeof(double), Compare_Double);
+	fprintf(report, "  %-10s %6d reps  p50 %9.1f us  p99 %9.1f us  max %9.1f us  %7ld bytes/frame\n",
+			op->name, op->count, times[op->count / 2] * 1e6, times[op->count * 99 / 100] * 1e6,
+			times[op->count - 1] * 1e6, bytes / op->count);
+	free_mem(times, "times");
+}
+
+/**	Replays the whole script against one file in a child process, so	**/
+/**	each corpus starts from a fresh editor.				**/
+void Replay_File( const char *name, char *path )
+{
+	fflush(report);
+	pid_t pid = fork();
+	if(pid == -1){
+		die("fork");
+	}
+	if(pid){
+		waitpid(pid, NULL, 0);
+		return;
+	}
+	int keys[2];
+	if(pipe(keys) == -1 || dup2(keys[0], STDIN) == -1){
+		die("pipe");
+	}
+	int null_fd = open("/dev/null", O_WRONLY);
+	if(null_fd == -1 || dup2(null_fd, STDOUT) == -1){
+		die("/dev/null");
+	}
+
+	Alloc_Config();
+	Reset_Editor();
+	*config->screen_cols = BENCH_COLS;
+	*config->screen_rows = BENCH_ROWS - 2;
+	double start = Bench_Now();
+	Open_File(path);
+	Replay_Idle();
+	fprintf(report, "%s: %d rows, opened and indexed in %.1f ms\n",
+			name, *config->num_of_rows, (Bench_Now() - start) * 1e3);
+
+	unsigned int i = 0;
+	for(i = 0; i < sizeof(replay_ops) / sizeof(replay_ops[0]); i++){
+		Replay_Op(&replay_ops[i], keys[1]);
+	}
+	Replay_Idle();
+	Heap_Report(report);
+	fflush(report);
+	Journal_Close(1);
+	_exit(0);
+}
+
+/**	Corpora: many short rows of C, a few very long rows, and rows of	**/
+/**	block comments that stay open across thousands of rows.		**/
+void Write_Huge( FILE *fp )
+{
+	static const char *lines[] = {
+		"static int parse_header( struct header *h, const char *buf, size_t len ) /* checked */",
+		"\tfor(int i = 0; i < 64; i++){ total += table[i] * 3.25; } // unrolled by the compiler",
+		"\tif(h->magic != 0x7f454c46 && strncmp(buf, \"#!\", 2) != 0){ return -1; }",
+		"\twhile(node != NULL && node->next != NULL){ node = node->next; count++; }",
+		"",
+	};
+	int i = 0;
+	for(i = 0; i < 400000; i++){
+		fprintf(fp, "%s\n", lines[i % (sizeof(lines) / sizeof(lines[0]))]);
+	}
+}
+
+void Write_Long( FILE *fp )
+{
+	int i = 0, j = 0;
+	for(i = 0; i < 16; i++){
+		for(j = 0; j < 1 << 14; j++){
+			fprintf(fp, "x%d = \"%05d\"; /* %d */ ", j, j, i);
+		}
+		fputc('\n', fp);
+	}
+}
+
+void Write_Nested( FILE *fp )
+{
+	int i = 0;
+	for(i = 0; i < 100000; i++){
+		int depth = i % 40;
+		if(i % 5000 == 0){
+			fprintf(fp, "/* block %d opens here /* and again\n", i);
+		}else if(i % 5000 == 4999){
+			fprintf(fp, "   closes here */ int after_%d = %d;\n", i, i);
+		}else{
+			fprintf(fp, "%*s{ /* depth %d */ if(a[%d]){ \"str /* not */\"; // tail */\n", depth, "", depth, i);
+		}
+	}
+}
+
+/**	A file from the command line, copied byte for byte.		**/
+static const char *replay_source;
+
+void Write_Copy( FILE *fp )
+{
+	char buf[1 << 16];
+	size_t len;
+	FILE *in = fopen(replay_source, "r");
+	if(in == NULL){
+		die(replay_source);
+	}
+	while((len = fread(buf, 1, sizeof(buf), in)) > 0){
+		fwrite(buf, 1, len, fp);
+	}
+	fclose(in);
+}
+
+/**	Writes the corpus to a temporary file ending in ext, so the	**/
+/**	syntax is picked as it would be for the original.		**/
+void Replay_Corpus( const char *name, const char *ext, void (*write_corpus)( FILE * ) )
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "/tmp/tedit_replayXXXXXX%s", ext);
+	int fd = mkstemps(path, strlen(ext));
+	if(fd == -1){
+		die("mkstemps");
+	}
+	FILE *fp = fdopen(fd, "w");
+	write_corpus(fp);
+	fclose(fp);
+	Replay_File(name, path);
+	unlink(path);
+}
+
+int main( int argc, char **argv )
+{
+	memcpy(replay_paste, "\x1b[200~", 6);
+	int i = 0;
+	for(i = 0; i < BENCH_PASTE; i++){
+		replay_paste[6 + i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+	}
+	memcpy(&replay_paste[6 + BENCH_PASTE], "\x1b[201~", 7);
+
+	report = fdopen(dup(STDOUT), "w");
+	if(report == NULL){
+		die("report");
+	}
+	if(argc > 1){
+		for(i = 1; i < argc; i++){
+			const char *dot = strrchr(argv[i], '.');
+			replay_source = argv[i];
+			Replay_Corpus(argv[i], (dot && !strchr(dot, '/')) ? dot : "", Write_Copy);
+		}
+		return 0;
+	}
+	Replay_Corpus("huge", ".c", Write_Huge);
+	Replay_Corpus("long", ".c", Write_Long);
+	Replay_Corpus("nested", ".c", Write_Nested);
+	return 0;
+}
@@ -1,39 +1,152 @@
 /* FEATURE MACROS */
 #define _DEFAULT_SOURCE
 #define _BSD_SOURCE
-#define GNU_SOURCE
+#define _GNU_SOURCE
 
 /* INCLUDES */ /* TODO probably make a header file */
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <poll.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <termios.h>
 #include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 /* DEFINITIONS */
 #define STDIN 0
 #define STDOUT 1
 #define STDERR 2
 #define CTRL_KEY(k) ((k) & 0x1f) 	
-#define BUFFER_CONSTR { NULL, 0 }
+#define BUFFER_CONSTR { NULL, 0, 0, HEAP_OTHER }
 #define TEDIT_VERSION "0.1"
 #define TEDIT_QUIT 3
 #define TAB_STOP 8
 #define HIGH_LIGHT_NUMBERS (1<<0)	
 #define HIGH_LIGHT_STRINGS (1<<1)
+#define CC_SEPARATOR (1<<0)
+#define CC_QUOTE (1<<1)
+#define CC_COMMENT (1<<2)
+#define CC_STOP (CC_SEPARATOR | CC_QUOTE | CC_COMMENT)
+#define LINE_NODE_MAX 64
+#define POOL_ALIGN 16
+#define POOL_SMALL_MAX 512
+#define POOL_MAX_SHIFT 16
+#define POOL_CLASSES (POOL_SMALL_MAX / POOL_ALIGN + (POOL_MAX_SHIFT - 9) * 4)
+#define POOL_CHUNK_SIZE (1 << 20)
+#define ROW_MAPPED (1<<0)
+#define ROW_RENDERED (1<<1)
+#define ROW_STATE_VALID (1<<2)
+#define ROW_GLYPHS (1<<3)
+#define ROW_MARKS (1<<4)
+#define ROW_SHARED (1<<5)
+#define HOT_ROWS 4096
+#define SYNTAX_IDLE_ROWS 16384
+#define MAP_INDEX_BATCH 1024
+#define MAP_IDLE_LINES 4096
+#define ATTR_INVERSE (1<<7)
+#define SCREEN_GAP 6
+#define INPUT_BUFFER 65536
+#define INPUT_ESC_WAIT 100
+#define ROW_LONG (1<<16)
+#define ROW_CHUNK 4096
+#define ROW_LOOKAHEAD 64
+#define LEX_NORMAL 0
+#define LEX_COMMENT 1
+#define LEX_LINE_COMMENT 2
+#define UTF8_INVALID 0xfffd
+#define SAVE_BATCH 1024
+#define SAVE_BATCH_BYTES (4 << 20)
+#define SAVE_TICK 100
+#define JOURNAL_MAGIC "TEDJ"
+#define JOURNAL_VERSION 2
+#define JOURNAL_COMMIT_MS 100
+#define JOURNAL_FLUSH_BYTES (1 << 20)
+#define UNDO_BUDGET (64 << 20)
+#define SEARCH_TWO_WAY 64
+#define SEARCH_BLOCK (1 << 20)
+#define SEARCH_THREADS 8
+#define SEARCH_TICK 10
+#define REGEX_REPEAT_MAX 1000
+#define REGEX_PROGRAM_MAX (1 << 16)
+#define REGEX_CACHE_STATES 1024
+#define REGEX_TABLE 2048
+#define REGEX_GROUPS 32
+#define REGEX_POLL (1 << 16)
+#define TRACE_FRAMES 256
+#define TRACE_SPANS 64
 
 /* PROTOTYPE */
+struct File_row;
+struct Line_Node;
+struct Row_Iter;
+struct Row_Chunks;
+struct Col_Mark;
+struct Screen;
+struct Buffer;
+struct Syntax;
 void Refresh_Screen();
 void Disable_Raw_Mode();
-void Set_Status_Message( onst char *fmt, ...);
+void Set_Status_Message( const char *fmt, ...);
 char *Prompt( char *prompt, void (*callback)(char *, int) );
+struct File_row *Row_At( int index );
+struct File_row *Row_Iter_Seek( struct Row_Iter *iter, int index );
+struct File_row *Row_Iter_Next( struct Row_Iter *iter );
+int Row_Index( struct File_row *row );
+int Map_Pending();
+void Map_Index_Lines( int lines );
+void Map_Index_Until( int rows );
+int Syntax_Pending();
+void Syntax_Validate( int at );
+void Keyword_Free( struct Syntax *syntax );
+struct Row_Chunks *Row_Long( struct File_row *row );
+void Row_Chunks_Free( struct File_row *row );
+int Row_Scan_State( struct File_row *row, int in_comment );
+void Scroll();
+void Row_Glyphs( struct File_row *row );
+void Screen_Resize( struct Screen *screen, int rows, int cols );
+void Append_Buffer( struct Buffer *buff, const char *key_press, int size );
+void Free_Buffer( struct Buffer *buff );
+void Line_Tree_Free( struct Line_Node *node );
+void Save_Orphan( char *string, int cap );
+int Save_Pending();
+void Journal_Row( int op, struct File_row *row, int x, const char *text, int len );
+void Journal_Record( int op, int index, int x, const char *text, int len );
+void Journal_Open();
+void Journal_Close( int remove );
+int Journal_Rebase( long long mark );
+int Save_Poll( int wait );
+void Undo_Insert( struct File_row *row, int x, const char *text, int len );
+void Undo_Delete( struct File_row *row, int x, int len );
+void Undo_Splice( struct File_row *row, int index, int x, int old_len, const char *text, int len );
+void Undo_Row_Insert( int index );
+void Undo_Row_Delete( int index, struct File_row *row );
+void Undo_Row_Split( int op, int index, int x );
+void Undo_Clear();
+void Search_Clear();
+int Search_Pending();
+int Search_Poll( int wait );
+void Search_Pool_Stop();
+void Search_High_Light( struct File_row *row, int at, unsigned char *attr, int len );
+long long Trace_Now();
+void Trace_End( int phase, long long start );
+void Trace_Count( int counter, long count );
+void Heap_Count( int kind, long long bytes, int allocs );
+void *Heap_Alloc( int kind, void *ptr, size_t size );
+void Heap_Free( void *ptr );
 
 /* DATA */
 enum KEYS{
@@ -46,7 +159,89 @@ enum KEYS{
 	HOME_KEY,
 	END_KEY,
 	PAGE_UP,
-	PAGE_DOWN
+	PAGE_DOWN,
+	PASTE_KEY		/* text is in config->input->paste */
+};
+
+/**	Journal records: an op byte, then varints for the row and offset,	**/
+/**	then a varint length and the bytes for the ops that carry text.	**/
+enum JOURNAL_OPS{
+	JOURNAL_INSERT = 1,	/* row, x, text */
+	JOURNAL_DELETE,		/* row, x, length */
+	JOURNAL_TRUNCATE,	/* row, x */
+	JOURNAL_ROW_INSERT,	/* row, text */
+	JOURNAL_ROW_DELETE	/* row */
+};
+
+enum UNDO_OPS{
+	UNDO_INSERT = 1,	/* text went in at row, x */
+	UNDO_DELETE,		/* text came out at row, x */
+	UNDO_ROW_INSERT,
+	UNDO_ROW_DELETE,
+	UNDO_REPLACE,		/* rows spliced by a replace, packed in text */
+	UNDO_ROW_SPLIT,		/* row was split at x, nothing is copied */
+	UNDO_ROW_JOIN		/* the row below was joined onto row at x */
+};
+
+/**	What the last key did, typing and erasing runs share a group.	**/
+enum UNDO_KINDS{
+	UNDO_OTHER = 0,
+	UNDO_TYPING,
+	UNDO_ERASE
+};
+
+enum REGEX_OPS{
+	REGEX_BYTE = 1,		/* a byte of sets[set], then out */
+	REGEX_SPLIT,		/* out and out1 */
+	REGEX_BOL,		/* at the start of the line */
+	REGEX_EOL,		/* at the end of the line */
+	REGEX_MATCH
+};
+
+enum REGEX_NODES{
+	REGEX_NODE_EMPTY,
+	REGEX_NODE_SET,
+	REGEX_NODE_CAT,
+	REGEX_NODE_ALT,
+	REGEX_NODE_REPEAT,
+	REGEX_NODE_BOL,
+	REGEX_NODE_EOL
+};
+
+/**	Phases a frame's time is split into. SYNTAX spans can sit inside	**/
+/**	KEYS, IDLE and DRAW ones, so the totals overlap.			**/
+enum TRACE_PHASES{
+	TRACE_KEYS = 0,		/* from the first key to the start of the frame */
+	TRACE_IDLE,		/* background work between keys */
+	TRACE_SYNTAX,
+	TRACE_DRAW,
+	TRACE_FLUSH,
+	TRACE_WRITE,
+	TRACE_PHASE_COUNT
+};
+
+enum TRACE_COUNTERS{
+	TRACE_ROWS_LEXED = 0,
+	TRACE_BYTES_RENDERED,
+	TRACE_BYTES_WRITTEN,
+	TRACE_ALLOCS,
+	TRACE_SYSCALLS,
+	TRACE_COUNTER_COUNT
+};
+
+/**	What a block of heap is for. Pools count whole blocks, the rest	**/
+/**	is counted by Heap_Alloc.						**/
+enum HEAP_KINDS{
+	HEAP_OTHER = 0,
+	HEAP_ROWS,		/* File_row structs */
+	HEAP_TEXT,		/* row strings owned by the editor */
+	HEAP_RENDER,		/* render copies, glyphs and column marks */
+	HEAP_HIGHLIGHT,
+	HEAP_UNDO,		/* records, their text and the rows they keep */
+	HEAP_SEARCH,
+	HEAP_SCREEN,		/* cells and the frame buffer */
+	HEAP_JOURNAL,
+	HEAP_KIND_COUNT
 };
 
 enum HIGHLIGHT{
@@ -61,18 +256,467 @@ enum HIGHLIGHT{
 };
 
 typedef struct File_row {
-	int *idx;
-	int *hl_open_comment;
-	int *size;
-	int *render_size;
+	struct Line_Node *leaf;
+	struct Row_Chunks *chunks;	/* only rows of ROW_LONG bytes or more */
+	struct Col_Mark *marks;		/* valid while ROW_MARKS is set */
 	char *render;
 	char *string;
-	unsigned char *high_lighted;
+	unsigned int *glyph;		/* cell per column when ROW_GLYPHS */
+	unsigned char *high_lighted;	/* one per column */
+	int hl_open_comment;
+	int flags;
+	int hot;
+	int size;
+	int gap;		/* string[gap, gap + gap_len) is unused */
+	int gap_len;
+	int render_size;
+	int columns;
+	int mark_count;
+	int string_cap;
+	int render_cap;
+	int glyph_cap;
+	int mark_cap;
+	int high_lighted_cap;
 } File_row;
 
+/**	A byte sequence of string that is not one column wide: a tab, a	**/
+/**	multi-byte character or a wide one. Every byte between two marks	**/
+/**	takes one column, so columns and offsets map by binary search.	**/
+struct Col_Mark {
+	int off;
+	int rx;
+	unsigned char len;
+	unsigned char width;
+};
+
+/**	Lexer state and render column at an offset of a long row. Offsets	**/
+/**	are only picked where the state follows from the bytes before them,	**/
+/**	so a checkpoint past an edit is still right if the scan reaches it	**/
+/**	in the same state.							**/
+struct Row_Checkpoint {
+	int off;
+	int rx;
+	int state;		/* LEX_* */
+};
+
+/**	ck[0, valid) are exact, ck[valid, count) are left over from before	**/
+/**	the last edit and only kept if the scan converges on them. rx is	**/
+/**	known for ck[0, rx_valid). render holds the columns from render_rx.	**/
+struct Row_Chunks {
+	struct Row_Checkpoint *ck;
+	int count;
+	int cap;
+	int valid;
+	int rx_valid;
+	int complete;		/* the scan from ck[count - 1] reached the end */
+	int end_state;
+	int render_rx;
+	int render_end;		/* render reaches the end of the row */
+};
+
+/**	Size-classed slab allocator. Blocks up to 1 << POOL_MAX_SHIFT are cut	**/
+/**	out of large chunks and recycled through per-class free lists, bigger	**/
+/**	ones are malloc'd and chained so Pool_Release frees everything at once.	**/
+struct Pool_Chunk {
+	struct Pool_Chunk *next;
+	size_t used;
+	size_t size;
+	size_t pad;		/* keeps data 16 byte aligned */
+	char data[];
+};
+
+struct Pool_Large {
+	struct Pool_Large *next;
+	struct Pool_Large *prev;
+};
+
+struct Pool {
+	struct Pool_Chunk *chunks;
+	struct Pool_Large *large;
+	void *free_list[POOL_CLASSES];
+	int kind;		/* HEAP_KINDS its blocks count toward */
+	long long live;		/* bytes in blocks handed out */
+};
+
+/**	Counted B+ tree of rows. Row numbers are implicit: a row's index is the	**/
+/**	sum of the line counts to its left, so inserts and deletes never	**/
+/**	renumber the rows that follow.						**/
+struct Line_Node {
+	struct Line_Node *parent;
+	struct Line_Node *prev;		/* leaf siblings, for sequential scans */
+	struct Line_Node *next;
+	int leaf;
+	int count;
+	int line_count;
+	union {
+		struct Line_Node *child[LINE_NODE_MAX];
+		File_row *row[LINE_NODE_MAX];
+	};
+};
+
+struct Row_Iter {
+	struct Line_Node *leaf;
+	int slot;
+};
+
+/**	Read-only view of the opened file. Rows past 'indexed' have not	**/
+/**	been split out yet and are added in the background.			**/
+struct Mapping {
+	char *data;
+	size_t length;
+	size_t indexed;
+};
+
 struct Buffer {
-	char *string;
+	char *string;		/* from Heap_Alloc */
 	int length;
+	int capacity;
+	int kind;		/* HEAP_KINDS */
+};
+
+/**	Bytes read from the tty but not decoded into keys yet, and the	**/
+/**	text of the last bracketed paste.					**/
+struct Input {
+	char data[INPUT_BUFFER];
+	int start;
+	int end;
+	struct Buffer paste;
+};
+
+/**	Terminal cells, one codepoint and one attribute (HL_* | ATTR_INVERSE)	**/
+/**	each; the cell right of a wide character holds 0. text/attr is the	**/
+/**	frame being drawn, back_text/back_attr is what the terminal has	**/
+/**	shown since the last Screen_Flush.					**/
+struct Screen {
+	int rows;
+	int cols;
+	int top;		/* current_row of the back buffer */
+	int valid;		/* back buffer matches the terminal */
+	unsigned int *text;
+	unsigned char *attr;
+	unsigned int *back_text;
+	unsigned char *back_attr;
+	struct Buffer frame;	/* escape sequences of the frame, reused */
+	char sgr[256][16];	/* SGR sequence of every attribute */
+	unsigned char sgr_len[256];
+};
+
+/**	Timing of one frame: from the first key read, or the first span,	**/
+/**	to the end of the write. Spans past TRACE_SPANS only count toward	**/
+/**	the phase totals. Times are CLOCK_MONOTONIC nanoseconds.		**/
+struct Trace_Span {
+	long long start;
+	long long end;
+	int phase;
+};
+
+struct Trace_Frame {
+	long long start;
+	long long end;
+	long long key;		/* first key of the frame read, 0 if none */
+	long long phase_ns[TRACE_PHASE_COUNT];
+	long counters[TRACE_COUNTER_COUNT];
+	int span_count;
+	struct Trace_Span spans[TRACE_SPANS];
+};
+
+/**	Bytes live now, the most there were at once, and allocations made.	**/
+/**	Updated with relaxed atomics, search workers count too.		**/
+struct Heap_Stat {
+	long long live;
+	long long peak;
+	long long count;
+};
+
+/**	In front of every block from Heap_Alloc, which is kept aligned.	**/
+struct Heap_Header {
+	long long size;
+	long long kind;
+};
+
+/**	Ring of the last TRACE_FRAMES frames, frames[next] is the one being	**/
+/**	recorded. Only the input thread records.				**/
+enum TRACE_OVERLAYS{
+	TRACE_OVERLAY_OFF = 0,
+	TRACE_OVERLAY_FRAME,
+	TRACE_OVERLAY_HEAP,
+	TRACE_OVERLAY_COUNT
+};
+
+struct Trace {
+	struct Trace_Frame frames[TRACE_FRAMES];
+	int next;
+	int count;		/* frames finished, up to TRACE_FRAMES */
+	int overlay;		/* status bar shows TRACE_OVERLAY_* */
+	int idle;		/* in Read_Key's background work, whose inner */
+				/* spans fold into the TRACE_IDLE one */
+};
+
+/**	A save running on its own thread. spans point into row storage and	**/
+/**	the mapping, each is written followed by a newline. Rows in the	**/
+/**	snapshot are ROW_SHARED: editing one copies its string first and the	**/
+/**	old one is parked in orphans until the writer is done with it.	**/
+struct Save_Span {
+	const char *data;
+	size_t len;
+};
+
+struct Save_Orphan {
+	char *string;
+	int cap;
+};
+
+struct Save_Job {
+	pthread_t thread;
+	struct Save_Span *spans;
+	int span_count;
+	struct Save_Orphan *orphans;
+	int orphan_count;
+	int orphan_cap;
+	char *target;		/* config->filename with symlinks resolved */
+	char *temp;
+	int fd;
+	int dirty;		/* dirty_flag when the snapshot was taken */
+	long long journal_mark;	/* journal ops up to here are in the snapshot */
+	long long total;
+	long long written;	/* atomic, updated by the writer */
+	int done;		/* atomic, set once the writer has finished */
+	int error;		/* errno of the first failure, read after done */
+	struct timespec start;
+	struct timespec shown;	/* last progress message */
+};
+
+/**	Journal of the edits made since the file was last saved. Ops are	**/
+/**	appended to pending on the main thread; the writer thread swaps it	**/
+/**	out every JOURNAL_COMMIT_MS and writes and fdatasyncs it as one	**/
+/**	batch. Lock order is lock, then io.					**/
+struct Journal_Header {
+	char magic[4];
+	int version;
+	long long size;		/* the saved file the ops apply to */
+	long long inode;
+	long long mtime_sec;
+	long long mtime_nsec;
+};
+
+struct Journal {
+	pthread_t thread;
+	pthread_mutex_t lock;	/* pending and stop */
+	pthread_mutex_t io;	/* fd and writing, held while writing */
+	pthread_cond_t wake;
+	struct Buffer pending;
+	struct Buffer writing;
+	long long logged;	/* bytes of ops after the header, main thread only */
+	char *path;
+	int fd;
+	int stop;
+	int error;		/* atomic, errno of the first failed write; nothing is written after it */
+};
+
+/**	An edit and what it takes to reverse it. Row records hold the row	**/
+/**	itself while it is out of the tree: deleted, or inserted and then	**/
+/**	undone. Nothing is copied to undo a row delete, it is linked back.	**/
+struct Undo_Record {
+	int op;			/* UNDO_OPS */
+	int row;
+	int x;
+	int len;
+	int cap;
+	int group;		/* first record of an undo group */
+	union {
+		char *text;		/* UNDO_INSERT, UNDO_DELETE, from undo_pool */
+		File_row *line;		/* UNDO_ROW_*, NULL while in the tree */
+	};
+};
+
+/**	records[start, done) can be undone, records[done, count) redone.	**/
+/**	Whole groups are dropped from the front once the records cost more	**/
+/**	than config->undo_budget bytes.					**/
+struct Undo_History {
+	struct Undo_Record *records;
+	int start;
+	int done;
+	int count;
+	int cap;
+	int newest;		/* first record of the last group */
+	long long bytes;
+	int kind;		/* UNDO_KINDS of the last key */
+	int open;		/* the next record may join the last group */
+	int applying;		/* undo or redo is running, edits are not recorded */
+};
+
+/**	A regex is parsed into a tree of nodes, then compiled to a program	**/
+/**	of instructions for each direction: the reverse one reads a line	**/
+/**	backwards, with ^ and $ swapped. Each byte instruction takes a set	**/
+/**	of 256 bits, so a UTF-8 character is a sequence of them.		**/
+struct Regex_Node {
+	int type;		/* REGEX_NODES */
+	int left;
+	int right;
+	int set;
+	int min;
+	int max;		/* -1 when there is no limit */
+};
+
+struct Regex_Inst {
+	int op;			/* REGEX_OPS */
+	int out;
+	int out1;
+	int set;
+};
+
+struct Regex_Program {
+	struct Regex_Inst *inst;
+	int count;
+	int cap;
+	int start;
+};
+
+struct Regex {
+	struct Regex_Program forward;
+	struct Regex_Program reverse;
+	unsigned char (*sets)[32];
+	int set_count;
+	int set_cap;
+	char *prefix;		/* bytes every match starts with */
+	int prefix_len;
+};
+
+struct Regex_Parser {
+	const char *at;
+	const char *end;
+	const char *error;	/* the first one, parsing stops there */
+	struct Regex_Node *nodes;
+	int count;
+	int cap;
+	struct Regex *regex;
+};
+
+/**	A DFA built lazily from a program, one state at a time as the text	**/
+/**	needs it. A state is the sorted list of instructions the threads	**/
+/**	are at; next[state * 257 + byte] is -1 until that move is taken,	**/
+/**	byte 256 being the end of the line. Once REGEX_CACHE_STATES exist	**/
+/**	they are all dropped and built again from there.			**/
+struct Regex_Dfa {
+	struct Regex_Program *program;
+	unsigned char (*sets)[32];
+	int unanchored;		/* a match can start at every byte */
+	int *next;
+	unsigned char *accept;
+	int *list_at;		/* the instructions of a state in lists */
+	int *list_len;
+	int count;
+	int cap;
+	int *lists;
+	int lists_len;
+	int lists_cap;
+	int table[REGEX_TABLE];	/* lists hashed to states, -1 when empty */
+	int start[3];		/* not at, at the start of a line, of an empty one */
+	int epoch;		/* flushes so far */
+	int *work;		/* the list being built */
+	int *stack;
+	int *seen;
+	int mark;
+};
+
+/**	A match Regex_Matches is following: where it starts, its state in	**/
+/**	the forward DFA, -1 once it can not grow, and its longest end yet.	**/
+struct Regex_Group {
+	int start;
+	int state;
+	int end;		/* -1 until it has matched */
+};
+
+/**	The DFAs a worker matches with, built for the regex of one scan,	**/
+/**	the bytes of a line that matches start at, last first, and the	**/
+/**	matches found in it.							**/
+struct Regex_Matcher {
+	struct Regex_Dfa forward;
+	struct Regex_Dfa reverse;
+	int *starts;
+	int start_count;
+	int starts_cap;
+	struct Regex_Group *groups;	/* [group_head, group_count), in order of start */
+	int group_head;
+	int group_count;
+	int groups_cap;
+	int alive[REGEX_GROUPS];	/* the groups that can still grow */
+	int alive_count;
+	int *kept;		/* group states across a flush, see Regex_Keep */
+	int kept_cap;
+	int *found;		/* start and end of each match */
+	int found_count;
+	int found_cap;
+	int generation;
+};
+
+/**	Every match of query, in buffer order. Stepping to the next or	**/
+/**	previous match moves along the array instead of scanning again.	**/
+/**	While the query grows, its matches are narrowed down from the last	**/
+/**	query's, or from the candidates of the last full scan, for base.	**/
+struct Search_Match {
+	int row;
+	int x;
+	int len;
+};
+
+/**	A scan runs on a pool of workers over a snapshot of the rows: runs	**/
+/**	of rows back to back in the mapping, or single rows, with the index	**/
+/**	of the first. Spans are grouped into blocks that a worker claims	**/
+/**	and fills with its own matches, read by the main thread once done.	**/
+struct Search_Span {
+	const char *data;
+	size_t len;
+	int row;
+};
+
+struct Search_Block {
+	int first;		/* spans[first, end) */
+	int end;
+	struct Search_Match *matches;
+	int count;
+	int cap;
+	int done;		/* atomic, set once matches is complete */
+};
+
+struct Search {
+	char *query;		/* NULL when there is no index */
+	int query_len;
+	int overlap;		/* copies of query can overlap */
+	struct Search_Match *matches;
+	int count;
+	int cap;
+	char *base;		/* query of the last full scan */
+	int base_len;
+	int base_overlap;
+	struct Search_Match *candidates;	/* matches of base */
+	int candidate_count;
+	int current;		/* the match shown, -1 when there is none */
+	int origin_row;		/* cursor when the prompt opened */
+	int origin_x;
+	struct Search_Span *spans;	/* NULL until the first scan of a prompt */
+	int span_count;
+	struct Search_Block *blocks;
+	int block_count;
+	int block_start;	/* the block of origin_row, claimed first */
+	int next_block;		/* atomic, claims counted from block_start */
+	int finished;		/* atomic, blocks done */
+	int reported;		/* finished when the status was last set */
+	struct Search_Match first;	/* shown while the scan runs */
+	int have_first;
+	int running;		/* a scan has not been collected yet */
+	int cancel;		/* atomic */
+	pthread_t *threads;
+	int thread_count;
+	pthread_mutex_t lock;	/* generation, busy, stop */
+	pthread_cond_t wake;
+	pthread_cond_t idle;	/* busy fell to 0, or the last block is done */
+	int generation;
+	int busy;		/* workers inside a scan */
+	int stop;
+	int regex_mode;		/* queries are regexes, kept across prompts */
+	struct Regex *regex;	/* the compiled query in regex_mode */
+	struct Regex_Matcher matcher;	/* for scans on the input thread */
 };
 
 struct Config {
@@ -85,14 +729,51 @@ struct Config {
 	int *current_col;
 	int *render_x;
 	int *dirty_flag;
+	int *syntax_valid;
+	int *hot_next;
+	int *undo_budget;
 	char *status_msg;
 	char *filename;
 	time_t status_time;
-	File_row *row;
+	struct Line_Node *lines;
+	struct Pool *row_pool;
+	struct Pool *text_pool;
+	struct Pool *render_pool;
+	struct Pool *hl_pool;
+	struct Pool *undo_pool;
+	struct Mapping *map;
+	File_row **hot_rows;
+	struct Screen *screen;
+	struct Input *input;
 	struct Syntax *syntax;
+	struct Save_Job *save;		/* NULL unless a save is running */
+	struct Journal *journal;	/* NULL when edits are not journaled */
+	struct Undo_History *undo;
+	struct Search *search;
+	struct Trace *trace;
+	struct Heap_Stat *heap;		/* HEAP_KIND_COUNT of them */
 	struct termios *orig;
 };
 
+/**	key_words compiled into a trie over the bytes that occur in them.	**/
+/**	next[node * width + class] is the child node, 0 when there is none.	**/
+struct Keyword_Trie {
+	int width;
+	int nodes;
+	unsigned char class_of[256];
+	int *next;
+	unsigned char *accept;
+};
+
+/**	Per byte CC_* classes, and the bytes that can change the comment	**/
+/**	state, which Syntax_Scan_State searches for instead of lexing.		**/
+struct Syntax_Tables {
+	unsigned char char_class[256];
+	char stops[4];
+	int stop_count;
+	int simd_ident;		/* [0-9A-Za-z_] and 8 bit bytes are all plain */
+};
+
 struct Syntax{
 	char *file_type;
 	char **file_match;
@@ -101,6 +782,8 @@ struct Syntax{
 	char *multi_line_comment_start;
 	char *multi_line_comment_end;
 	int flags;
+	struct Keyword_Trie *keyword_trie;	/* built by Select_Syntax_High_Light */
+	struct Syntax_Tables *tables;
 };
 
 /* FILE TYPES */
@@ -119,7 +802,8 @@ struct Syntax HLDB[] = {
 	C_HL_Extensions,
 	C_HL_Keywords,
 	"//","/*","*/",
-	HIGH_LIGHT_NUMBERS | HIGH_LIGHT_STRINGS
+	HIGH_LIGHT_NUMBERS | HIGH_LIGHT_STRINGS,
+	NULL, NULL
 	},
 };
 #define HLDB_ENTRIES ( sizeof(HLDB) / sizeof(HLDB[0]) )
@@ -152,10 +836,407 @@ void Check_Mem( void *mem, const char *string )
 	}
 }
 
+/* TRACE */
+long long Trace_Now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**	Closes a span of 'phase' that began at 'start', a Trace_Now() time.	**/
+void Trace_End( int phase, long long start )
+{
+	struct Trace_Frame *frame = &config->trace->frames[config->trace->next];
+	if(config->trace->idle){
+		return;
+	}
+	long long now = Trace_Now();
+	if(phase != TRACE_IDLE && (!frame->start || start < frame->start)){
+		frame->start = start;
+	}
+	frame->phase_ns[phase] += now - start;
+	if(frame->span_count < TRACE_SPANS){
+		struct Trace_Span *span = &frame->spans[frame->span_count++];
+		span->start = start;
+		span->end = now;
+		span->phase = phase;
+	}
+}
+
+void Trace_Count( int counter, long count )
+{
+	config->trace->frames[config->trace->next].counters[counter] += count;
+}
+
+void Trace_Key()
+{
+	struct Trace_Frame *frame = &config->trace->frames[config->trace->next];
+	if(!frame->key){
+		frame->key = Trace_Now();
+	}
+}
+
+/**	Called once the frame is written; starts recording the next one.	**/
+void Trace_Frame_End()
+{
+	struct Trace *trace = config->trace;
+	trace->frames[trace->next].end = Trace_Now();
+	trace->next = (trace->next + 1) % TRACE_FRAMES;
+	if(trace->count < TRACE_FRAMES){
+		trace->count++;
+	}
+	memset(&trace->frames[trace->next], 0, sizeof(struct Trace_Frame));
+}
+
+struct Trace_Frame *Trace_Frame_At( int age )
+{
+	struct Trace *trace = config->trace;
+	return &trace->frames[(trace->next - 1 - age + 2 * TRACE_FRAMES) % TRACE_FRAMES];
+}
+
+/**	The last frame and the slowest one still in the ring, in ms.		**/
+int Trace_Summary( char *out, int size )
+{
+	struct Trace *trace = config->trace;
+	if(!trace->count){
+		snprintf(out, size, "trace: no frames yet");
+		return strlen(out);
+	}
+	long long worst = 0;
+	int i = 0;
+	for(i = 0; i < trace->count; i++){
+		struct Trace_Frame *frame = Trace_Frame_At(i);
+		if(frame->end - frame->start > worst){
+			worst = frame->end - frame->start;
+		}
+	}
+	struct Trace_Frame *last = Trace_Frame_At(0);
+	int len = snprintf(out, size, "%.2fms (max %.2f) keys %.2f syn %.2f draw %.2f flush %.2f write %.2f | %ld lexed %ldB out %ld alloc %ld sys",
+			(last->end - last->start) / 1e6, worst / 1e6, last->phase_ns[TRACE_KEYS] / 1e6,
+			last->phase_ns[TRACE_SYNTAX] / 1e6, last->phase_ns[TRACE_DRAW] / 1e6,
+			last->phase_ns[TRACE_FLUSH] / 1e6, last->phase_ns[TRACE_WRITE] / 1e6,
+			last->counters[TRACE_ROWS_LEXED], last->counters[TRACE_BYTES_WRITTEN],
+			last->counters[TRACE_ALLOCS], last->counters[TRACE_SYSCALLS]);
+	return (len < size) ? len : size - 1;
+}
+
+/**	Writes the ring as Chrome trace events (chrome://tracing, Perfetto):	**/
+/**	a complete event per frame and per span, idle work on its own track,	**/
+/**	and the counters at the end of each frame. Returns the number of	**/
+/**	frames written, or -1 with errno set.					**/
+int Trace_Dump( const char *path )
+{
+	static const char *phases[TRACE_PHASE_COUNT] = { "keys", "idle", "syntax", "draw", "flush", "write" };
+	struct Trace *trace = config->trace;
+	FILE *fp = fopen(path, "w");
+	if(!fp){
+		return -1;
+	}
+	fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	fprintf(fp, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 2, \"args\": {\"name\": \"idle\"}}");
+	int i = 0, j = 0;
+	for(i = trace->count - 1; i >= 0; i--){
+		struct Trace_Frame *frame = Trace_Frame_At(i);
+		fprintf(fp, ",\n{\"name\": \"frame\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f}",
+			frame->start / 1e3, (frame->end - frame->start) / 1e3);
+		for(j = 0; j < frame->span_count; j++){
+			struct Trace_Span *span = &frame->spans[j];
+			fprintf(fp, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+				phases[span->phase], span->phase == TRACE_IDLE ? 2 : 1, span->start / 1e3, (span->end - span->start) / 1e3);
+		}
+		fprintf(fp, ",\n{\"name\": \"counters\", \"ph\": \"C\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"args\": "
+			"{\"rows_lexed\": %ld, \"bytes_rendered\": %ld, \"bytes_written\": %ld, \"allocs\": %ld, \"syscalls\": %ld}}",
+			frame->end / 1e3, frame->counters[TRACE_ROWS_LEXED], frame->counters[TRACE_BYTES_RENDERED],
+			frame->counters[TRACE_BYTES_WRITTEN], frame->counters[TRACE_ALLOCS], frame->counters[TRACE_SYSCALLS]);
+	}
+	fprintf(fp, "\n]}\n");
+	int error = ferror(fp) ? EIO : 0;
+	if(fclose(fp) == EOF && !error){
+		error = errno;
+	}
+	if(error){
+		errno = error;
+		return -1;
+	}
+	return trace->count;
+}
+
+void Trace_Dump_Prompt()
+{
+	char *path = Prompt("Dump trace to: %s (ESC to cancel)", NULL);
+	if(!path){
+		return;
+	}
+	int frames = Trace_Dump(path);
+	if(frames == -1){
+		Set_Status_Message("Trace dump failed: %s", strerror(errno));
+	}else{
+		Set_Status_Message("%d frames of trace written to %.40s", frames, path);
+	}
+	free_mem(path, "trace path");
+}
+
+/* HEAP ACCOUNTING */
+static const char *heap_names[HEAP_KIND_COUNT] = {
+	"other", "rows", "text", "render", "highlight", "undo", "search", "screen", "journal"
+};
+
+/**	Adds bytes (negative when freed) to kind, and allocs to its count.	**/
+void Heap_Count( int kind, long long bytes, int allocs )
+{
+	struct Heap_Stat *stat = &config->heap[kind];
+	long long live = __atomic_add_fetch(&stat->live, bytes, __ATOMIC_RELAXED);
+	if(allocs){
+		__atomic_add_fetch(&stat->count, allocs, __ATOMIC_RELAXED);
+	}
+	long long peak = __atomic_load_n(&stat->peak, __ATOMIC_RELAXED);
+	while(live > peak && !__atomic_compare_exchange_n(&stat->peak, &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+	}
+}
+
+/**	realloc that counts the block toward kind. Blocks from it must go	**/
+/**	back through Heap_Alloc or Heap_Free, never realloc or free.		**/
+void *Heap_Alloc( int kind, void *ptr, size_t size )
+{
+	struct Heap_Header *head = ptr ? (struct Heap_Header *)ptr - 1 : NULL;
+	long long old = head ? head->size : 0;
+	head = realloc(head, sizeof(struct Heap_Header) + size);
+	if(!head){
+		return NULL;
+	}
+	head->size = size;
+	head->kind = kind;
+	Heap_Count(kind, (long long)size - old, 1);
+	return head + 1;
+}
+
+void Heap_Free( void *ptr )
+{
+	if(!ptr){
+		return;
+	}
+	struct Heap_Header *head = (struct Heap_Header *)ptr - 1;
+	Heap_Count(head->kind, -head->size, 0);
+	free(head);
+}
+
+/**	Sizes like 12.3M for the status bar.				**/
+char *Heap_Size( char *out, long long bytes )
+{
+	if(bytes >= (1 << 20)){
+		sprintf(out, "%.1fM", bytes / 1048576.0);
+	}else if(bytes >= (1 << 10)){
+		sprintf(out, "%.1fK", bytes / 1024.0);
+	}else{
+		sprintf(out, "%lldB", bytes);
+	}
+	return out;
+}
+
+/**	The total, then live/peak of each kind that has had any.	**/
+int Heap_Summary( char *out, int size )
+{
+	char live[16], peak[16];
+	long long total = 0;
+	int i = 0;
+	for(i = 0; i < HEAP_KIND_COUNT; i++){
+		total += __atomic_load_n(&config->heap[i].live, __ATOMIC_RELAXED);
+	}
+	int len = snprintf(out, size, "heap %s", Heap_Size(live, total));
+	for(i = 0; i < HEAP_KIND_COUNT && len < size; i++){
+		struct Heap_Stat *stat = &config->heap[i];
+		if(__atomic_load_n(&stat->peak, __ATOMIC_RELAXED)){
+			len += snprintf(&out[len], size - len, " | %s %s/%s", heap_names[i],
+					Heap_Size(live, __atomic_load_n(&stat->live, __ATOMIC_RELAXED)),
+					Heap_Size(peak, __atomic_load_n(&stat->peak, __ATOMIC_RELAXED)));
+		}
+	}
+	return (len < size) ? len : size - 1;
+}
+
+void Heap_Report( FILE *fp )
+{
+	long long total = 0;
+	int i = 0;
+	fprintf(fp, "%-10s %14s %14s %12s\n", "heap", "live bytes", "peak bytes", "allocs");
+	for(i = 0; i < HEAP_KIND_COUNT; i++){
+		struct Heap_Stat *stat = &config->heap[i];
+		long long live = __atomic_load_n(&stat->live, __ATOMIC_RELAXED);
+		fprintf(fp, "%-10s %14lld %14lld %12lld\n", heap_names[i], live,
+			__atomic_load_n(&stat->peak, __ATOMIC_RELAXED), __atomic_load_n(&stat->count, __ATOMIC_RELAXED));
+		total += live;
+	}
+	fprintf(fp, "%-10s %14lld\n", "total", total);
+}
+
+/**	With TEDIT_HEAP_REPORT set, appends the report to the file it names,	**/
+/**	or writes it to stderr for "-".					**/
+void Heap_Report_Exit()
+{
+	const char *path = getenv("TEDIT_HEAP_REPORT");
+	if(!path || !*path){
+		return;
+	}
+	FILE *fp = strcmp(path, "-") ? fopen(path, "a") : stderr;
+	if(!fp){
+		return;
+	}
+	Heap_Report(fp);
+	if(fp != stderr){
+		fclose(fp);
+	}
+}
+
+/* MEMORY POOLS */
+struct Pool *Pool_New( int kind )
+{
+	struct Pool *pool = calloc(1, sizeof(struct Pool));
+	Check_Mem(pool,"Pool");
+	pool->kind = kind;
+	return pool;
+}
+
+/**	16 byte steps up to POOL_SMALL_MAX, then four classes per power of two,	**/
+/**	so a block never wastes more than a quarter of its size.		**/
+int Pool_Class( int size, int *block )
+{
+	if(size <= POOL_ALIGN){
+		*block = POOL_ALIGN;
+		return 0;
+	}
+	if(size <= POOL_SMALL_MAX){
+		int class = (size - 1) / POOL_ALIGN;
+		*block = (class + 1) * POOL_ALIGN;
+		return class;
+	}
+	int shift = 9;
+	while((2 << shift) < size){
+		shift++;
+	}
+	int step = 1 << (shift - 2);
+	int quarter = (size - 1 - (1 << shift)) / step;
+	*block = (1 << shift) + (quarter + 1) * step;
+	return POOL_SMALL_MAX / POOL_ALIGN + (shift - 9) * 4 + quarter;
+}
+
+/**	Returns a block of at least 'size' bytes, the usable size goes to *cap.	**/
+void *Pool_Alloc( struct Pool *pool, int size, int *cap )
+{
+	Trace_Count(TRACE_ALLOCS, 1);
+	if(size > (1 << POOL_MAX_SHIFT)){
+		struct Pool_Large *large = malloc(sizeof(struct Pool_Large) + size);
+		Check_Mem(large,"Pool_Large");
+		large->prev = NULL;
+		large->next = pool->large;
+		if(pool->large){
+			pool->large->prev = large;
+		}
+		pool->large = large;
+		*cap = size;
+		pool->live += size;
+		Heap_Count(pool->kind, size, 1);
+		return large + 1;
+	}
+
+	int block = 0;
+	int class = Pool_Class(size, &block);
+	*cap = block;
+	pool->live += block;
+	Heap_Count(pool->kind, block, 1);
+	if(pool->free_list[class]){
+		void *ptr = pool->free_list[class];
+		pool->free_list[class] = *(void **)ptr;
+		return ptr;
+	}
+
+	struct Pool_Chunk *chunk = pool->chunks;
+	if(!chunk || chunk->used + block > chunk->size){
+		chunk = malloc(sizeof(struct Pool_Chunk) + POOL_CHUNK_SIZE);
+		Check_Mem(chunk,"Pool_Chunk");
+		chunk->used = 0;
+		chunk->size = POOL_CHUNK_SIZE;
+		chunk->next = pool->chunks;
+		pool->chunks = chunk;
+	}
+	void *ptr = &chunk->data[chunk->used];
+	chunk->used += block;
+	return ptr;
+}
+
+void Pool_Free( struct Pool *pool, void *ptr, int cap )
+{
+	if(!ptr){
+		return;
+	}
+	if(cap > (1 << POOL_MAX_SHIFT)){
+		struct Pool_Large *large = (struct Pool_Large *)ptr - 1;
+		if(large->prev){
+			large->prev->next = large->next;
+		}else{
+			pool->large = large->next;
+		}
+		if(large->next){
+			large->next->prev = large->prev;
+		}
+		free_mem(large,"Pool_Large");
+		pool->live -= cap;
+		Heap_Count(pool->kind, -cap, 0);
+		return;
+	}
+	int block = 0;
+	int class = Pool_Class(cap, &block);
+	pool->live -= block;
+	Heap_Count(pool->kind, -block, 0);
+	*(void **)ptr = pool->free_list[class];
+	pool->free_list[class] = ptr;
+}
+
+/**	Makes room for 'need' bytes, keeping the first 'used' bytes.		**/
+void *Pool_Grow( struct Pool *pool, void *ptr, int *cap, int used, int need )
+{
+	if(ptr && need <= *cap){
+		return ptr;
+	}
+	int new_cap = 0;
+	if(ptr && need < *cap + *cap / 2){
+		need = *cap + *cap / 2;		/* rows being edited grow geometrically */
+	}else if(need > (1 << POOL_MAX_SHIFT)){
+		need += need / 2;
+	}
+	void *grown = Pool_Alloc(pool, need, &new_cap);
+	if(ptr){
+		memcpy(grown, ptr, used);
+		Pool_Free(pool, ptr, *cap);
+	}
+	*cap = new_cap;
+	return grown;
+}
+
+void Pool_Release( struct Pool *pool )
+{
+	while(pool->chunks){
+		struct Pool_Chunk *next = pool->chunks->next;
+		free_mem(pool->chunks,"Pool_Chunk");
+		pool->chunks = next;
+	}
+	while(pool->large){
+		struct Pool_Large *next = pool->large->next;
+		free_mem(pool->large,"Pool_Large");
+		pool->large = next;
+	}
+	memset(pool->free_list, 0, sizeof(pool->free_list));
+	Heap_Count(pool->kind, -pool->live, 0);
+	pool->live = 0;
+}
+
 void Alloc_Config()
 {
 	config = malloc(sizeof(struct Config));	
 	Check_Mem(config,"config");
+
+	config->heap = calloc(HEAP_KIND_COUNT, sizeof(struct Heap_Stat));
+	Check_Mem(config->heap,"config->heap");
 		
 	config->orig = malloc(sizeof(struct termios));
 	Check_Mem(config->orig,"config->orig");	
@@ -189,49 +1270,112 @@ void Alloc_Config()
 	
 	config->dirty_flag = malloc(sizeof(int));
 	Check_Mem(config->dirty_flag, "config->dirty_flag");
+
+	config->syntax_valid = malloc(sizeof(int));
+	Check_Mem(config->syntax_valid, "config->syntax_valid");
+
+	config->hot_next = malloc(sizeof(int));
+	Check_Mem(config->hot_next, "config->hot_next");
+
+	config->undo_budget = malloc(sizeof(int));
+	Check_Mem(config->undo_budget, "config->undo_budget");
+
+	config->undo = calloc(1, sizeof(struct Undo_History));
+	Check_Mem(config->undo, "config->undo");
+
+	config->search = calloc(1, sizeof(struct Search));
+	Check_Mem(config->search, "config->search");
+	pthread_mutex_init(&config->search->lock, NULL);
+	pthread_cond_init(&config->search->wake, NULL);
+	pthread_cond_init(&config->search->idle, NULL);
+
+	config->hot_rows = calloc(HOT_ROWS, sizeof(File_row *));
+	Check_Mem(config->hot_rows, "config->hot_rows");
+
+	config->row_pool = Pool_New(HEAP_ROWS);
+	config->text_pool = Pool_New(HEAP_TEXT);
+	config->render_pool = Pool_New(HEAP_RENDER);
+	config->hl_pool = Pool_New(HEAP_HIGHLIGHT);
+	config->undo_pool = Pool_New(HEAP_UNDO);
+
+	config->screen = calloc(1, sizeof(struct Screen));
+	Check_Mem(config->screen, "config->screen");
+	config->screen->frame.kind = HEAP_SCREEN;
+
+	config->input = calloc(1, sizeof(struct Input));
+	Check_Mem(config->input, "config->input");
+
+	config->trace = calloc(1, sizeof(struct Trace));
+	Check_Mem(config->trace, "config->trace");
 	
 	/**	config->filename allocated using a strdup in Open_file()	**/
-	/**	config->row is allocates in Insert_Row				**/
+	/**	config->lines is allocated in Insert_Row			**/
 }
 
 void Free_Rows()
 {
-	int index = *config->num_of_rows;
-	while (index--){
-		if(config->row[index].hl_open_comment){
-			free_mem(config->row[index].hl_open_comment, "config->row.hl_open_comment");
-		}
-		if(config->row[index].idx){
-			free_mem(config->row[index].idx, "config->row.idx");
-		}
-		if(config->row[index].high_lighted){
-			free_mem(config->row[index].high_lighted, "config->row.high_lighted");
-		}
-		if(config->row[index].render){
-			free_mem(config->row[index].render,"config->row.render");
-		}
-		if(config->row[index].render_size){
-			free_mem(config->row[index].render_size,"config->row->render.size");
-		}
-		if(config->row[index].string){
-			free_mem(config->row[index].string,"config->row->string");
-		}
-		if(config->row[index].size){
-			free_mem(config->row[index].size,"config->row.size");
-		}
+	struct Row_Iter iter;
+	File_row *row;
+	Save_Poll(1);
+	Undo_Clear();
+	Search_Clear();
+	for(row = Row_Iter_Seek(&iter, 0); row; row = Row_Iter_Next(&iter)){
+		Row_Chunks_Free(row);		/* malloced, the pools do not own them */
 	}
-	if(config->row){
-		free_mem(config->row,"config->row");
+	Pool_Release(config->hl_pool);
+	Pool_Release(config->undo_pool);
+	Pool_Release(config->render_pool);
+	Pool_Release(config->text_pool);
+	Pool_Release(config->row_pool);
+	memset(config->hot_rows, 0, sizeof(File_row *) * HOT_ROWS);
+	if(config->lines){
+		Line_Tree_Free(config->lines);
+		config->lines = NULL;
+	}
+	if(config->map){
+		munmap(config->map->data, config->map->length);
+		free_mem(config->map,"config->map");
+		config->map = NULL;
 	}
 }
 
 void Disable_Raw_Mode()
 {
+	unsigned int j = 0;
+	if(write(STDOUT,"\x1b[?2004l",8) == -1){
+		die("Disable_Raw_mode paste");
+	}
 	if(tcsetattr(STDIN,TCSAFLUSH,config->orig) == -1){
 		die("Disable_Raw_mode");
 	}
-	Free_Rows();		
+	Heap_Report_Exit();
+	Free_Rows();
+	Journal_Close(0);		/* kept for recovery unless quit cleared it */		
 
+	free_mem(config->hl_pool,"hl_pool");
+	free_mem(config->undo_pool,"undo_pool");
+	free_mem(config->render_pool,"render_pool");
+	free_mem(config->text_pool,"text_pool");
+	free_mem(config->row_pool,"row_pool");
+	free_mem(config->hot_rows,"hot_rows");
+	Screen_Resize(config->screen, 0, 0);
+	free_mem(config->screen,"screen");
+	Free_Buffer(&config->input->paste);
+	free_mem(config->input,"input");
+	free_mem(config->trace,"trace");
+	free_mem(config->hot_next,"hot_next");
+	free_mem(config->undo_budget,"undo_budget");
+	free_mem(config->undo,"undo");
+	Search_Pool_Stop();
+	free_mem(config->search,"search");
+	free_mem(config->syntax_valid,"syntax_valid");
+	for(j = 0; j < HLDB_ENTRIES; j++){
+		Keyword_Free(&HLDB[j]);
+		if(HLDB[j].tables){
+			free_mem(HLDB[j].tables,"syntax->tables");
+			HLDB[j].tables = NULL;
+		}
+	}
 	if(config->dirty_flag){
 		free_mem(config->dirty_flag, "dirty_flag");
 	}
@@ -268,6 +1412,7 @@ void Disable_Raw_Mode()
 	if(config->orig){
 		free_mem(config->orig,"orig");
 	}
+	free_mem(config->heap,"heap");
 	if(config){
 		free_mem(config,"config");
 	}
@@ -293,52 +1438,171 @@ void Enable_Raw_Mode()
 	raw->c_cflag |= ~(CS8);
 	raw->c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);				
 	raw->c_cc[VMIN] = 0;
-	raw->c_cc[VTIME] = 1;
+	raw->c_cc[VTIME] = 0;		/* Input_Fill polls before it reads */
 
 	if(tcsetattr(STDIN,TCSAFLUSH, raw) == -1)
 	{
 		die("Enable_Raw_Mode set");
 	}
+	if(write(STDOUT,"\x1b[?2004h",8) == -1){		/* bracketed paste */
+		die("Enable_Raw_Mode paste");
+	}
 }
 
-int Read_Key()
+/**	Waits up to timeout ms (-1 for ever) for the tty to be readable and	**/
+/**	reads everything it has that fits. Returns the number of bytes read.	**/
+int Input_Fill( int timeout )
 {
-	int check = 0;
-	char key_press = '\0';
-	while((check = read(STDIN,&key_press,1))!= 1){
-		if(check == -1 && errno != EAGAIN){
-			printf("Read");
-		}
+	struct Input *input = config->input;
+	if(input->start == input->end){
+		input->start = input->end = 0;
+	}else if(input->end == INPUT_BUFFER){
+		memmove(input->data, &input->data[input->start], input->end - input->start);
+		input->end -= input->start;
+		input->start = 0;
 	}
-	if(key_press == '\x1b'){
-		char seq[3];
-		if(read(STDIN,&seq[0],1)!= 1){
+
+	struct pollfd pfd = { STDIN, POLLIN, 0 };
+	int ready = poll(&pfd, 1, timeout);
+	Trace_Count(TRACE_SYSCALLS, 1);
+	if(ready == -1 && errno != EINTR){
+		die("Input_Fill poll");
+	}
+	if(ready <= 0){
+		return 0;
+	}
+	ssize_t n = read(STDIN, &input->data[input->end], INPUT_BUFFER - input->end);
+	Trace_Count(TRACE_SYSCALLS, 1);
+	if(n == -1 && (errno == EAGAIN || errno == EINTR)){
+		return 0;
+	}
+	if(n <= 0){
+		die("Input_Fill read");
+	}
+	input->end += n;
+	return n;
+}
+
+int Input_Pending()
+{
+	return config->input->start < config->input->end;
+}
+
+/**	Next input byte, or -1 if none arrives within timeout ms.		**/
+int Input_Byte( int timeout )
+{
+	struct Input *input = config->input;
+	while(input->start == input->end){
+		if(!Input_Fill(timeout) && timeout != -1){
+			return -1;
+		}
+	}
+	return (unsigned char)input->data[input->start++];
+}
+
+/**	Collects the text of a bracketed paste, up to the closing		**/
+/**	\x1b[201~, into config->input->paste a buffered run at a time.	**/
+void Read_Paste()
+{
+	struct Input *input = config->input;
+	struct Buffer *paste = &input->paste;
+	paste->length = 0;
+	while(1){
+		if(input->start == input->end){
+			Input_Fill(-1);
+			continue;
+		}
+		char *from = &input->data[input->start];
+		char *esc = memchr(from, '\x1b', input->end - input->start);
+		if(esc == NULL){
+			Append_Buffer(paste, from, input->end - input->start);
+			input->start = input->end;
+			continue;
+		}
+		Append_Buffer(paste, from, esc - from);
+		input->start += esc - from;
+		while(input->end - input->start < 6 && Input_Fill(INPUT_ESC_WAIT)){
+		}
+		if(input->end - input->start >= 6 && !memcmp(&input->data[input->start], "\x1b[201~", 6)){
+			input->start += 6;
+			return;
+		}
+		Append_Buffer(paste, &input->data[input->start++], 1);
+	}
+}
+
+int Key_Waiting()
+{
+	struct pollfd pfd = { STDIN, POLLIN, 0 };
+	if(Input_Pending()){
+		return 1;
+	}
+	Trace_Count(TRACE_SYSCALLS, 1);
+	return poll(&pfd, 1, 0) > 0;
+}
+
+int Read_Key()
+{
+	int key_press = 0;
+	while((Map_Pending() || Syntax_Pending() || Save_Pending() || Search_Pending()) && !Key_Waiting()){
+		if(Save_Poll(0)){
+			Refresh_Screen();
+		}
+		if(Search_Poll(0)){
+			Refresh_Screen();
+		}
+		long long trace = Trace_Now();
+		if(Map_Pending()){
+			config->trace->idle = 1;
+			Map_Index_Lines(MAP_IDLE_LINES);
+			config->trace->idle = 0;
+			Trace_End(TRACE_IDLE, trace);
+		}else if(Syntax_Pending()){
+			config->trace->idle = 1;
+			Syntax_Validate(*config->syntax_valid + SYNTAX_IDLE_ROWS);
+			config->trace->idle = 0;
+			Trace_End(TRACE_IDLE, trace);
+		}else if(Save_Pending() || Search_Pending()){
+			struct pollfd pfd = { STDIN, POLLIN, 0 };
+			poll(&pfd, 1, Search_Pending() ? SEARCH_TICK : SAVE_TICK);
+			Trace_Count(TRACE_SYSCALLS, 1);
+		}
+	}
+	key_press = Input_Byte(-1);
+	Trace_Key();
+	if(key_press == '\x1b'){
+		int seq[3];
+		if((seq[0] = Input_Byte(INPUT_ESC_WAIT)) == -1){
 			return '\x1b';		
 		}
-		if(read(STDIN,&seq[1],1)!= 1){
+		if((seq[1] = Input_Byte(INPUT_ESC_WAIT)) == -1){
 			return '\x1b';		
 		}
 		if(seq[0] == '['){
 			if(seq[1] >= '0' && seq[1] <= '9'){
-				if(read(STDIN,&seq[2],1) != 1){
-					return '\x1b';				
+				int number = seq[1] - '0';
+				while((seq[2] = Input_Byte(INPUT_ESC_WAIT)) >= '0' && seq[2] <= '9'){
+					number = number * 10 + seq[2] - '0';
 				}
 				if(seq[2] == '~'){
-					switch(seq[1]){
-						case '1':
+					switch(number){
+						case 1:
 							return HOME_KEY;
-						case '3':
+						case 3:
 							return DEL_KEY;
-						case '4':
+						case 4:
 							return END_KEY;
-						case '5':
+						case 5:
 							return PAGE_UP;
-						case '6':
+						case 6:
 							return PAGE_DOWN;
-						case '7':
+						case 7:
 							return HOME_KEY;
-						case '8':
+						case 8:
 							return END_KEY;
+						case 200:
+							Read_Paste();
+							return PASTE_KEY;
 					}
 				}		
 			}else{
@@ -418,21 +1682,594 @@ int Get_Win_Size( int *cols, int *rows )
 	return 0;
 }
 
+/* LINE TREE */
+struct Line_Node *Line_Node_New( int leaf )
+{
+	struct Line_Node *node = calloc(1, sizeof(struct Line_Node));
+	Check_Mem(node,"Line_Node");
+	node->leaf = leaf;
+	return node;
+}
+
+void Line_Tree_Free( struct Line_Node *node )
+{
+	int i = 0;
+	if(!node->leaf){
+		for(i = 0; i < node->count; i++){
+			Line_Tree_Free(node->child[i]);
+		}
+	}
+	free_mem(node,"Line_Node");
+}
+
+int Line_Node_Slot( struct Line_Node *parent, struct Line_Node *node )
+{
+	int i = 0;
+	while(parent->child[i] != node){
+		i++;
+	}
+	return i;
+}
+
+/**	Walks down to the leaf holding row 'index', leaving the offset	**/
+/**	inside that leaf in *slot.					**/
+struct Line_Node *Line_Tree_Find( int index, int *slot )
+{
+	struct Line_Node *node = config->lines;
+	while(!node->leaf){
+		int i = 0;
+		while(i < node->count - 1 && index >= node->child[i]->line_count){
+			index -= node->child[i]->line_count;
+			i++;
+		}
+		node = node->child[i];
+	}
+	*slot = index;
+	return node;
+}
+
+File_row *Row_At( int index )
+{
+	int slot = 0;
+	if(!config->lines || index < 0 || index >= config->lines->line_count){
+		return NULL;
+	}
+	struct Line_Node *leaf = Line_Tree_Find(index, &slot);
+	return leaf->row[slot];
+}
+
+int Row_Index( File_row *row )
+{
+	struct Line_Node *node = row->leaf;
+	int index = 0;
+	while(node->row[index] != row){
+		index++;
+	}
+	while(node->parent){
+		struct Line_Node *parent = node->parent;
+		int i = 0;
+		for(i = 0; parent->child[i] != node; i++){
+			index += parent->child[i]->line_count;
+		}
+		node = parent;
+	}
+	return index;
+}
+
+File_row *Row_Iter_Seek( struct Row_Iter *iter, int index )
+{
+	if(!config->lines || index < 0 || index >= config->lines->line_count){
+		iter->leaf = NULL;
+		return NULL;
+	}
+	iter->leaf = Line_Tree_Find(index, &iter->slot);
+	return iter->leaf->row[iter->slot];
+}
+
+File_row *Row_Iter_Next( struct Row_Iter *iter )
+{
+	if(!iter->leaf){
+		return NULL;
+	}
+	if(++iter->slot >= iter->leaf->count){
+		iter->leaf = iter->leaf->next;
+		iter->slot = 0;
+		if(!iter->leaf){
+			return NULL;
+		}
+	}
+	return iter->leaf->row[iter->slot];
+}
+
+File_row *Row_Iter_Prev( struct Row_Iter *iter )
+{
+	if(!iter->leaf){
+		return NULL;
+	}
+	if(--iter->slot < 0){
+		iter->leaf = iter->leaf->prev;
+		if(!iter->leaf){
+			return NULL;
+		}
+		iter->slot = iter->leaf->count - 1;
+	}
+	return iter->leaf->row[iter->slot];
+}
+
+/**	Moves iter on to row 'to' at or after *index, the row it is at, -1	**/
+/**	when it is not on any yet. Rows close ahead are stepped to.		**/
+File_row *Row_Iter_Reach( struct Row_Iter *iter, int *index, int to )
+{
+	File_row *row = NULL;
+	if(*index < 0 || to - *index >= LINE_NODE_MAX){
+		*index = to;
+		return Row_Iter_Seek(iter, to);
+	}
+	row = iter->leaf ? iter->leaf->row[iter->slot] : NULL;
+	while(*index < to){
+		row = Row_Iter_Next(iter);
+		(*index)++;
+	}
+	return row;
+}
+
+void Line_Node_Insert_Child( struct Line_Node *parent, int pos, struct Line_Node *child )
+{
+	memmove(&parent->child[pos + 1], &parent->child[pos], sizeof(struct Line_Node *) * (parent->count - pos));
+	parent->child[pos] = child;
+	parent->count++;
+	child->parent = parent;
+}
+
+void Line_Node_Split( struct Line_Node *node )
+{
+	int half = node->count / 2;
+	int i = 0;
+	struct Line_Node *sibling = Line_Node_New(node->leaf);
+
+	sibling->count = node->count - half;
+	memcpy(sibling->child, &node->child[half], sizeof(struct Line_Node *) * sibling->count);
+	node->count = half;
+
+	for(i = 0; i < sibling->count; i++){
+		if(sibling->leaf){
+			sibling->row[i]->leaf = sibling;
+			sibling->line_count++;
+		}else{
+			sibling->child[i]->parent = sibling;
+			sibling->line_count += sibling->child[i]->line_count;
+		}
+	}
+	node->line_count -= sibling->line_count;
+
+	if(node->leaf){
+		sibling->next = node->next;
+		sibling->prev = node;
+		if(node->next){
+			node->next->prev = sibling;
+		}
+		node->next = sibling;
+	}
+
+	if(!node->parent){
+		struct Line_Node *root = Line_Node_New(0);
+		root->line_count = node->line_count + sibling->line_count;
+		Line_Node_Insert_Child(root, 0, node);
+		config->lines = root;
+	}
+	struct Line_Node *parent = node->parent;
+	Line_Node_Insert_Child(parent, Line_Node_Slot(parent, node) + 1, sibling);
+	if(parent->count == LINE_NODE_MAX){
+		Line_Node_Split(parent);
+	}
+}
+
+void Line_Tree_Insert( int index, File_row *row )
+{
+	if(!config->lines){
+		config->lines = Line_Node_New(1);
+	}
+	struct Line_Node *node = config->lines;
+	while(!node->leaf){
+		int i = 0;
+		while(i < node->count - 1 && index > node->child[i]->line_count){
+			index -= node->child[i]->line_count;
+			i++;
+		}
+		node->line_count++;
+		node = node->child[i];
+	}
+	memmove(&node->row[index + 1], &node->row[index], sizeof(File_row *) * (node->count - index));
+	node->row[index] = row;
+	node->count++;
+	node->line_count++;
+	row->leaf = node;
+	if(node->count == LINE_NODE_MAX){
+		Line_Node_Split(node);
+	}
+}
+
+void Line_Node_Unlink( struct Line_Node *node )
+{
+	struct Line_Node *parent = node->parent;
+	int pos = Line_Node_Slot(parent, node);
+	memmove(&parent->child[pos], &parent->child[pos + 1], sizeof(struct Line_Node *) * (parent->count - pos - 1));
+	parent->count--;
+	if(node->leaf){
+		if(node->prev){
+			node->prev->next = node->next;
+		}
+		if(node->next){
+			node->next->prev = node->prev;
+		}
+	}
+	free_mem(node,"Line_Node");
+}
+
+/**	Folds underfull nodes into a neighbour and collapses the root, so	**/
+/**	the depth stays logarithmic as rows are deleted.			**/
+void Line_Node_Rebalance( struct Line_Node *node )
+{
+	while(node->parent){
+		struct Line_Node *parent = node->parent;
+		if(node->count == 0){
+			Line_Node_Unlink(node);
+			node = parent;
+			continue;
+		}
+		if(node->count >= LINE_NODE_MAX / 4){
+			break;
+		}
+		int pos = Line_Node_Slot(parent, node);
+		struct Line_Node *left = pos > 0 ? parent->child[pos - 1] : node;
+		struct Line_Node *right = pos > 0 ? node : (pos + 1 < parent->count ? parent->child[pos + 1] : NULL);
+		if(!right || left->count + right->count >= LINE_NODE_MAX){
+			break;
+		}
+		int i = 0;
+		for(i = 0; i < right->count; i++){
+			if(right->leaf){
+				right->row[i]->leaf = left;
+			}else{
+				right->child[i]->parent = left;
+			}
+		}
+		memcpy(&left->child[left->count], right->child, sizeof(struct Line_Node *) * right->count);
+		left->count += right->count;
+		left->line_count += right->line_count;
+		Line_Node_Unlink(right);
+		node = parent;
+	}
+	if(!config->lines->leaf && config->lines->count == 0){
+		config->lines->leaf = 1;
+	}
+	while(!config->lines->leaf && config->lines->count == 1){
+		struct Line_Node *root = config->lines;
+		config->lines = root->child[0];
+		config->lines->parent = NULL;
+		free_mem(root,"Line_Node");
+	}
+}
+
+File_row *Line_Tree_Remove( int index )
+{
+	int slot = 0;
+	struct Line_Node *leaf = Line_Tree_Find(index, &slot);
+	File_row *row = leaf->row[slot];
+	struct Line_Node *node = leaf;
+
+	memmove(&leaf->row[slot], &leaf->row[slot + 1], sizeof(File_row *) * (leaf->count - slot - 1));
+	leaf->count--;
+	while(node){
+		node->line_count--;
+		node = node->parent;
+	}
+	Line_Node_Rebalance(leaf);
+	return row;
+}
+
+/**	Replaces the tree with one over rows[0, count), built bottom up with	**/
+/**	nodes three quarters full so the next inserts do not split at once.	**/
+void Line_Tree_Build( File_row **rows, int count )
+{
+	int fill = LINE_NODE_MAX * 3 / 4;
+	int n = (count + fill - 1) / fill;
+	int i = 0, j = 0;
+	if(config->lines){
+		Line_Tree_Free(config->lines);
+	}
+	if(n == 0){
+		config->lines = Line_Node_New(1);
+		return;
+	}
+	struct Line_Node **level = malloc(sizeof(struct Line_Node *) * n);
+	Check_Mem(level,"Line_Tree_Build");
+	for(i = 0; i < n; i++){
+		struct Line_Node *leaf = Line_Node_New(1);
+		int from = (long long)i * count / n;
+		int to = (long long)(i + 1) * count / n;
+		for(j = from; j < to; j++){
+			leaf->row[j - from] = rows[j];
+			rows[j]->leaf = leaf;
+		}
+		leaf->count = leaf->line_count = to - from;
+		if(i > 0){
+			leaf->prev = level[i - 1];
+			level[i - 1]->next = leaf;
+		}
+		level[i] = leaf;
+	}
+	while(n > 1){
+		int parents = (n + fill - 1) / fill;
+		for(i = 0; i < parents; i++){
+			struct Line_Node *node = Line_Node_New(0);
+			int from = (long long)i * n / parents;
+			int to = (long long)(i + 1) * n / parents;
+			for(j = from; j < to; j++){
+				Line_Node_Insert_Child(node, j - from, level[j]);
+				node->line_count += level[j]->line_count;
+			}
+			level[i] = node;
+		}
+		n = parents;
+	}
+	config->lines = level[0];
+	free_mem(level,"Line_Tree_Build");
+}
+
+/**	Every row in order, into a new array with 'extra' spare slots.	**/
+File_row **Line_Tree_Rows( int extra )
+{
+	int total = config->lines ? config->lines->line_count : 0;
+	File_row **rows = malloc(sizeof(File_row *) * (total + extra + 1));
+	Check_Mem(rows,"Line_Tree_Rows");
+	struct Row_Iter iter;
+	File_row *row = Row_Iter_Seek(&iter, 0);
+	int i = 0;
+	for(; row; row = Row_Iter_Next(&iter)){
+		rows[i++] = row;
+	}
+	return rows;
+}
+
+/**	A run long next to the tree is linked in by rebuilding, O(rows),	**/
+/**	rather than one insert per row.						**/
+void Line_Tree_Insert_Run( int index, File_row **rows, int count )
+{
+	int total = config->lines ? config->lines->line_count : 0;
+	int i = 0;
+	if(count < LINE_NODE_MAX || count < total / 8){
+		for(i = 0; i < count; i++){
+			Line_Tree_Insert(index + i, rows[i]);
+		}
+		return;
+	}
+	File_row **all = Line_Tree_Rows(count);
+	memmove(&all[index + count], &all[index], sizeof(File_row *) * (total - index));
+	memcpy(&all[index], rows, sizeof(File_row *) * count);
+	Line_Tree_Build(all, total + count);
+	free_mem(all,"Line_Tree_Rows");
+}
+
+void Line_Tree_Remove_Run( int index, int count, File_row **rows )
+{
+	int total = config->lines->line_count;
+	int i = 0;
+	if(count < LINE_NODE_MAX || count < total / 8){
+		for(i = 0; i < count; i++){
+			rows[i] = Line_Tree_Remove(index);
+		}
+		return;
+	}
+	File_row **all = Line_Tree_Rows(0);
+	memcpy(rows, &all[index], sizeof(File_row *) * count);
+	memmove(&all[index], &all[index + count], sizeof(File_row *) * (total - index - count));
+	Line_Tree_Build(all, total - count);
+	free_mem(all,"Line_Tree_Rows");
+}
+
 /* SYNTAX HIGHLIGHTING */
 int Is_Seperator( int c )
 {
 	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];",c) != NULL;
 }
 
-void Update_Syntax( File_row *row ) /*TODO Break this up into smaller functions.*/
+void Keyword_Compile( struct Syntax *syntax )
 {
-	row->high_lighted = realloc(row->high_lighted, *row->render_size);	
-	memset(row->high_lighted, HL_NORMAL, *row->render_size);		
+	struct Keyword_Trie *trie = calloc(1, sizeof(struct Keyword_Trie));
+	Check_Mem(trie,"keyword_trie");
+	char **keywords = syntax->key_words;
+	int max_nodes = 1;
+	int j = 0, k = 0;
 
-	if(config->syntax == NULL){						
+	trie->width = 1;
+	for(j = 0; keywords[j]; j++){
+		int klen = strlen(keywords[j]);
+		for(k = 0; k < klen; k++){
+			unsigned char c = keywords[j][k];
+			if(c == '|' && k == klen - 1){
+				break;
+			}
+			if(!trie->class_of[c]){
+				trie->class_of[c] = trie->width++;
+			}
+		}
+		max_nodes += klen;
+	}
+
+	trie->next = calloc(max_nodes * trie->width, sizeof(int));
+	trie->accept = calloc(max_nodes, 1);
+	Check_Mem(trie->next,"keyword_trie->next");
+	Check_Mem(trie->accept,"keyword_trie->accept");
+	trie->nodes = 1;
+
+	for(j = 0; keywords[j]; j++){
+		int klen = strlen(keywords[j]);
+		int kw2 = keywords[j][klen - 1] == '|';
+		int node = 0;
+		if(kw2){
+			klen--;
+		}
+		for(k = 0; k < klen; k++){
+			int *slot = &trie->next[node * trie->width + trie->class_of[(unsigned char)keywords[j][k]]];
+			if(!*slot){
+				*slot = trie->nodes++;
+			}
+			node = *slot;
+		}
+		if(node && !trie->accept[node]){		/* first listing of a keyword wins */
+			trie->accept[node] = kw2 ? HL_KEYWORD_2 : HL_KEYWORD_1;
+		}
+	}
+	syntax->keyword_trie = trie;
+}
+
+void Keyword_Free( struct Syntax *syntax )
+{
+	struct Keyword_Trie *trie = syntax->keyword_trie;
+	if(!trie){
 		return;
 	}
-	char **keywords = config->syntax->key_words;				
+	free_mem(trie->next,"keyword_trie->next");
+	free_mem(trie->accept,"keyword_trie->accept");
+	free_mem(trie,"keyword_trie");
+	syntax->keyword_trie = NULL;
+}
+
+void Syntax_Tables_Compile( struct Syntax *syntax )
+{
+	struct Syntax_Tables *tables = calloc(1, sizeof(struct Syntax_Tables));
+	Check_Mem(tables,"syntax->tables");
+	unsigned char *cls = tables->char_class;
+	char *scs = syntax->single_line_comment_start;
+	char *mlcs = syntax->multi_line_comment_start;
+	char *mlce = syntax->multi_line_comment_end;
+	int c = 0;
+
+	for(c = 0; c < 256; c++){
+		if(Is_Seperator(c)){
+			cls[c] |= CC_SEPARATOR;
+		}
+	}
+	if(syntax->flags & HIGH_LIGHT_STRINGS){
+		cls['"'] |= CC_QUOTE;
+		cls['\''] |= CC_QUOTE;
+		tables->stops[tables->stop_count++] = '"';
+		tables->stops[tables->stop_count++] = '\'';
+	}
+	if(scs && scs[0]){
+		cls[(unsigned char)scs[0]] |= CC_COMMENT;
+		tables->stops[tables->stop_count++] = scs[0];
+	}
+	if(mlcs && mlcs[0] && mlce && mlce[0]){
+		cls[(unsigned char)mlcs[0]] |= CC_COMMENT;
+		tables->stops[tables->stop_count++] = mlcs[0];
+	}
+
+	tables->simd_ident = 1;
+	for(c = 0; c < 256; c++){
+		if((isalnum(c) || c == '_' || c >= 0x80) && (cls[c] & CC_STOP)){
+			tables->simd_ident = 0;
+		}
+	}
+	syntax->tables = tables;
+}
+
+/**	Index of the first byte of s that is one of set[0..count), or len.	**/
+int Scan_Until_Any( const char *s, int len, const char *set, int count )
+{
+	int i = 0;
+	if(count == 0){
+		return len;
+	}
+#if defined(__SSE2__)
+	__m128i c0 = _mm_set1_epi8(set[0]);
+	__m128i c1 = _mm_set1_epi8(set[count > 1 ? 1 : 0]);
+	__m128i c2 = _mm_set1_epi8(set[count > 2 ? 2 : 0]);
+	__m128i c3 = _mm_set1_epi8(set[count > 3 ? 3 : 0]);
+	for(; i + 16 <= len; i += 16){
+		__m128i block = _mm_loadu_si128((const __m128i *)&s[i]);
+		__m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, c0), _mm_cmpeq_epi8(block, c1)),
+		                           _mm_or_si128(_mm_cmpeq_epi8(block, c2), _mm_cmpeq_epi8(block, c3)));
+		int mask = _mm_movemask_epi8(hit);
+		if(mask){
+			return i + __builtin_ctz(mask);
+		}
+	}
+#endif
+	for(; i < len; i++){
+		if(memchr(set, s[i], count)){
+			return i;
+		}
+	}
+	return len;
+}
+
+/**	Number of leading bytes of s that cannot start a token: the rest of	**/
+/**	an identifier the lexer is already inside.				**/
+int Plain_Run( const char *s, int len, struct Syntax_Tables *tables )
+{
+	int i = 0;
+#if defined(__SSE2__)
+	if(tables->simd_ident){
+		for(; i + 16 <= len; i += 16){
+			__m128i block = _mm_loadu_si128((const __m128i *)&s[i]);
+			__m128i folded = _mm_or_si128(block, _mm_set1_epi8(0x20));
+			__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(folded, _mm_set1_epi8('a' - 1)),
+			                              _mm_cmplt_epi8(folded, _mm_set1_epi8('z' + 1)));
+			__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('0' - 1)),
+			                              _mm_cmplt_epi8(block, _mm_set1_epi8('9' + 1)));
+			__m128i ident = _mm_or_si128(_mm_or_si128(alpha, digit),
+			                             _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('_')),
+			                                          _mm_cmplt_epi8(block, _mm_setzero_si128())));
+			int mask = _mm_movemask_epi8(ident);
+			if(mask != 0xffff){
+				i += __builtin_ctz(~mask);
+				break;
+			}
+		}
+	}
+#endif
+	while(i < len && !(tables->char_class[(unsigned char)s[i]] & CC_STOP)){
+		i++;
+	}
+	return i;
+}
+
+/**	Length of the keyword starting at text[0] that is followed by a	**/
+/**	separator, 0 if there is none. Its highlight class goes to *type.	**/
+int Keyword_Match( struct Keyword_Trie *trie, const unsigned char *char_class, const char *text, int len, int *type )
+{
+	int node = 0, j = 0, found = 0;
+	while(j < len){
+		int class = trie->class_of[(unsigned char)text[j]];
+		if(!class){
+			break;
+		}
+		node = trie->next[node * trie->width + class];
+		if(!node){
+			break;
+		}
+		j++;
+		if(trie->accept[node] && (j == len || (char_class[(unsigned char)text[j]] & CC_SEPARATOR))){
+			found = j;
+			*type = trie->accept[node];
+		}
+	}
+	return found;
+}
+
+/**	Highlights len bytes of rendered text into hl, starting in the	**/
+/**	given comment state, and returns the state at the end.		**/
+int Syntax_Lex( const char *text, unsigned char *hl, int len, int in_comment ) /*TODO Break this up into smaller functions.*/
+{
+	memset(hl, HL_NORMAL, len);		
+
+	if(config->syntax == NULL){						
+		return 0;
+	}
+	struct Keyword_Trie *keywords = config->syntax->keyword_trie;
+	unsigned char *char_class = config->syntax->tables->char_class;
 
 	char *scs = config->syntax->single_line_comment_start;			
 	char *mlcs = config->syntax->multi_line_comment_start;
@@ -444,24 +2281,47 @@ void Update_Syntax( File_row *row ) /*TODO Break this up into smaller functions.
 
 	int prev_sep = 1;							
 	int in_string = 0;
-	int in_comment = (*row->idx > 0 && *config->row[*row->idx - 1].hl_open_comment);
 
 	int i = 0;
-	while( i < *row->render_size){
-		char c = row->render[i];						
-		unsigned char prev_hl = (i > 0) ? row->high_lighted[i - 1] : HL_NORMAL;		
-		if(scs_len && !in_string && !in_comment){							
-			if(!strncmp(&row->render[i],scs,scs_len)){				
-				memset(&row->high_lighted[i],HL_COMMENT,*row->render_size - i); 
+	while( i < len){
+		if(in_comment && mlce_len){
+			char *end = memchr(&text[i], mlce[0], len - i);
+			int stop = end ? end - text : len;
+			memset(&hl[i], HL_MLCOMMENT, stop - i);
+			if((i = stop) == len){
+				break;
+			}
+		}else if(in_string){
+			char set[2] = { '\\', in_string };
+			int run = Scan_Until_Any(&text[i], len - i, set, 2);
+			memset(&hl[i], HL_STRING, run);
+			if(run){
+				prev_sep = 1;
+			}
+			if((i += run) == len){
+				break;
+			}
+		}else if(!prev_sep && i > 0 && hl[i - 1] != HL_NUMBER){
+			i += Plain_Run(&text[i], len - i, config->syntax->tables);
+			if(i == len){
+				break;
+			}
+		}
+		char c = text[i];						
+		unsigned char cc = char_class[(unsigned char)c];
+		unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;		
+		if(scs_len && !in_string && !in_comment && (cc & CC_COMMENT)){							
+			if(!strncmp(&text[i],scs,scs_len)){				
+				memset(&hl[i],HL_COMMENT,len - i); 
 				break;
 			}
 
 		}
 		if(mlcs_len && mlce_len && !in_string){
 			if(in_comment){
-				row->high_lighted[i] = HL_MLCOMMENT;
-				if(!strncmp(&row->render[i],mlce,mlce_len)){
-					memset(&row->high_lighted[i], HL_MLCOMMENT, mlce_len);
+				hl[i] = HL_MLCOMMENT;
+				if(!strncmp(&text[i],mlce,mlce_len)){
+					memset(&hl[i], HL_MLCOMMENT, mlce_len);
 					i += mlce_len;
 					in_comment = 0;
 					prev_sep = 1;
@@ -471,8 +2331,8 @@ void Update_Syntax( File_row *row ) /*TODO Break this up into smaller functions.
 					continue;
 				}
 
-			}else if(!strncmp(&row->render[i],mlcs,mlcs_len)){
-				memset(&row->high_lighted[i], HL_MLCOMMENT, mlcs_len);
+			}else if((cc & CC_COMMENT) && !strncmp(&text[i],mlcs,mlcs_len)){
+				memset(&hl[i], HL_MLCOMMENT, mlcs_len);
 				i += mlcs_len;
 				in_comment = 1;
 				continue;
@@ -480,9 +2340,9 @@ void Update_Syntax( File_row *row ) /*TODO Break this up into smaller functions.
 		}
 		if(config->syntax->flags & HIGH_LIGHT_STRINGS){
 			if(in_string){
-				row->high_lighted[i] = HL_STRING;
-				if(c == '\\' && (i + 1) < *row->render_size){
-					row->high_lighted[i + 1] = HL_STRING;
+				hl[i] = HL_STRING;
+				if(c == '\\' && (i + 1) < len){
+					hl[i + 1] = HL_STRING;
 					i+=2;
 					continue;
 
@@ -496,7 +2356,7 @@ void Update_Syntax( File_row *row ) /*TODO Break this up into smaller functions.
 			}else{
 				if(c == '"' || c == '\''){
 					in_string = c;
-					row->high_lighted[i] = HL_STRING;
+					hl[i] = HL_STRING;
 					i++;
 					continue;
 				}
@@ -506,7 +2366,7 @@ void Update_Syntax( File_row *row ) /*TODO Break this up into smaller functions.
 		if(config->syntax->flags & HIGH_LIGHT_NUMBERS){
 	 		if((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || 
 			   ( c == '.' && prev_hl == HL_NUMBER)){	//TODO possible bug with a sentence that ends with a number.
-				row->high_lighted[i] = HL_NUMBER;
+				hl[i] = HL_NUMBER;
 				i++;
 				prev_sep = 0;
 				continue;
@@ -514,45 +2374,185 @@ void Update_Syntax( File_row *row ) /*TODO Break this up into smaller functions.
 		}
 	
 		if(prev_sep){
-			int j = 0;
-			for(j = 0 ;keywords[j]; j++){
-				int klen = strlen(keywords[j]);
-				int kw2 = keywords[j][klen - 1] == '|';
-				if(kw2){
-					klen--;
-				}
-				if(!strncmp(&row->render[i],keywords[j],klen) && Is_Seperator(row->render[i + klen])){
-					memset(&row->high_lighted[i], kw2 ? HL_KEYWORD_2 : HL_KEYWORD_1, klen);
-					i += klen;
-					break;
-				}
-			}
-			if(keywords[j] != NULL){
+			int type = 0;
+			int klen = Keyword_Match(keywords, char_class, &text[i], len - i, &type);
+			if(klen){
+				memset(&hl[i], type, klen);
+				i += klen;
 				prev_sep = 0;
 				continue;
 			}
 		}
-		prev_sep = Is_Seperator(c);
+		prev_sep = cc & CC_SEPARATOR;
 		i++;	
 	}
-	int changed = (*row->hl_open_comment != in_comment);
-	*row->hl_open_comment = in_comment;
-	if(changed && (*row->idx + 1 )< *config->num_of_rows){
-		Update_Syntax(&config->row[*row->idx + 1]);
-	}
+	return in_comment;
 }
 
-int Syntax_Color( int highlight )
+void Update_Syntax( File_row *row, int in_comment )
 {
-	switch(highlight){
-		case HL_COMMENT:
-		case HL_MLCOMMENT:
-			return 36;
-		case HL_KEYWORD_1:
-			return 33;
-		case HL_KEYWORD_2:
-			return 32;
-		case HL_STRING:
+	row->high_lighted = Pool_Grow(config->hl_pool, row->high_lighted, &row->high_lighted_cap, 0, row->render_size);	
+	row->hl_open_comment = Syntax_Lex(row->render, row->high_lighted, row->render_size, in_comment);
+	Row_Glyphs(row);
+}
+
+/**	Same comment and string rules as Update_Syntax, run over the raw	**/
+/**	string without producing highlight bytes. Used to carry the open	**/
+/**	comment state through rows that are not on screen.			**/
+int Syntax_Scan_State( File_row *row, int in_comment )
+{
+	if(config->syntax == NULL){
+		return 0;
+	}
+	char *scs = config->syntax->single_line_comment_start;
+	char *mlcs = config->syntax->multi_line_comment_start;
+	char *mlce = config->syntax->multi_line_comment_end;
+
+	int scs_len = scs ? strlen(scs) : 0;
+	int mlcs_len = mlcs ? strlen(mlcs): 0;
+	int mlce_len = mlce ? strlen(mlce): 0;
+	int strings = config->syntax->flags & HIGH_LIGHT_STRINGS;
+
+	struct Syntax_Tables *tables = config->syntax->tables;
+
+	char *s = row->string;
+	int size = row->size;
+	int in_string = 0;
+	int i = 0;
+	while(i < size){
+		if(in_comment && mlce_len){
+			char *end = memchr(&s[i], mlce[0], size - i);
+			i = end ? end - s : size;
+		}else if(in_string){
+			char set[2] = { '\\', in_string };
+			i += Scan_Until_Any(&s[i], size - i, set, 2);
+		}else{
+			i += Scan_Until_Any(&s[i], size - i, tables->stops, tables->stop_count);
+		}
+		if(i >= size){
+			break;
+		}
+		char c = s[i];
+		if(scs_len && !in_string && !in_comment && i + scs_len <= size && !memcmp(&s[i],scs,scs_len)){
+			break;
+		}
+		if(mlcs_len && mlce_len && !in_string){
+			if(in_comment){
+				if(i + mlce_len <= size && !memcmp(&s[i],mlce,mlce_len)){
+					i += mlce_len;
+					in_comment = 0;
+				}else{
+					i++;
+				}
+				continue;
+			}else if(i + mlcs_len <= size && !memcmp(&s[i],mlcs,mlcs_len)){
+				i += mlcs_len;
+				in_comment = 1;
+				continue;
+			}
+		}
+		if(strings){
+			if(in_string){
+				if(c == '\\' && (i + 1) < size){
+					i += 2;
+					continue;
+				}
+				if(c == in_string){
+					in_string = 0;
+				}
+			}else if(c == '"' || c == '\''){
+				in_string = c;
+			}
+		}
+		i++;
+	}
+	return in_comment;
+}
+
+/**	Each row's hl_open_comment is the lexer state at its end, and is	**/
+/**	trusted while ROW_STATE_VALID is set. An edit only clears the flag on	**/
+/**	the edited row; re-lexing walks forward and stops clearing flags as	**/
+/**	soon as a row ends in the same state as before. Every row above		**/
+/**	*config->syntax_valid is known to be valid.				**/
+int Syntax_Pending()
+{
+	return config->syntax && *config->syntax_valid < *config->num_of_rows;
+}
+
+void Syntax_Invalidate( File_row *row, int at )
+{
+	if(row){
+		row->flags &= ~ROW_STATE_VALID;
+	}
+	if(at < *config->syntax_valid){
+		*config->syntax_valid = at;
+	}
+}
+
+void Syntax_Reset()
+{
+	struct Row_Iter iter;
+	File_row *row = Row_Iter_Seek(&iter, 0);
+	for(; row; row = Row_Iter_Next(&iter)){
+		row->flags &= ~(ROW_STATE_VALID | ROW_RENDERED);
+	}
+	*config->syntax_valid = 0;
+}
+
+/**	Re-lexes stale rows up to and including 'at'. Draw_Rows calls this	**/
+/**	for the viewport, Read_Key carries on through the rest when idle.	**/
+void Syntax_Validate( int at )
+{
+	if(at >= *config->num_of_rows){
+		at = *config->num_of_rows - 1;
+	}
+	if(at < *config->syntax_valid){
+		return;
+	}
+	long long trace = Trace_Now();
+	File_row *prev = Row_At(*config->syntax_valid - 1);
+	int in_comment = prev ? prev->hl_open_comment : 0;
+	int changed = 0;
+	int lexed = 0;
+
+	struct Row_Iter iter;
+	File_row *row = Row_Iter_Seek(&iter, *config->syntax_valid);
+	for(; row && *config->syntax_valid <= at; row = Row_Iter_Next(&iter)){
+		if(changed || !(row->flags & ROW_STATE_VALID)){
+			int old_state = row->hl_open_comment;
+			if(Row_Long(row)){
+				row->hl_open_comment = Row_Scan_State(row, in_comment);
+				row->flags &= ~ROW_RENDERED;
+			}else if(row->flags & ROW_RENDERED){
+				Update_Syntax(row, in_comment);
+			}else{
+				row->hl_open_comment = Syntax_Scan_State(row, in_comment);
+			}
+			row->flags |= ROW_STATE_VALID;
+			changed = (row->hl_open_comment != old_state);
+			lexed++;
+		}
+		in_comment = row->hl_open_comment;
+		(*config->syntax_valid)++;
+	}
+	if(changed && row){
+		row->flags &= ~ROW_STATE_VALID;
+	}
+	Trace_Count(TRACE_ROWS_LEXED, lexed);
+	Trace_End(TRACE_SYNTAX, trace);
+}
+
+int Syntax_Color( int highlight )
+{
+	switch(highlight){
+		case HL_COMMENT:
+		case HL_MLCOMMENT:
+			return 36;
+		case HL_KEYWORD_1:
+			return 33;
+		case HL_KEYWORD_2:
+			return 32;
+		case HL_STRING:
 			return 35;	
 		case HL_NUMBER:
 			return 31;
@@ -581,419 +2581,4888 @@ void Select_Syntax_High_Light()
 			if((is_ext && ext && !strcmp(ext, s->file_match[i])) ||
 			  (!is_ext  && strstr(config->filename, s->file_match[i]))){
 				config->syntax = s;
-
-				int file_row = 0;
-				for(file_row = 0; file_row < *config->num_of_rows; file_row++){
-					Update_Syntax(&config->row[file_row]);
+				if(!s->keyword_trie){
+					Keyword_Compile(s);
+					Syntax_Tables_Compile(s);
 				}
+
+				Syntax_Reset();
 				return;
 			}
 			i++;
 		}
 	}
-}
-
-/* ROW OPERATIONS */
-int Row_Cursor_2_Render( File_row *row, int cx )
-{
-	int rx = 0, j =0;
-	
-	for( j = 0; j < cx; j++ ){
-		if(row->string[j] == '\t'){
-			rx += (TAB_STOP - 1) - (rx % TAB_STOP);
+}
+
+/* TEXT WIDTH */
+/**	Decodes the UTF-8 sequence at s into *cp and returns its length.	**/
+/**	A byte that does not start a valid sequence is one UTF8_INVALID.	**/
+int Utf8_Decode( const char *s, int len, unsigned int *cp )
+{
+	unsigned char c = s[0];
+	if(c < 0x80){
+		*cp = c;
+		return 1;
+	}
+	int n = (c >= 0xf0 && c < 0xf5) ? 4 : (c >= 0xe0 && c < 0xf0) ? 3 : (c >= 0xc2 && c < 0xe0) ? 2 : 0;
+	unsigned int value = c & (0x7f >> n);
+	int i = 1;
+	if(n == 0 || n > len){
+		*cp = UTF8_INVALID;
+		return 1;
+	}
+	for(i = 1; i < n; i++){
+		if((s[i] & 0xc0) != 0x80){
+			*cp = UTF8_INVALID;
+			return 1;
+		}
+		value = (value << 6) | (s[i] & 0x3f);
+	}
+	if((n == 3 && value < 0x800) || (n == 4 && (value < 0x10000 || value > 0x10ffff)) ||
+	   (value >= 0xd800 && value <= 0xdfff)){
+		*cp = UTF8_INVALID;
+		return 1;
+	}
+	*cp = value;
+	return n;
+}
+
+int Utf8_Encode( unsigned int cp, char *out )
+{
+	if(cp < 0x80){
+		out[0] = cp;
+		return 1;
+	}
+	if(cp < 0x800){
+		out[0] = 0xc0 | (cp >> 6);
+		out[1] = 0x80 | (cp & 0x3f);
+		return 2;
+	}
+	if(cp < 0x10000){
+		out[0] = 0xe0 | (cp >> 12);
+		out[1] = 0x80 | ((cp >> 6) & 0x3f);
+		out[2] = 0x80 | (cp & 0x3f);
+		return 3;
+	}
+	out[0] = 0xf0 | (cp >> 18);
+	out[1] = 0x80 | ((cp >> 12) & 0x3f);
+	out[2] = 0x80 | ((cp >> 6) & 0x3f);
+	out[3] = 0x80 | (cp & 0x3f);
+	return 4;
+}
+
+/**	Terminal columns taken by cp: 0 for combining marks and zero width	**/
+/**	spaces, 2 for East Asian wide and fullwidth characters, 1 for the	**/
+/**	rest. Control characters count as 1, Draw_Rows shows them as one	**/
+/**	inverted cell.								**/
+int Char_Width( unsigned int cp )
+{
+	static const unsigned int zero[][2] = {
+		{ 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd }, { 0x0610, 0x061a },
+		{ 0x064b, 0x065f }, { 0x0e31, 0x0e31 }, { 0x0e34, 0x0e3a }, { 0x0e47, 0x0e4e },
+		{ 0x1ab0, 0x1aff }, { 0x1dc0, 0x1dff }, { 0x200b, 0x200f }, { 0x20d0, 0x20ff },
+		{ 0xfe00, 0xfe0f }, { 0xfe20, 0xfe2f }, { 0xfeff, 0xfeff }
+	};
+	static const unsigned int wide[][2] = {
+		{ 0x1100, 0x115f }, { 0x2e80, 0x303e }, { 0x3041, 0x33ff }, { 0x3400, 0x4dbf },
+		{ 0x4e00, 0x9fff }, { 0xa000, 0xa4cf }, { 0xac00, 0xd7a3 }, { 0xf900, 0xfaff },
+		{ 0xfe30, 0xfe4f }, { 0xff00, 0xff60 }, { 0xffe0, 0xffe6 }, { 0x1f300, 0x1f64f },
+		{ 0x1f900, 0x1f9ff }, { 0x20000, 0x2fffd }, { 0x30000, 0x3fffd }
+	};
+	unsigned int i = 0;
+	if(cp < 0x300){
+		return 1;
+	}
+	for(i = 0; i < sizeof(zero) / sizeof(zero[0]) && cp >= zero[i][0]; i++){
+		if(cp <= zero[i][1]){
+			return 0;
+		}
+	}
+	for(i = 0; i < sizeof(wide) / sizeof(wide[0]) && cp >= wide[i][0]; i++){
+		if(cp <= wide[i][1]){
+			return 2;
+		}
+	}
+	return 1;
+}
+
+/**	Length of the prefix of s that is one column per byte: no tabs and	**/
+/**	no 8 bit bytes.								**/
+int Plain_Columns( const char *s, int len )
+{
+	int i = 0;
+#if defined(__SSE2__)
+	for(; i + 16 <= len; i += 16){
+		__m128i block = _mm_loadu_si128((const __m128i *)&s[i]);
+		int mask = _mm_movemask_epi8(block) | _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('\t')));
+		if(mask){
+			return i + __builtin_ctz(mask);
+		}
+	}
+#endif
+	while(i < len && s[i] != '\t' && !(s[i] & 0x80)){
+		i++;
+	}
+	return i;
+}
+
+/**	Turns the lexed render of a row with 8 bit bytes or control	**/
+/**	characters into one cell and one attribute per column, so drawing a	**/
+/**	frame is a copy. Wide characters take two columns, the second one	**/
+/**	0; control characters and bad bytes become inverted ^X or '?'.	**/
+void Row_Glyphs( File_row *row )
+{
+	if(!(row->flags & ROW_GLYPHS)){
+		row->columns = row->render_size;
+		return;
+	}
+	row->glyph = Pool_Grow(config->render_pool, row->glyph, &row->glyph_cap, 0, (row->render_size + 1) * sizeof(unsigned int));
+	unsigned char *hl = row->high_lighted;
+	int i = 0, col = 0;
+	while(i < row->render_size){
+		unsigned int cp = 0;
+		int n = Utf8_Decode(&row->render[i], row->render_size - i, &cp);
+		int width = Char_Width(cp);
+		if(width){
+			row->glyph[col] = cp;
+			hl[col] = hl[i];
+			if(cp < 0x20 || cp == 0x7f || (cp >= 0x80 && cp < 0xa0) || cp == UTF8_INVALID){
+				row->glyph[col] = (cp <= 26) ? '@' + cp : '?';
+				hl[col] |= ATTR_INVERSE;
+			}
+			if(width == 2){
+				row->glyph[col + 1] = 0;
+				hl[col + 1] = hl[i];
+			}
+			col += width;
+		}
+		i += n;
+	}
+	row->columns = col;
+}
+
+/**	Builds the column marks of a row that has no chunks.			**/
+void Row_Marks( File_row *row )
+{
+	if(row->flags & ROW_MARKS){
+		return;
+	}
+	int off = 0, rx = 0;
+	row->mark_count = 0;
+	while(1){
+		int plain = Plain_Columns(&row->string[off], row->size - off);
+		off += plain;
+		rx += plain;
+		if(off >= row->size){
+			break;
+		}
+		struct Col_Mark mark = { off, rx, 1, 0 };
+		if(row->string[off] == '\t'){
+			mark.width = TAB_STOP - (rx % TAB_STOP);
+		}else{
+			unsigned int cp = 0;
+			mark.len = Utf8_Decode(&row->string[off], row->size - off, &cp);
+			mark.width = Char_Width(cp);
+		}
+		row->marks = Pool_Grow(config->render_pool, row->marks, &row->mark_cap,
+				row->mark_count * sizeof(struct Col_Mark), (row->mark_count + 1) * sizeof(struct Col_Mark));
+		row->marks[row->mark_count++] = mark;
+		off += mark.len;
+		rx += mark.width;
+	}
+	row->flags |= ROW_MARKS;
+}
+
+/**	Index of the last mark whose offset (by_rx 0) or column (by_rx 1)	**/
+/**	is at most 'key', -1 if there is none.					**/
+int Row_Mark_Find( File_row *row, int key, int by_rx )
+{
+	int lo = -1, hi = row->mark_count - 1;
+	while(lo < hi){
+		int mid = (lo + hi + 1) / 2;
+		if((by_rx ? row->marks[mid].rx : row->marks[mid].off) <= key){
+			lo = mid;
+		}else{
+			hi = mid - 1;
+		}
+	}
+	return lo;
+}
+
+/* LONG ROWS */
+/**	Rows of ROW_LONG bytes or more keep a gap at the last edit, so	**/
+/**	typing does not move the rest of the line, and checkpoints every	**/
+/**	ROW_CHUNK bytes or so, so only the columns on screen are rendered	**/
+/**	and lexed. Readers that want the whole string call Row_Text.		**/
+struct Row_Chunks *Row_Long( File_row *row )
+{
+	if(row->chunks || row->size < ROW_LONG){
+		return row->chunks;
+	}
+	struct Row_Chunks *chunks = calloc(1, sizeof(struct Row_Chunks));
+	Check_Mem(chunks,"chunks");
+	chunks->cap = 64;
+	chunks->ck = malloc(chunks->cap * sizeof(struct Row_Checkpoint));
+	Check_Mem(chunks->ck,"chunks->ck");
+	chunks->ck[0].off = chunks->ck[0].rx = 0;
+	chunks->ck[0].state = LEX_NORMAL;
+	chunks->count = chunks->valid = chunks->rx_valid = 1;
+	row->chunks = chunks;
+	return chunks;
+}
+
+void Row_Chunks_Free( File_row *row )
+{
+	if(row->chunks){
+		free_mem(row->chunks->ck,"chunks->ck");
+		free_mem(row->chunks,"chunks");
+		row->chunks = NULL;
+	}
+}
+
+/**	Removes ck[from, to).							**/
+void Row_Chunks_Drop( struct Row_Chunks *chunks, int from, int to )
+{
+	memmove(&chunks->ck[from], &chunks->ck[to], (chunks->count - to) * sizeof(struct Row_Checkpoint));
+	chunks->count -= to - from;
+}
+
+/**	Shifts the checkpoints past an edit of 'delta' bytes at 'x' and marks	**/
+/**	them stale. Ones inside deleted text can never be right again.	**/
+void Row_Chunks_Edit( File_row *row, int x, int delta )
+{
+	struct Row_Chunks *chunks = row->chunks;
+	int k = chunks->count;
+	while(k > 1 && chunks->ck[k - 1].off > x){
+		chunks->ck[--k].off += delta;
+	}
+	if(k == chunks->count){
+		chunks->complete = 0;
+	}
+	int gone = k;
+	while(gone < chunks->count && chunks->ck[gone].off < x){
+		gone++;
+	}
+	Row_Chunks_Drop(chunks, k, gone);
+	if(k < chunks->valid){
+		chunks->valid = k;
+	}
+	if(k < chunks->rx_valid){
+		chunks->rx_valid = k;
+	}
+}
+
+/**	Appends an exact checkpoint in place of the stale ones before	**/
+/**	ck[stale].								**/
+void Row_Chunks_Place( struct Row_Chunks *chunks, int stale, int off, int state )
+{
+	int at = chunks->valid;
+	if(stale > at){
+		Row_Chunks_Drop(chunks, at + 1, stale);
+	}else{
+		if(chunks->count == chunks->cap){
+			chunks->cap *= 2;
+			chunks->ck = realloc(chunks->ck, chunks->cap * sizeof(struct Row_Checkpoint));
+			Check_Mem(chunks->ck,"chunks->ck");
+		}
+		memmove(&chunks->ck[at + 1], &chunks->ck[at], (chunks->count - at) * sizeof(struct Row_Checkpoint));
+		chunks->count++;
+	}
+	chunks->ck[at].off = off;
+	chunks->ck[at].rx = 0;
+	chunks->ck[at].state = state;
+	chunks->valid++;
+}
+
+void Row_Gap_Move( File_row *row, int x )
+{
+	if(row->gap_len == 0){
+		row->gap = x;
+		return;
+	}
+	if(x < row->gap){
+		memmove(&row->string[x + row->gap_len], &row->string[x], row->gap - x);
+	}else if(x > row->gap){
+		memmove(&row->string[row->gap], &row->string[row->gap + row->gap_len], x - row->gap);
+	}
+	row->gap = x;
+}
+
+/**	Makes the gap at least 'len' bytes, with an eighth of the row to	**/
+/**	spare so a run of inserts does not move the tail every time.		**/
+void Row_Gap_Reserve( File_row *row, int len )
+{
+	if(row->gap_len >= len){
+		return;
+	}
+	int old = row->gap_len;
+	int tail = row->size - row->gap;
+	row->string = Pool_Grow(config->text_pool, row->string, &row->string_cap, row->size + old + 1, row->size + len + (row->size >> 3) + 1);
+	row->gap_len = row->string_cap - row->size - 1;
+	memmove(&row->string[row->gap + row->gap_len], &row->string[row->gap + old], tail + 1);
+}
+
+void Row_Gap_Insert( File_row *row, int x, const char *string, int len )
+{
+	Row_Gap_Move(row, x);
+	Row_Gap_Reserve(row, len);
+	memcpy(&row->string[row->gap], string, len);
+	row->gap += len;
+	row->gap_len -= len;
+	row->size += len;
+	Row_Chunks_Edit(row, x, len);
+}
+
+void Row_Gap_Delete( File_row *row, int x, int len )
+{
+	Row_Gap_Move(row, x);
+	row->gap_len += len;
+	row->size -= len;
+	Row_Chunks_Edit(row, x, -len);
+}
+
+/**	Closes the gap: row->string is then the whole row, '\0' terminated.	**/
+char *Row_Text( File_row *row )
+{
+	if(row->gap_len){
+		Row_Gap_Move(row, row->size);
+		row->gap_len = 0;
+		row->string[row->size] = '\0';
+	}
+	return row->string;
+}
+
+/**	string[off, off + len) without the gap, copied into 'scratch' only	**/
+/**	when it straddles it.							**/
+const char *Row_Span( File_row *row, int off, int len, char *scratch )
+{
+	if(row->gap_len == 0 || off + len <= row->gap){
+		return &row->string[off];
+	}
+	if(off >= row->gap){
+		return &row->string[off + row->gap_len];
+	}
+	int head = row->gap - off;
+	memcpy(scratch, &row->string[off], head);
+	memcpy(&scratch[head], &row->string[row->gap + row->gap_len], len - head);
+	return scratch;
+}
+
+/**	Render column reached from column 'rx' at 'off' by string[off, end).	**/
+/**	A character that starts before 'end' but runs past it is not counted.	**/
+int Row_Columns( File_row *row, int off, int end, int rx )
+{
+	char scratch[ROW_CHUNK + 4];
+	while(off < end){
+		int len = (end - off < ROW_CHUNK) ? end - off : ROW_CHUNK;
+		int avail = (row->size - off < len + 3) ? row->size - off : len + 3;
+		const char *s = Row_Span(row, off, avail, scratch);
+		int i = 0;
+		while(i < len){
+			int plain = Plain_Columns(&s[i], len - i);
+			i += plain;
+			rx += plain;
+			if(i >= len){
+				break;
+			}
+			if(s[i] == '\t'){
+				rx += TAB_STOP - (rx % TAB_STOP);
+				i++;
+				continue;
+			}
+			unsigned int cp = 0;
+			int n = Utf8_Decode(&s[i], avail - i, &cp);
+			if(off + i + n > end){
+				return rx;
+			}
+			rx += Char_Width(cp);
+			i += n;
+		}
+		off += i;
+	}
+	return rx;
+}
+
+/**	Whether the lexer state at 'at' (offset p) follows from the bytes	**/
+/**	before it: not inside a token that could still turn into a comment,	**/
+/**	number or keyword depending on what comes next.				**/
+int Row_Safe_Point( const char *at, int p, int state )
+{
+	if(state == LEX_LINE_COMMENT || config->syntax == NULL){
+		return 1;
+	}
+	unsigned char *char_class = config->syntax->tables->char_class;
+	unsigned char c1 = at[-1];
+	unsigned char c2 = (p >= 2) ? at[-2] : ' ';
+	if(state == LEX_COMMENT){
+		unsigned char end = config->syntax->multi_line_comment_end[0];
+		return c1 != end && c2 != end;
+	}
+	return char_class[c1] == CC_SEPARATOR && c1 != '.' && !(char_class[c2] & CC_COMMENT);
+}
+
+/**	Lexes on from the last exact checkpoint, with the rules of		**/
+/**	Syntax_Scan_State, until it can place the next one, meets a stale	**/
+/**	one in the same state (so the rest still holds) or hits the end.	**/
+void Row_Scan_Step( File_row *row )
+{
+	struct Row_Chunks *chunks = row->chunks;
+	struct Syntax *syntax = config->syntax;
+	char scratch[ROW_CHUNK + ROW_LOOKAHEAD + 2];
+
+	char *scs = syntax ? syntax->single_line_comment_start : NULL;
+	char *mlcs = syntax ? syntax->multi_line_comment_start : NULL;
+	char *mlce = syntax ? syntax->multi_line_comment_end : NULL;
+	int scs_len = scs ? strlen(scs) : 0;
+	int mlcs_len = mlcs ? strlen(mlcs): 0;
+	int mlce_len = mlce ? strlen(mlce): 0;
+	int strings = syntax && (syntax->flags & HIGH_LIGHT_STRINGS);
+
+	struct Row_Checkpoint *last = &chunks->ck[chunks->valid - 1];
+	int i = last->off;
+	int state = last->state;
+	int next_at = i + ROW_CHUNK;
+	int stale = chunks->valid;
+	int in_string = 0;
+	int size = row->size;
+
+	if(state == LEX_COMMENT && !mlce_len){
+		state = LEX_NORMAL;
+	}
+	while(i < size){
+		int base = (i >= 2) ? i - 2 : 0;
+		int span_end = (size - i < ROW_CHUNK) ? size : i + ROW_CHUNK;
+		int span_len = ((size - span_end < ROW_LOOKAHEAD) ? size : span_end + ROW_LOOKAHEAD) - base;
+		const char *s = Row_Span(row, base, span_len, scratch) - base;
+
+		while(i < span_end){
+			int r = span_end;
+			if(syntax == NULL || state == LEX_LINE_COMMENT){
+				r = span_end;
+			}else if(state == LEX_COMMENT){
+				const char *end = memchr(&s[i], mlce[0], span_end - i);
+				r = end ? end - s : span_end;
+			}else if(in_string){
+				char set[2] = { '\\', in_string };
+				r = i + Scan_Until_Any(&s[i], span_end - i, set, 2);
+			}else{
+				r = i + Scan_Until_Any(&s[i], span_end - i, syntax->tables->stops, syntax->tables->stop_count);
+			}
+
+			/* every offset in [i, r) is reached in 'state' */
+			if(!in_string){
+				while(stale < chunks->count && chunks->ck[stale].off < r){
+					struct Row_Checkpoint *old = &chunks->ck[stale];
+					if(old->off >= i && old->state == state && Row_Safe_Point(&s[old->off], old->off, state)){
+						Row_Chunks_Drop(chunks, chunks->valid, stale);
+						chunks->valid = chunks->count;
+						return;
+					}
+					stale++;
+				}
+				int p = (next_at > i) ? next_at : i;
+				for(; p < r; p++){
+					if(Row_Safe_Point(&s[p], p, state)){
+						Row_Chunks_Place(chunks, stale, p, state);
+						return;
+					}
+				}
+			}
+			i = r;
+			if(i >= span_end){
+				break;
+			}
+
+			char c = s[i];
+			if(scs_len && !in_string && state == LEX_NORMAL && i + scs_len <= size && !memcmp(&s[i],scs,scs_len)){
+				i += scs_len;
+				state = LEX_LINE_COMMENT;
+				continue;
+			}
+			if(mlcs_len && mlce_len && !in_string){
+				if(state == LEX_COMMENT){
+					if(i + mlce_len <= size && !memcmp(&s[i],mlce,mlce_len)){
+						i += mlce_len;
+						state = LEX_NORMAL;
+					}else{
+						i++;
+					}
+					continue;
+				}else if(i + mlcs_len <= size && !memcmp(&s[i],mlcs,mlcs_len)){
+					i += mlcs_len;
+					state = LEX_COMMENT;
+					continue;
+				}
+			}
+			if(strings){
+				if(in_string){
+					if(c == '\\' && (i + 1) < size){
+						i += 2;
+						continue;
+					}
+					if(c == in_string){
+						in_string = 0;
+					}
+				}else if(c == '"' || c == '\''){
+					in_string = c;
+				}
+			}
+			i++;
+		}
+	}
+	Row_Chunks_Drop(chunks, chunks->valid, chunks->count);
+	chunks->complete = 1;
+	chunks->end_state = (state == LEX_COMMENT);
+}
+
+/**	Makes the checkpoints exact up to the first one past 'until'.	**/
+void Row_Scan( File_row *row, int until )
+{
+	struct Row_Chunks *chunks = row->chunks;
+	while(!(chunks->complete && chunks->valid == chunks->count) && chunks->ck[chunks->valid - 1].off <= until){
+		Row_Scan_Step(row);
+	}
+}
+
+/**	Long row counterpart of Syntax_Scan_State.				**/
+int Row_Scan_State( File_row *row, int in_comment )
+{
+	struct Row_Chunks *chunks = row->chunks;
+	int state = in_comment ? LEX_COMMENT : LEX_NORMAL;
+	if(chunks->ck[0].state != state){
+		chunks->ck[0].state = state;
+		chunks->valid = chunks->rx_valid = 1;
+		if(chunks->count == 1){
+			chunks->complete = 0;
+		}
+	}
+	Row_Scan(row, INT_MAX);
+	return chunks->end_state;
+}
+
+/**	Fills in rx up to and including ck[k], k < valid.			**/
+void Row_Rx_Until( File_row *row, int k )
+{
+	struct Row_Chunks *chunks = row->chunks;
+	struct Row_Checkpoint *ck = chunks->ck;
+	for(; chunks->rx_valid <= k; chunks->rx_valid++){
+		int j = chunks->rx_valid;
+		ck[j].rx = Row_Columns(row, ck[j - 1].off, ck[j].off, ck[j - 1].rx);
+	}
+}
+
+/**	Index of the last checkpoint at or before offset 'cx'.		**/
+int Row_Find_Offset( File_row *row, int cx )
+{
+	Row_Scan(row, cx);
+	struct Row_Chunks *chunks = row->chunks;
+	int lo = 0, hi = chunks->valid - 1;
+	while(lo < hi){
+		int mid = (lo + hi + 1) / 2;
+		if(chunks->ck[mid].off <= cx){
+			lo = mid;
+		}else{
+			hi = mid - 1;
+		}
+	}
+	Row_Rx_Until(row, lo);
+	return lo;
+}
+
+/**	Index of the last checkpoint at or before render column 'rx'.	**/
+int Row_Find_Column( File_row *row, int rx )
+{
+	struct Row_Chunks *chunks = row->chunks;
+	while(1){
+		if(chunks->rx_valid < chunks->valid){
+			if(chunks->ck[chunks->rx_valid - 1].rx > rx){
+				break;
+			}
+			Row_Rx_Until(row, chunks->rx_valid);
+			continue;
+		}
+		if(chunks->ck[chunks->rx_valid - 1].rx > rx || (chunks->complete && chunks->valid == chunks->count)){
+			break;
+		}
+		Row_Scan(row, chunks->ck[chunks->valid - 1].off);
+	}
+	int lo = 0, hi = chunks->rx_valid - 1;
+	while(lo < hi){
+		int mid = (lo + hi + 1) / 2;
+		if(chunks->ck[mid].rx <= rx){
+			lo = mid;
+		}else{
+			hi = mid - 1;
+		}
+	}
+	return lo;
+}
+
+/**	Renders and highlights the columns from the checkpoint before		**/
+/**	current_col to ROW_LOOKAHEAD past the right edge of the screen.		**/
+void Row_Render_Window( File_row *row )
+{
+	struct Row_Chunks *chunks = row->chunks;
+	char scratch[ROW_CHUNK + 4];
+	int to = *config->current_col + *config->screen_cols + ROW_LOOKAHEAD;
+	int first = Row_Find_Column(row, *config->current_col);		/* may grow ck */
+	struct Row_Checkpoint from = chunks->ck[first];
+
+	int off = from.off, rx = from.rx, idx = 0, wide = 0;
+	while(off < row->size && rx < to){
+		int len = (row->size - off < ROW_CHUNK) ? row->size - off : ROW_CHUNK;
+		int avail = (row->size - off < len + 3) ? row->size - off : len + 3;
+		const char *s = Row_Span(row, off, avail, scratch);
+		row->render = Pool_Grow(config->render_pool, row->render, &row->render_cap, idx, idx + len * TAB_STOP + 4);
+		int j = 0;
+		while(j < len && rx < to){
+			if(s[j] == '\t'){
+				do{
+					row->render[idx++] = ' ';
+					rx++;
+				}while(rx % TAB_STOP);
+				j++;
+			}else if(s[j] & 0x80){
+				unsigned int cp = 0;
+				int n = Utf8_Decode(&s[j], avail - j, &cp);
+				memcpy(&row->render[idx], &s[j], n);
+				idx += n;
+				j += n;
+				rx += Char_Width(cp);
+				wide = 1;
+			}else{
+				wide |= (unsigned char)s[j] < 0x20 || s[j] == 0x7f;
+				row->render[idx++] = s[j++];
+				rx++;
+			}
+		}
+		off += j;
+	}
+	if(row->render == NULL){
+		row->render = Pool_Grow(config->render_pool, row->render, &row->render_cap, 0, 1);
+	}
+	row->render[idx] = '\0';
+	row->render_size = idx;
+	Trace_Count(TRACE_BYTES_RENDERED, idx);
+	row->flags = wide ? (row->flags | ROW_GLYPHS) : (row->flags & ~ROW_GLYPHS);
+	chunks->render_rx = from.rx;
+	chunks->render_end = (off >= row->size);
+
+	row->high_lighted = Pool_Grow(config->hl_pool, row->high_lighted, &row->high_lighted_cap, 0, idx);
+	if(from.state == LEX_LINE_COMMENT){
+		memset(row->high_lighted, HL_COMMENT, idx);
+	}else{
+		Syntax_Lex(row->render, row->high_lighted, idx, from.state == LEX_COMMENT);
+	}
+	Row_Glyphs(row);
+}
+
+/**	Whether the rendered columns still cover the screen.			**/
+int Row_Window_Covers( File_row *row )
+{
+	struct Row_Chunks *chunks = row->chunks;
+	int from = *config->current_col;
+	int to = from + *config->screen_cols;
+	return from >= chunks->render_rx && (chunks->render_end || chunks->render_rx + row->columns >= to);
+}
+
+/* ROW OPERATIONS */
+/**	Length of the character at x, and the start of the one holding x,	**/
+/**	so the cursor never stops inside a UTF-8 sequence.			**/
+int Row_Char_Len( File_row *row, int x )
+{
+	char scratch[4];
+	int avail = (row->size - x < 4) ? row->size - x : 4;
+	unsigned int cp = 0;
+	if(avail <= 0){
+		return 0;
+	}
+	return Utf8_Decode(Row_Span(row, x, avail, scratch), avail, &cp);
+}
+
+int Row_Char_Start( File_row *row, int x )
+{
+	char scratch[4];
+	int start = x;
+	while(start > 0 && x - start < 3 && (Row_Span(row, start, 1, scratch)[0] & 0xc0) == 0x80){
+		start--;
+	}
+	return (start + Row_Char_Len(row, start) > x) ? start : x;
+}
+
+int Row_Cursor_2_Render( File_row *row, int cx )
+{
+	if(row->chunks){
+		int at = Row_Find_Offset(row, cx);
+		struct Row_Checkpoint *ck = &row->chunks->ck[at];
+		return Row_Columns(row, ck->off, cx, ck->rx);
+	}
+	Row_Marks(row);
+	int k = Row_Mark_Find(row, cx - 1, 0);
+	if(k < 0){
+		return cx;
+	}
+	struct Col_Mark *mark = &row->marks[k];
+	if(cx < mark->off + mark->len){
+		return mark->rx;
+	}
+	return mark->rx + mark->width + (cx - mark->off - mark->len);
+}
+
+int Row_Rx_2_Cx( File_row *row, int rx )
+{
+	if(row->chunks){
+		char scratch[4];
+		int at = Row_Find_Column(row, rx);
+		struct Row_Checkpoint *ck = &row->chunks->ck[at];
+		int cx = ck->off, cur_rx = ck->rx;
+		while(cx < row->size){
+			int avail = (row->size - cx < 4) ? row->size - cx : 4;
+			const char *s = Row_Span(row, cx, avail, scratch);
+			unsigned int cp = 0;
+			int n = (s[0] == '\t') ? 1 : Utf8_Decode(s, avail, &cp);
+			cur_rx += (s[0] == '\t') ? TAB_STOP - (cur_rx % TAB_STOP) : Char_Width(cp);
+			if(cur_rx > rx){
+				return cx;
+			}
+			cx += n;
+		}
+		return cx;
+	}
+	Row_Marks(row);
+	int k = Row_Mark_Find(row, rx, 1);
+	int cx = rx;
+	if(k >= 0){
+		struct Col_Mark *mark = &row->marks[k];
+		if(rx < mark->rx + mark->width){
+			return mark->off;
+		}
+		cx = mark->off + mark->len + (rx - mark->rx - mark->width);
+	}
+	return (cx < row->size) ? cx : row->size;
+}
+
+void Row_Render( File_row *row )
+{
+	int j = 0, idx = 0, tabs = 0, wide = 0, glyphs = 0;
+
+	for( j = 0; j < row->size; j++){
+		unsigned char c = row->string[j];
+		if(c == '\t'){
+			tabs++;
+		}else if(c & 0x80){
+			wide = 1;
+		}else if(c < 0x20 || c == 0x7f){
+			glyphs = 1;
+		}
+	}
+
+	row->render = Pool_Grow(config->render_pool, row->render, &row->render_cap, 0, row->size + (tabs * (TAB_STOP - 1)) + 1);
+	
+	if(wide){
+		/* tab stops count columns, not bytes */
+		int col = 0;
+		for( j = 0; j < row->size; ){
+			if(row->string[j] == '\t'){
+				do{
+					row->render[idx++] = ' ';
+					col++;
+				}while(col % TAB_STOP);
+				j++;
+			}else{
+				unsigned int cp = 0;
+				int n = Utf8_Decode(&row->string[j], row->size - j, &cp);
+				memcpy(&row->render[idx], &row->string[j], n);
+				idx += n;
+				j += n;
+				col += Char_Width(cp);
+			}
+		}
+	}else{
+		for( j = 0; j < row->size; j++ ){
+			if(row->string[j] == '\t'){
+				row->render[idx++] = ' ';
+				while( ( idx % TAB_STOP )!= 0){
+					row->render[idx++] = ' ';
+				}
+			}else{
+				row->render[idx++] = row->string[j];
+			}
+		}
+	}
+	row->render[idx] = '\0';
+	row->render_size = idx;
+	Trace_Count(TRACE_BYTES_RENDERED, idx);
+	row->flags = (wide || glyphs) ? (row->flags | ROW_GLYPHS) : (row->flags & ~ROW_GLYPHS);
+}
+
+void Row_Evict( File_row *row )
+{
+	Pool_Free(config->hl_pool, row->high_lighted, row->high_lighted_cap);
+	Pool_Free(config->render_pool, row->render, row->render_cap);
+	Pool_Free(config->render_pool, row->glyph, row->glyph_cap);
+	Pool_Free(config->render_pool, row->marks, row->mark_cap);
+	row->high_lighted = NULL;
+	row->render = NULL;
+	row->glyph = NULL;
+	row->marks = NULL;
+	row->high_lighted_cap = row->render_cap = row->render_size = 0;
+	row->glyph_cap = row->mark_cap = row->mark_count = row->columns = 0;
+	row->flags &= ~(ROW_RENDERED | ROW_MARKS);
+	if(row->hot){
+		config->hot_rows[row->hot - 1] = NULL;
+		row->hot = 0;
+	}
+}
+
+/**	Builds render and high_lighted for row 'at' if they are missing or	**/
+/**	stale. Only HOT_ROWS rows keep them, the oldest one gets evicted.	**/
+void Row_Materialize( File_row *row, int at )
+{
+	int long_row = (Row_Long(row) != NULL);
+	if((row->flags & ROW_RENDERED) && at < *config->syntax_valid && (!long_row || Row_Window_Covers(row))){
+		return;
+	}
+	Syntax_Validate(at - 1);
+	File_row *prev = Row_At(at - 1);
+	int old_state = row->hl_open_comment;
+
+	if(long_row){
+		long long trace = Trace_Now();
+		row->hl_open_comment = Row_Scan_State(row, prev ? prev->hl_open_comment : 0);
+		Trace_End(TRACE_SYNTAX, trace);
+		Row_Render_Window(row);
+	}else{
+		if(!(row->flags & ROW_RENDERED)){
+			Row_Render(row);
+		}
+		long long trace = Trace_Now();
+		Update_Syntax(row, prev ? prev->hl_open_comment : 0);
+		Trace_End(TRACE_SYNTAX, trace);
+	}
+	Trace_Count(TRACE_ROWS_LEXED, 1);
+	row->flags |= ROW_RENDERED | ROW_STATE_VALID;
+	if(row->hl_open_comment != old_state){
+		Syntax_Invalidate(Row_At(at + 1), at + 1);
+	}
+	if(at == *config->syntax_valid){
+		(*config->syntax_valid)++;
+	}
+
+	if(!row->hot){
+		File_row *old = config->hot_rows[*config->hot_next];
+		if(old){
+			Row_Evict(old);
+		}
+		config->hot_rows[*config->hot_next] = row;
+		row->hot = *config->hot_next + 1;
+		*config->hot_next = (*config->hot_next + 1) % HOT_ROWS;
+	}
+}
+
+/**	Called after row's text changed: drops the rendered copy and marks	**/
+/**	the row for re-lexing.							**/
+void Update_Row( File_row *row )
+{
+	row->flags &= ~(ROW_RENDERED | ROW_MARKS);
+	Syntax_Invalidate(row, Row_Index(row));
+}
+
+File_row *Row_New()
+{
+	int cap = 0;
+	File_row *row = Pool_Alloc(config->row_pool, sizeof(File_row), &cap);
+	memset(row, 0, sizeof(File_row));
+	return row;
+}
+
+void Insert_Row( int index, char *line, size_t linelen )
+{			
+	if(index < 0 || index > *config->num_of_rows){
+		return;
+	}
+	Journal_Record(JOURNAL_ROW_INSERT, index, 0, line, linelen);
+	
+	File_row *row = Row_New();
+	File_row *prev = Row_At(index - 1);
+	row->size = linelen;
+	row->string = Pool_Alloc(config->text_pool, linelen + 1, &row->string_cap);
+	memcpy(row->string, line, linelen);
+	row->string[linelen] = '\0';
+	/**	The row below was lexed starting from this state, start from it	**/
+	/**	too so re-lexing sees whether the new row changes it.		**/
+	row->hl_open_comment = prev ? prev->hl_open_comment : 0;
+
+	Line_Tree_Insert(index, row);
+	(*config->num_of_rows)++;
+	Update_Row(row);
+	(*config->dirty_flag)++;
+	Undo_Row_Insert(index);
+}
+
+/**	Appends a row whose text stays in the file mapping until it is edited.	**/
+void Insert_Row_View( char *line, size_t linelen )
+{
+	File_row *row = Row_New();
+	row->size = linelen;
+	row->string = line;
+	row->flags |= ROW_MAPPED;
+
+	Line_Tree_Insert(*config->num_of_rows, row);
+	(*config->num_of_rows)++;
+}
+
+/**	Copies a mapped row, or one a save is still writing, into owned	**/
+/**	storage before it is modified.						**/
+void Row_Own( File_row *row )
+{
+	if(!config->save){
+		row->flags &= ~ROW_SHARED;	/* left on a row undo had kept aside */
+	}
+	if(!(row->flags & (ROW_MAPPED | ROW_SHARED))){
+		return;
+	}
+	char *view = row->string;
+	int cap = row->string_cap;
+	row->string = Pool_Alloc(config->text_pool, row->size + 1, &row->string_cap);
+	memcpy(row->string, view, row->size);
+	row->string[row->size] = '\0';
+	if(row->flags & ROW_SHARED){
+		Save_Orphan(view, cap);
+	}
+	row->flags &= ~(ROW_MAPPED | ROW_SHARED);
+}
+
+void Row_Free( File_row *row )
+{
+	Row_Evict(row);
+	Row_Chunks_Free(row);
+	if((row->flags & ROW_SHARED) && config->save){
+		Save_Orphan(row->string, row->string_cap);
+	}else if(!(row->flags & ROW_MAPPED)){
+		Pool_Free(config->text_pool, row->string, row->string_cap);
+	}
+	Pool_Free(config->row_pool, row, sizeof(File_row));
+}
+
+void Del_Whole_Row( int row_num )
+{
+	if(row_num < 0 || row_num >= *config->num_of_rows){
+		return;
+	}
+	Journal_Record(JOURNAL_ROW_DELETE, row_num, 0, NULL, 0);
+	File_row *row = Line_Tree_Remove(row_num);
+	(*config->num_of_rows)--;
+	Syntax_Invalidate(Row_At(row_num), row_num);
+	(*config->dirty_flag)++;
+	Undo_Row_Delete(row_num, row);		/* keeps the row, or frees it */
+}
+
+/**	Takes rows [index, index + count) out of the tree into 'rows'	**/
+/**	without freeing them.							**/
+void Rows_Unlink( int index, int count, File_row **rows )
+{
+	int i = 0;
+	for(i = 0; i < count; i++){
+		Journal_Record(JOURNAL_ROW_DELETE, index, 0, NULL, 0);
+	}
+	Line_Tree_Remove_Run(index, count, rows);
+	for(i = 0; i < count; i++){
+		Row_Evict(rows[i]);
+	}
+	*config->num_of_rows -= count;
+	Syntax_Invalidate(Row_At(index), index);
+	(*config->dirty_flag)++;
+}
+
+/**	Puts rows taken out by Rows_Unlink or Del_Whole_Row back at 'index'.	**/
+void Rows_Relink( int index, File_row **rows, int count )
+{
+	int i = 0;
+	for(i = 0; i < count; i++){
+		if(config->journal){
+			Journal_Record(JOURNAL_ROW_INSERT, index + i, 0, Row_Text(rows[i]), rows[i]->size);
+		}
+		rows[i]->flags &= ~ROW_STATE_VALID;
+	}
+	Line_Tree_Insert_Run(index, rows, count);
+	*config->num_of_rows += count;
+	Syntax_Invalidate(rows[0], index);
+	Syntax_Invalidate(Row_At(index + count), index + count);
+	(*config->dirty_flag)++;
+}
+
+void Row_Insert_String( File_row *row, int x, const char *string, size_t len )
+{	
+	Row_Own(row);
+	if(x < 0 || x > row->size){
+		x = row->size;	
+	}
+	Journal_Row(JOURNAL_INSERT, row, x, string, len);
+	Undo_Insert(row, x, string, len);
+	if(Row_Long(row)){
+		Row_Gap_Insert(row, x, string, len);
+		Update_Row(row);
+		(*config->dirty_flag)++;
+		return;
+	}
+	row->string = Pool_Grow(config->text_pool, row->string, &row->string_cap, row->size + 1, row->size + len + 1);
+
+	memmove(&row->string[x + len], &row->string[x], row->size - x + 1);
+	memcpy(&row->string[x], string, len);
+	row->size += len;
+	Update_Row(row);
+	(*config->dirty_flag)++;
+}
+
+void Row_Insert_Char( File_row *row, int x, int input )
+{	
+	char c = input;
+	Row_Insert_String(row, x, &c, 1);
+}
+
+void Row_Append_String( File_row *row, char *string, size_t len	)
+{
+	Journal_Row(JOURNAL_INSERT, row, row->size, string, len);
+	Undo_Insert(row, row->size, string, len);
+	Row_Own(row);
+	Row_Text(row);
+	row->string = Pool_Grow(config->text_pool, row->string, &row->string_cap, row->size + 1, row->size + len + 1);
+	if(row->chunks){
+		Row_Chunks_Edit(row, row->size, len);
+	}
+	memcpy(&row->string[row->size],string, len);
+	row->size += len;
+	row->string[row->size] = '\0';
+	Update_Row(row);
+	(*config->dirty_flag)++;
+}
+
+/**	Drops everything from 'x' on, and the room it took when most of	**/
+/**	the row goes.								**/
+void Row_Truncate( File_row *row, int x )
+{
+	Journal_Row(JOURNAL_TRUNCATE, row, x, NULL, 0);
+	Undo_Delete(row, x, row->size - x);
+	Row_Own(row);
+	Row_Text(row);
+	if(row->chunks){
+		Row_Chunks_Edit(row, x, x - row->size);
+	}
+	row->size = x;
+	row->string[row->size] = '\0';
+	if(row->string_cap > POOL_SMALL_MAX && row->string_cap / 4 > x + 1){
+		int cap = 0;
+		char *string = Pool_Alloc(config->text_pool, x + 1, &cap);
+		memcpy(string, row->string, x + 1);
+		Pool_Free(config->text_pool, row->string, row->string_cap);	/* the tail's room */
+		row->string = string;
+		row->string_cap = cap;
+	}
+	Update_Row(row);
+}
+
+/**	Moves string[x, size) of row index into a new row below it. Undo	**/
+/**	records only where, the rows hold the text.				**/
+void Row_Split( int index, int x )
+{
+	struct Undo_History *history = config->undo;
+	File_row *row = Row_At(index);
+	int applying = history->applying;
+	history->applying = 1;
+	Insert_Row(index + 1, &Row_Text(row)[x], row->size - x);
+	Row_Truncate(row, x);
+	history->applying = applying;
+	Undo_Row_Split(UNDO_ROW_SPLIT, index, x);
+}
+
+/**	Appends the row below index to it and removes the row below.	**/
+void Row_Join( int index )
+{
+	struct Undo_History *history = config->undo;
+	File_row *row = Row_At(index);
+	File_row *below = Row_At(index + 1);
+	int x = row->size;
+	int applying = history->applying;
+	history->applying = 1;
+	Row_Append_String(row, (char *)Row_Text(below), below->size);
+	Del_Whole_Row(index + 1);
+	history->applying = applying;
+	Undo_Row_Split(UNDO_ROW_JOIN, index, x);
+}
+
+/**	Removes string[x, x + len).						**/
+void Row_Delete_Span( File_row *row, int x, int len )
+{
+	if(x < 0 || len <= 0 || x + len > row->size){
+		return;
+	}
+	Journal_Row(JOURNAL_DELETE, row, x, NULL, len);
+	Undo_Delete(row, x, len);
+	Row_Own(row);
+	if(Row_Long(row)){
+		Row_Gap_Delete(row, x, len);
+	}else{
+		memmove(&row->string[x],&row->string[x + len], row->size - x - len + 1);
+		row->size -= len;
+	}
+	Update_Row(row);
+	(*config->dirty_flag)++;
+}
+
+void Row_Delete_Char( File_row *row, int x )
+{
+	if(x < 0 || x >= row->size){					
+		return;	
+	}
+	Row_Delete_Span(row, x, Row_Char_Len(row, x));
+}
+
+/**	Replaces string[x, x + old_len) with text in a single move of the	**/
+/**	rest of the row, for bulk edits that already know the row's index.	**/
+void Row_Splice( File_row *row, int index, int x, int old_len, const char *text, int len )
+{
+	if(old_len > 0){
+		Journal_Record(JOURNAL_DELETE, index, x, NULL, old_len);
+	}
+	if(len > 0){
+		Journal_Record(JOURNAL_INSERT, index, x, text, len);
+	}
+	Undo_Splice(row, index, x, old_len, text, len);
+	Row_Own(row);
+	if(Row_Long(row)){
+		Row_Gap_Delete(row, x, old_len);
+		Row_Gap_Insert(row, x, text, len);
+	}else{
+		if(len > old_len){
+			row->string = Pool_Grow(config->text_pool, row->string, &row->string_cap, row->size + 1, row->size + len - old_len + 1);
+		}
+		memmove(&row->string[x + len], &row->string[x + old_len], row->size - x - old_len + 1);
+		memcpy(&row->string[x], text, len);
+		row->size += len - old_len;
+	}
+	row->flags &= ~(ROW_RENDERED | ROW_MARKS);
+	Syntax_Invalidate(row, index);
+	(*config->dirty_flag)++;
+}
+
+/* UNDO */
+long long Undo_Cost( struct Undo_Record *rec )
+{
+	long long cost = sizeof(struct Undo_Record);
+	if(rec->op == UNDO_INSERT || rec->op == UNDO_DELETE || rec->op == UNDO_REPLACE){
+		cost += rec->cap;
+	}else if(rec->line){
+		cost += sizeof(File_row) + ((rec->line->flags & ROW_MAPPED) ? 0 : rec->line->string_cap);
+	}
+	return cost;
+}
+
+/**	Moves a row between HEAP_ROWS/HEAP_TEXT and HEAP_UNDO as undo takes	**/
+/**	it out of the tree or gives it back.					**/
+void Undo_Keep_Row( File_row *row, int keep )
+{
+	int block = 0;
+	long long bytes = 0;
+	Pool_Class(sizeof(File_row), &block);
+	Heap_Count(keep ? HEAP_ROWS : HEAP_UNDO, -block, 0);
+	Heap_Count(keep ? HEAP_UNDO : HEAP_ROWS, block, 0);
+	if(!(row->flags & ROW_MAPPED)){
+		bytes = row->string_cap;
+		Heap_Count(keep ? HEAP_TEXT : HEAP_UNDO, -bytes, 0);
+		Heap_Count(keep ? HEAP_UNDO : HEAP_TEXT, bytes, 0);
+	}
+}
+
+void Undo_Release( struct Undo_Record *rec )
+{
+	if(rec->op == UNDO_INSERT || rec->op == UNDO_DELETE || rec->op == UNDO_REPLACE){
+		Pool_Free(config->undo_pool, rec->text, rec->cap);
+	}else if(rec->line){
+		Undo_Keep_Row(rec->line, 0);
+		Row_Free(rec->line);
+	}
+	rec->text = NULL;
+}
+
+/**	Drops records[from, count).						**/
+void Undo_Truncate( int from )
+{
+	struct Undo_History *history = config->undo;
+	int i = 0;
+	for(i = from; i < history->count; i++){
+		history->bytes -= Undo_Cost(&history->records[i]);
+		Undo_Release(&history->records[i]);
+	}
+	history->count = from;
+	if(history->done > from){
+		history->done = from;
+	}
+	while(history->newest > history->start && history->newest >= from){
+		history->newest--;
+		while(history->newest > history->start && !history->records[history->newest].group){
+			history->newest--;
+		}
+	}
+}
+
+void Undo_Clear()
+{
+	struct Undo_History *history = config->undo;
+	Undo_Truncate(history->start);
+	Heap_Free(history->records);
+	memset(history, 0, sizeof(struct Undo_History));
+}
+
+/**	Evicts the oldest groups while over budget. The newest group is	**/
+/**	always kept, however large, so the last edit can be undone; it is	**/
+/**	closed once it alone is over budget, so the next edit starts a	**/
+/**	group and this one can go. A run of typing or a replace that big	**/
+/**	is then undone in more than one step.					**/
+void Undo_Trim()
+{
+	struct Undo_History *history = config->undo;
+	while(history->bytes > *config->undo_budget && history->newest > history->start){
+		int end = history->start + 1;
+		while(end < history->done && !history->records[end].group){
+			end++;
+		}
+		if(end >= history->done){
+			break;
+		}
+		for(; history->start < end; history->start++){
+			history->bytes -= Undo_Cost(&history->records[history->start]);
+			Undo_Release(&history->records[history->start]);
+		}
+	}
+	if(history->bytes > *config->undo_budget){
+		history->open = 0;
+	}
+}
+
+/**	Appends a record after dropping whatever could have been redone.	**/
+struct Undo_Record *Undo_Push( int op, int row, int x )
+{
+	struct Undo_History *history = config->undo;
+	Undo_Truncate(history->done);
+	if(history->count == history->cap){
+		if(history->start > history->count / 2){
+			memmove(history->records, &history->records[history->start], sizeof(struct Undo_Record) * (history->count - history->start));
+			history->count -= history->start;
+			history->newest -= history->start;
+			history->start = 0;
+		}else{
+			history->cap = history->cap ? history->cap * 2 : 256;
+			history->records = Heap_Alloc(HEAP_UNDO, history->records, sizeof(struct Undo_Record) * history->cap);
+			Check_Mem(history->records, "undo records");
+		}
+	}
+	struct Undo_Record *rec = &history->records[history->count++];
+	memset(rec, 0, sizeof(struct Undo_Record));
+	rec->op = op;
+	rec->row = row;
+	rec->x = x;
+	rec->group = !history->open;
+	if(rec->group){
+		history->newest = history->count - 1;
+	}
+	history->open = 1;
+	history->done = history->count;
+	return rec;
+}
+
+/**	The last record, if the next edit may still be folded into it.	**/
+struct Undo_Record *Undo_Last( int op, int row )
+{
+	struct Undo_History *history = config->undo;
+	if(!history->open || history->done != history->count || history->count == history->start){
+		return NULL;
+	}
+	struct Undo_Record *rec = &history->records[history->count - 1];
+	return (rec->op == op && rec->row == row) ? rec : NULL;
+}
+
+/**	Makes room for 'len' more bytes of text at 'at' in rec.		**/
+char *Undo_Text_Open( struct Undo_Record *rec, int at, int len )
+{
+	struct Undo_History *history = config->undo;
+	history->bytes -= rec->cap;
+	rec->text = Pool_Grow(config->undo_pool, rec->text, &rec->cap, rec->len, rec->len + len);
+	history->bytes += rec->cap;
+	memmove(&rec->text[at + len], &rec->text[at], rec->len - at);
+	rec->len += len;
+	return &rec->text[at];
+}
+
+/**	Records text going in. Typing at the end of the last insert only	**/
+/**	extends it, so a typed run is one record.				**/
+void Undo_Insert( File_row *row, int x, const char *text, int len )
+{
+	struct Undo_History *history = config->undo;
+	if(history->applying || len <= 0){
+		return;
+	}
+	int index = Row_Index(row);
+	struct Undo_Record *rec = Undo_Last(UNDO_INSERT, index);
+	if(!rec || rec->x + rec->len != x){
+		rec = Undo_Push(UNDO_INSERT, index, x);
+		history->bytes += Undo_Cost(rec);
+	}
+	memcpy(Undo_Text_Open(rec, rec->len, len), text, len);
+	Undo_Trim();
+}
+
+/**	Records string[x, x + len) before it is removed. Backspacing or	**/
+/**	deleting next to the last delete grows that record instead.	**/
+void Undo_Delete( File_row *row, int x, int len )
+{
+	struct Undo_History *history = config->undo;
+	if(history->applying || len <= 0){
+		return;
+	}
+	int index = Row_Index(row);
+	struct Undo_Record *rec = Undo_Last(UNDO_DELETE, index);
+	int at = 0;
+	if(rec && x + len == rec->x){
+		rec->x = x;
+	}else if(rec && x == rec->x){
+		at = rec->len;
+	}else{
+		rec = Undo_Push(UNDO_DELETE, index, x);
+		history->bytes += Undo_Cost(rec);
+	}
+	char *dest = Undo_Text_Open(rec, at, len);
+	const char *span = Row_Span(row, x, len, dest);
+	if(span != dest){
+		memcpy(dest, span, len);
+	}
+	Undo_Trim();
+}
+
+/**	Records a splice of row 'index'. The splices of one replace go into	**/
+/**	a single UNDO_REPLACE record, each as its row, x, both lengths, the	**/
+/**	old text and the new one.						**/
+void Undo_Splice( File_row *row, int index, int x, int old_len, const char *text, int len )
+{
+	struct Undo_History *history = config->undo;
+	if(history->applying){
+		return;
+	}
+	struct Undo_Record *rec = NULL;
+	if(history->open && history->done == history->count && history->count > history->start){
+		rec = &history->records[history->count - 1];
+	}
+	if(!rec || rec->op != UNDO_REPLACE){
+		rec = Undo_Push(UNDO_REPLACE, index, x);
+		history->bytes += Undo_Cost(rec);
+	}
+	int head[4] = {index, x, old_len, len};
+	char *dest = Undo_Text_Open(rec, rec->len, sizeof(head) + old_len + len);
+	memcpy(dest, head, sizeof(head));
+	dest += sizeof(head);
+	const char *span = Row_Span(row, x, old_len, dest);
+	if(span != dest){
+		memcpy(dest, span, old_len);
+	}
+	memcpy(&dest[old_len], text, len);
+	Undo_Trim();
+}
+
+void Undo_Row_Insert( int index )
+{
+	struct Undo_History *history = config->undo;
+	if(history->applying){
+		return;
+	}
+	history->bytes += Undo_Cost(Undo_Push(UNDO_ROW_INSERT, index, 0));
+	Undo_Trim();
+}
+
+/**	Records a split or join of row index at x by Row_Split or Row_Join.	**/
+void Undo_Row_Split( int op, int index, int x )
+{
+	struct Undo_History *history = config->undo;
+	if(history->applying){
+		return;
+	}
+	history->bytes += Undo_Cost(Undo_Push(op, index, x));
+	Undo_Trim();
+}
+
+/**	Takes over a row Del_Whole_Row removed, or frees it when undo is	**/
+/**	running.								**/
+void Undo_Row_Delete( int index, File_row *row )
+{
+	struct Undo_History *history = config->undo;
+	if(history->applying){
+		Row_Free(row);
+		return;
+	}
+	Row_Evict(row);
+	Undo_Keep_Row(row, 1);
+	struct Undo_Record *rec = Undo_Push(UNDO_ROW_DELETE, index, 0);
+	rec->line = row;
+	history->bytes += Undo_Cost(rec);
+	Undo_Trim();
+}
+
+/**	Closes the current group unless this key continues the same kind	**/
+/**	of run.									**/
+void Undo_Boundary( int kind )
+{
+	struct Undo_History *history = config->undo;
+	if(kind == UNDO_OTHER || kind != history->kind){
+		history->open = 0;
+	}
+	history->kind = kind;
+}
+
+/**	Records[from, to) are row records of one op forming a block of	**/
+/**	rows: deletes at one index, or inserts at consecutive ones. Takes	**/
+/**	the block out of the tree or links it back, in a single pass.	**/
+void Undo_Rows( int from, int to, int relink )
+{
+	struct Undo_History *history = config->undo;
+	struct Undo_Record *rec = &history->records[from];
+	int count = to - from;
+	int i = 0;
+	File_row **rows = malloc(sizeof(File_row *) * count);
+	Check_Mem(rows, "undo rows");
+	for(i = 0; i < count; i++){
+		history->bytes -= Undo_Cost(&rec[i]);
+		rows[i] = rec[i].line;
+	}
+	if(relink){
+		Rows_Relink(rec->row, rows, count);
+		for(i = 0; i < count; i++){
+			Undo_Keep_Row(rows[i], 0);
+			rec[i].line = NULL;
+		}
+	}else{
+		Rows_Unlink(rec->row, count, rows);
+		for(i = 0; i < count; i++){
+			Undo_Keep_Row(rows[i], 1);
+			rec[i].line = rows[i];
+		}
+	}
+	for(i = 0; i < count; i++){
+		history->bytes += Undo_Cost(&rec[i]);
+	}
+	free_mem(rows, "undo rows");
+	*config->cursor_y = rec->row;
+	*config->cursor_x = 0;
+}
+
+/**	Length of the block of row records of 'op' running from 'i' in	**/
+/**	the direction 'step', staying inside [low, high).			**/
+int Undo_Run( int i, int step, int low, int high )
+{
+	struct Undo_Record *records = config->undo->records;
+	int op = records[i].op;
+	int n = 1;
+	while(i + n * step >= low && i + n * step < high){
+		struct Undo_Record *next = &records[i + n * step];
+		struct Undo_Record *prev = &records[i + (n - 1) * step];
+		int want = (op == UNDO_ROW_DELETE) ? prev->row : prev->row + step;
+		if(next->op != op || next->row != want){
+			break;
+		}
+		n++;
+	}
+	return n;
+}
+
+void Undo_Cursor( int row, int x )
+{
+	*config->cursor_y = row;
+	*config->cursor_x = x;
+}
+
+/**	Takes back the splices of a replace record, or makes them again.	**/
+/**	They are on distinct rows in order, so one pass of an iterator	**/
+/**	reaches them all.							**/
+void Undo_Splices( struct Undo_Record *rec, int undo )
+{
+	struct Row_Iter iter;
+	int index = -1;
+	int at = 0;
+	while(at < rec->len){
+		int head[4];
+		memcpy(head, &rec->text[at], sizeof(head));
+		const char *old = &rec->text[at + sizeof(head)];
+		File_row *row = Row_Iter_Reach(&iter, &index, head[0]);
+		if(undo){
+			Row_Splice(row, head[0], head[1], head[3], old, head[2]);
+		}else{
+			Row_Splice(row, head[0], head[1], head[2], &old[head[2]], head[3]);
+		}
+		at += sizeof(head) + head[2] + head[3];
+	}
+	Undo_Cursor(rec->row, rec->x);
+}
+
+void Editor_Undo()
+{
+	struct Undo_History *history = config->undo;
+	if(history->done == history->start){
+		Set_Status_Message("Nothing to undo.");
+		return;
+	}
+	int group = history->done - 1;
+	while(!history->records[group].group){
+		group--;
+	}
+	history->applying = 1;
+	history->open = 0;
+	int i = history->done - 1;
+	while(i >= group){
+		struct Undo_Record *rec = &history->records[i];
+		File_row *row = Row_At(rec->row);
+		int n = 1;
+		switch(rec->op){
+			case UNDO_INSERT:
+				if(row){
+					Row_Delete_Span(row, rec->x, rec->len);
+				}
+				Undo_Cursor(rec->row, rec->x);
+				break;
+			case UNDO_DELETE:
+				if(row){
+					Row_Insert_String(row, rec->x, rec->text, rec->len);
+				}
+				Undo_Cursor(rec->row, rec->x + rec->len);
+				break;
+			case UNDO_ROW_DELETE:
+				n = Undo_Run(i, -1, group, history->done);
+				Undo_Rows(i - n + 1, i + 1, 1);
+				break;
+			case UNDO_ROW_INSERT:
+				n = Undo_Run(i, -1, group, history->done);
+				Undo_Rows(i - n + 1, i + 1, 0);
+				break;
+			case UNDO_REPLACE:
+				Undo_Splices(rec, 1);
+				break;
+			case UNDO_ROW_SPLIT:
+				Row_Join(rec->row);
+				Undo_Cursor(rec->row, rec->x);
+				break;
+			case UNDO_ROW_JOIN:
+				Row_Split(rec->row, rec->x);
+				Undo_Cursor(rec->row + 1, 0);
+				break;
+		}
+		i -= n;
+	}
+	history->done = group;
+	history->applying = 0;
+}
+
+void Editor_Redo()
+{
+	struct Undo_History *history = config->undo;
+	if(history->done == history->count){
+		Set_Status_Message("Nothing to redo.");
+		return;
+	}
+	int end = history->done + 1;
+	while(end < history->count && !history->records[end].group){
+		end++;
+	}
+	history->applying = 1;
+	history->open = 0;
+	int i = history->done;
+	while(i < end){
+		struct Undo_Record *rec = &history->records[i];
+		File_row *row = Row_At(rec->row);
+		int n = 1;
+		switch(rec->op){
+			case UNDO_INSERT:
+				if(row){
+					Row_Insert_String(row, rec->x, rec->text, rec->len);
+				}
+				Undo_Cursor(rec->row, rec->x + rec->len);
+				break;
+			case UNDO_DELETE:
+				if(row){
+					Row_Delete_Span(row, rec->x, rec->len);
+				}
+				Undo_Cursor(rec->row, rec->x);
+				break;
+			case UNDO_ROW_DELETE:
+				n = Undo_Run(i, 1, history->done, end);
+				Undo_Rows(i, i + n, 0);
+				break;
+			case UNDO_ROW_INSERT:
+				n = Undo_Run(i, 1, history->done, end);
+				Undo_Rows(i, i + n, 1);
+				break;
+			case UNDO_REPLACE:
+				Undo_Splices(rec, 0);
+				break;
+			case UNDO_ROW_SPLIT:
+				Row_Split(rec->row, rec->x);
+				Undo_Cursor(rec->row + 1, 0);
+				break;
+			case UNDO_ROW_JOIN:
+				Row_Join(rec->row);
+				Undo_Cursor(rec->row, rec->x);
+				break;
+		}
+		i += n;
+	}
+	history->done = end;
+	history->applying = 0;
+}
+
+/* EDITOR OPERATIONS */
+void Editor_Insert_Char( int key_press )
+{
+	Map_Index_Until(*config->cursor_y + 1);
+	if(*config->cursor_y == *config->num_of_rows){
+		Insert_Row(*config->num_of_rows, "",0);
+	}
+	Row_Insert_Char( Row_At(*config->cursor_y),*config->cursor_x, key_press);
+	(*config->cursor_x)++;
+}
+
+void Editor_Insert_Newline()
+{
+	Map_Index_Until(*config->cursor_y + 1);
+	if(*config->cursor_x == 0){
+		Insert_Row(*config->cursor_y, "", 0);
+	}else{
+		Row_Split(*config->cursor_y, *config->cursor_x);
+	}
+	(*config->cursor_y)++;
+	*config->cursor_x = 0;
+}
+
+/**	Inserts text at the cursor. Each line end ("\n", "\r" or "\r\n")	**/
+/**	starts a new row; the rest of the cursor's row moves to the last	**/
+/**	one. Every row touched is updated once, however long the text.	**/
+void Editor_Insert_Text( const char *text, int len )
+{
+	if(len <= 0){
+		return;
+	}
+	Map_Index_Until(*config->cursor_y + 1);
+	int past_end = (*config->cursor_y == *config->num_of_rows);
+	if(past_end){
+		Insert_Row(*config->num_of_rows, "", 0);
+	}
+	File_row *row = Row_At(*config->cursor_y);
+	int eol = Scan_Until_Any(text, len, "\r\n", 2);
+	if(eol == len){
+		Row_Insert_String(row, *config->cursor_x, text, len);
+		*config->cursor_x += len;
+		return;
+	}
+
+	int tail_len = row->size - *config->cursor_x;
+	if(tail_len > 0){
+		Row_Split(*config->cursor_y, *config->cursor_x);	/* the tail row ends up at the last line */
+	}
+	if(eol > 0){
+		Row_Insert_String(row, row->size, text, eol);
+	}
+
+	int at = *config->cursor_y;
+	int pos = eol;		/* always at a line end here */
+	int blank = (eol == 0);	/* only line ends so far */
+	while(1){
+		pos += (text[pos] == '\r' && pos + 1 < len && text[pos + 1] == '\n') ? 2 : 1;
+		eol = Scan_Until_Any(&text[pos], len - pos, "\r\n", 2);
+		at++;
+		if(pos + eol < len){
+			Insert_Row(at, (char *)&text[pos], eol);
+			blank = blank && (eol == 0);
+			pos += eol;
+			continue;
+		}
+		if(tail_len > 0){
+			if(eol > 0){
+				Row_Insert_String(Row_At(at), 0, &text[pos], eol);
+			}
+			break;
+		}
+		if(past_end && blank && eol == 0){
+			break;		/* as typed: the cursor stays past the end */
+		}
+		Insert_Row(at, (char *)&text[pos], eol);
+		break;
+	}
+	*config->cursor_y = at;
+	*config->cursor_x = eol;
+}
+
+void Editor_Delete_Char()
+{
+	if(*config->cursor_y == *config->num_of_rows){
+		return;
+	}
+
+	if(*config->cursor_x == 0 && *config->cursor_y == 0){
+		return;
+	}
+	File_row *row = Row_At(*config->cursor_y);
+	if(*config->cursor_x > 0){
+		*config->cursor_x = Row_Char_Start(row, *config->cursor_x - 1);
+		Row_Delete_Char(row,*config->cursor_x);
+	}else{
+		*config->cursor_x = Row_At(*config->cursor_y - 1)->size;
+		Row_Join(*config->cursor_y - 1);
+		(*config->cursor_y)--;	
+	}
+}
+							
+/* FILE INPUT/OUTPUT */
+/**	Collects the offsets of up to 'max' newlines in data[from, to). The	**/
+/**	scan stops early once 'out' is nearly full, *scanned says how far it got.	**/
+int Newline_Scan_Scalar( const char *data, size_t from, size_t to, size_t *out, int max, size_t *scanned )
+{
+	int count = 0;
+	while(count < max && from < to){
+		const char *nl = memchr(&data[from], '\n', to - from);
+		if(!nl){
+			from = to;
+			break;
+		}
+		out[count++] = nl - data;
+		from = out[count - 1] + 1;
+	}
+	*scanned = from;
+	return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+int Newline_Scan_SSE2( const char *data, size_t from, size_t to, size_t *out, int max, size_t *scanned )
+{
+	int count = 0;
+	__m128i newline = _mm_set1_epi8('\n');
+	while(from + 16 <= to && count + 16 <= max){
+		__m128i block = _mm_loadu_si128((const __m128i *)&data[from]);
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+		while(mask){
+			out[count++] = from + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+		from += 16;
+	}
+	size_t rest = 0;
+	count += Newline_Scan_Scalar(data, from, to, &out[count], max - count, &rest);
+	*scanned = rest;
+	return count;
+}
+
+__attribute__((target("avx2")))
+int Newline_Scan_AVX2( const char *data, size_t from, size_t to, size_t *out, int max, size_t *scanned )
+{
+	int count = 0;
+	__m256i newline = _mm256_set1_epi8('\n');
+	while(from + 64 <= to && count + 64 <= max){
+		__m256i low = _mm256_loadu_si256((const __m256i *)&data[from]);
+		__m256i high = _mm256_loadu_si256((const __m256i *)&data[from + 32]);
+		unsigned long long mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, newline));
+		mask |= (unsigned long long)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, newline)) << 32;
+		while(mask){
+			out[count++] = from + __builtin_ctzll(mask);
+			mask &= mask - 1;
+		}
+		from += 64;
+	}
+	size_t rest = 0;
+	count += Newline_Scan_Scalar(data, from, to, &out[count], max - count, &rest);
+	*scanned = rest;
+	return count;
+}
+#endif
+
+int Newline_Scan( const char *data, size_t from, size_t to, size_t *out, int max, size_t *scanned )
+{
+#if defined(__x86_64__) || defined(__i386__)
+	static int level = -1;
+	if(level == -1){
+		__builtin_cpu_init();
+		level = __builtin_cpu_supports("avx2") ? 2 : (__builtin_cpu_supports("sse2") ? 1 : 0);
+	}
+	if(level == 2){
+		return Newline_Scan_AVX2(data, from, to, out, max, scanned);
+	}
+	if(level == 1){
+		return Newline_Scan_SSE2(data, from, to, out, max, scanned);
+	}
+#endif
+	return Newline_Scan_Scalar(data, from, to, out, max, scanned);
+}
+
+int Map_Pending()
+{
+	return config->map && config->map->indexed < config->map->length;
+}
+
+/**	Splits up to 'lines' more rows out of the mapping.			**/
+void Map_Index_Lines( int lines )
+{
+	size_t offsets[MAP_INDEX_BATCH];
+	struct Mapping *map = config->map;
+
+	while(lines > 0 && Map_Pending()){
+		size_t scanned = 0;
+		int max = lines < MAP_INDEX_BATCH ? lines : MAP_INDEX_BATCH;
+		int count = Newline_Scan(map->data, map->indexed, map->length, offsets, max, &scanned);
+		int i = 0;
+		for(i = 0; i < count; i++){
+			size_t linelen = offsets[i] - map->indexed;
+			while(linelen > 0 && map->data[map->indexed + linelen - 1] == '\r'){
+				linelen--;
+			}
+			Insert_Row_View(&map->data[map->indexed], linelen);
+			map->indexed = offsets[i] + 1;
+		}
+		lines -= count;
+		if(scanned == map->length && count < max && map->indexed < map->length){
+			size_t linelen = map->length - map->indexed;
+			while(linelen > 0 && map->data[map->indexed + linelen - 1] == '\r'){
+				linelen--;
+			}
+			Insert_Row_View(&map->data[map->indexed], linelen);
+			map->indexed = map->length;
+			lines--;
+		}
+	}
+}
+
+void Map_Index_Until( int rows )
+{
+	if(Map_Pending() && rows >= *config->num_of_rows){
+		Map_Index_Lines(rows - *config->num_of_rows + 1);
+	}
+}
+
+void Open_File( char *filename )
+{
+	size_t fn_len = 0;
+	struct stat st;
+
+	int fd = open(filename, O_RDONLY);
+	if(fd == -1 && errno == ENOENT){
+		fd = open(filename, O_RDWR | O_CREAT, 0644);
+	}
+	if(fd == -1 || fstat(fd, &st) == -1){
+		perror("open: ");
+		exit(1);
+	}
+	fn_len = strlen(filename);
+	config->filename = strndup(filename, fn_len + 1);
+
+	Select_Syntax_High_Light();
+
+	if(st.st_size > 0){
+		char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(data == MAP_FAILED){
+			perror("mmap: ");
+			exit(1);
+		}
+		madvise(data, st.st_size, MADV_SEQUENTIAL);
+		config->map = malloc(sizeof(struct Mapping));
+		Check_Mem(config->map,"config->map");
+		config->map->data = data;
+		config->map->length = st.st_size;
+		config->map->indexed = 0;
+
+		/**	Only the first screens are indexed up front, Read_Key splits	**/
+		/**	out the rest while waiting for input.				**/
+		Map_Index_Until(*config->screen_rows * 2);
+	}
+	close(fd);
+	*config->dirty_flag = 0;
+	Journal_Open();
+}
+
+void Save_Orphan( char *string, int cap )
+{
+	struct Save_Job *job = config->save;
+	if(job->orphan_count == job->orphan_cap){
+		job->orphan_cap = job->orphan_cap ? job->orphan_cap * 2 : 64;
+		job->orphans = realloc(job->orphans, sizeof(struct Save_Orphan) * job->orphan_cap);
+		Check_Mem(job->orphans, "save orphans");
+	}
+	job->orphans[job->orphan_count].string = string;
+	job->orphans[job->orphan_count].cap = cap;
+	job->orphan_count++;
+}
+
+/**	writev until all of iov is written, resuming after short writes.	**/
+int Save_Write( int fd, struct iovec *iov, int count )
+{
+	while(count > 0){
+		ssize_t n = writev(fd, iov, count);
+		if(n == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		while(count > 0 && (size_t)n >= iov->iov_len){
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if(count > 0){
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/**	Makes the rename durable. Not every filesystem can fsync a	**/
+/**	directory, so failures are ignored.					**/
+void Save_Sync_Dir( const char *path )
+{
+	const char *slash = strrchr(path, '/');
+	char *dir = slash ? strndup(path, slash == path ? 1 : slash - path) : strdup(".");
+	if(!dir){
+		return;
+	}
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if(fd != -1){
+		fsync(fd);
+		close(fd);
+	}
+	free(dir);
+}
+
+/**	Writer thread: streams the spans in batches of up to SAVE_BATCH	**/
+/**	iovecs, long spans cut at SAVE_BATCH_BYTES so progress keeps moving,	**/
+/**	then replaces the target with the temp file.				**/
+void *Save_Worker( void *arg )
+{
+	struct Save_Job *job = arg;
+	struct iovec iov[SAVE_BATCH];
+	long long written = 0;
+	size_t off = 0;
+	int span = 0;
+	while(span < job->span_count){
+		int count = 0;
+		size_t bytes = 0;
+		while(span < job->span_count && count < SAVE_BATCH - 1 && bytes < SAVE_BATCH_BYTES){
+			struct Save_Span *s = &job->spans[span];
+			size_t take = s->len - off;
+			if(take > SAVE_BATCH_BYTES - bytes){
+				take = SAVE_BATCH_BYTES - bytes;
+			}
+			if(take){
+				iov[count].iov_base = (char *)s->data + off;
+				iov[count].iov_len = take;
+				count++;
+				off += take;
+				bytes += take;
+			}
+			if(off == s->len){
+				iov[count].iov_base = "\n";
+				iov[count].iov_len = 1;
+				count++;
+				bytes++;
+				span++;
+				off = 0;
+			}
+		}
+		if(Save_Write(job->fd, iov, count) == -1){
+			job->error = errno;
+			break;
+		}
+		written += bytes;
+		__atomic_store_n(&job->written, written, __ATOMIC_RELAXED);
+	}
+	if(!job->error && fsync(job->fd) == -1){
+		job->error = errno;
+	}
+	if(close(job->fd) == -1 && !job->error){
+		job->error = errno;
+	}
+	if(!job->error && rename(job->temp, job->target) == -1){
+		job->error = errno;
+	}
+	if(job->error){
+		unlink(job->temp);
+	}else{
+		Save_Sync_Dir(job->target);
+	}
+	__atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+void Save_Free( struct Save_Job *job )
+{
+	free(job->spans);
+	free(job->orphans);
+	free(job->target);
+	free(job->temp);
+	free(job);
+}
+
+/**	Clears ROW_SHARED from the rows a save snapshot, and lets go of	**/
+/**	the strings edits replaced while it ran.				**/
+void Save_Unshare( struct Save_Job *job )
+{
+	struct Row_Iter iter;
+	File_row *row = Row_Iter_Seek(&iter, 0);
+	for(; row; row = Row_Iter_Next(&iter)){
+		row->flags &= ~ROW_SHARED;
+	}
+	int i = 0;
+	for(i = 0; i < job->orphan_count; i++){
+		Pool_Free(config->text_pool, job->orphans[i].string, job->orphans[i].cap);
+	}
+	job->orphan_count = 0;
+}
+
+double Save_Seconds( struct timespec *from )
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - from->tv_sec) + (now.tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/**	Opens a temp file beside the target and snapshots the rows into	**/
+/**	spans. Unedited mapped rows that follow each other in the file are	**/
+/**	merged, so an untouched file goes out as a single span.		**/
+struct Save_Job *Save_Start( const char *path )
+{
+	struct Save_Job *job = calloc(1, sizeof(struct Save_Job));
+	Check_Mem(job, "save job");
+	job->target = realpath(path, NULL);
+	if(!job->target){
+		job->target = strdup(path);
+		Check_Mem(job->target, "save target");
+	}
+	struct stat st;
+	mode_t mode = (stat(job->target, &st) == 0) ? (st.st_mode & 07777) : 0644;
+	job->temp = malloc(strlen(job->target) + 8);
+	Check_Mem(job->temp, "save temp");
+	sprintf(job->temp, "%s.XXXXXX", job->target);
+	job->fd = mkstemp(job->temp);
+	if(job->fd == -1){
+		int error = errno;
+		Save_Free(job);
+		errno = error;
+		return NULL;
+	}
+	fchmod(job->fd, mode);
+
+	Map_Index_Lines(INT_MAX);
+	job->spans = malloc(sizeof(struct Save_Span) * (*config->num_of_rows + 1));
+	Check_Mem(job->spans, "save spans");
+	int merge = 0;
+	struct Row_Iter iter;
+	File_row *row = Row_Iter_Seek(&iter, 0);
+	for(; row; row = Row_Iter_Next(&iter)){
+		const char *text = Row_Text(row);
+		job->total += row->size + 1;
+		if(row->flags & ROW_MAPPED){
+			struct Save_Span *last = &job->spans[job->span_count - 1];
+			if(merge && last->data + last->len + 1 == text && last->data[last->len] == '\n'){
+				last->len += row->size + 1;
+				continue;
+			}
+			merge = 1;
+		}else{
+			row->flags |= ROW_SHARED;
+			merge = 0;
+		}
+		job->spans[job->span_count].data = text;
+		job->spans[job->span_count].len = row->size;
+		job->span_count++;
+	}
+	job->dirty = *config->dirty_flag;
+	job->journal_mark = config->journal ? config->journal->logged : 0;
+	clock_gettime(CLOCK_MONOTONIC, &job->start);
+	job->shown = job->start;
+
+	config->save = job;
+	int error = pthread_create(&job->thread, NULL, Save_Worker, job);
+	if(error){
+		Save_Unshare(job);
+		config->save = NULL;
+		close(job->fd);
+		unlink(job->temp);
+		Save_Free(job);
+		errno = error;
+		return NULL;
+	}
+	return job;
+}
+
+int Save_Pending()
+{
+	return config->save != NULL;
+}
+
+/**	Reports on the running save; once the writer is done, or right away	**/
+/**	when 'wait' is set, joins it and releases the snapshot. Returns 1	**/
+/**	when the status bar changed.						**/
+int Save_Poll( int wait )
+{
+	struct Save_Job *job = config->save;
+	if(!job){
+		return 0;
+	}
+	if(!wait && !__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)){
+		if(Save_Seconds(&job->shown) * 1000 < SAVE_TICK){
+			return 0;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &job->shown);
+		long long written = __atomic_load_n(&job->written, __ATOMIC_RELAXED);
+		double seconds = Save_Seconds(&job->start);
+		Set_Status_Message("Saving %s: %d%% (%.1f MB/s)", config->filename,
+				   job->total ? (int)(written * 100 / job->total) : 100, written / seconds / 1e6);
+		return 1;
+	}
+	pthread_join(job->thread, NULL);
+	double seconds = Save_Seconds(&job->start);
+	Save_Unshare(job);
+	config->save = NULL;
+	if(job->error){
+		Set_Status_Message("Error Saving: %s", strerror(job->error));
+	}else{
+		Set_Status_Message("%s Filename Saved, %lld Bytes Written (%.1f MB/s).", config->filename,
+				   job->total, seconds > 0 ? job->total / seconds / 1e6 : 0.0);
+		*config->dirty_flag -= job->dirty;	/* edits made during the save remain */
+		int journal_error = 0;
+		if(config->journal && Journal_Rebase(job->journal_mark) == -1){
+			journal_error = errno;
+			Journal_Close(1);		/* its header no longer matches the file */
+		}
+		if(!config->journal && !*config->dirty_flag){
+			Journal_Open();
+		}
+		if(journal_error){
+			Set_Status_Message("%.20s Saved. Journal Failed: %s%s", config->filename, strerror(journal_error),
+					   config->journal ? ", Started A New One." : ", Off Until Next Save.");
+		}
+	}
+	Save_Free(job);
+	return 1;
+}
+
+void Save_File()
+{
+	if( config->filename == NULL){
+		config->filename = Prompt("Save as: %s",NULL);
+		if(!config->filename){
+			Set_Status_Message("Save Cancelled.");
+			return;
+		}
+		
+		Select_Syntax_High_Light();
+	}
+	Save_Poll(1);		/* one save at a time */
+	if(!Save_Start(config->filename)){
+		Set_Status_Message("Error Saving: %s",strerror(errno));
+		return;
+	}
+	Set_Status_Message("Saving %s...", config->filename);
+}
+
+/* JOURNAL */
+/**	".name.tswp" beside the file.						**/
+char *Journal_Path( const char *filename )
+{
+	const char *base = strrchr(filename, '/');
+	int dir_len = base ? base - filename + 1 : 0;
+	base = base ? base + 1 : filename;
+	char *path = malloc(dir_len + strlen(base) + 7);
+	Check_Mem(path, "journal path");
+	sprintf(path, "%.*s.%s.tswp", dir_len, filename, base);
+	return path;
+}
+
+int Journal_Varint( char *out, unsigned long long value )
+{
+	int len = 0;
+	while(value >= 0x80){
+		out[len++] = (char)(value | 0x80);
+		value >>= 7;
+	}
+	out[len++] = (char)value;
+	return len;
+}
+
+/**	Reads a varint from *p, 0 when it runs past 'end'.			**/
+int Journal_Read_Varint( const unsigned char **p, const unsigned char *end, unsigned long long *value )
+{
+	int shift = 0;
+	*value = 0;
+	while(*p < end && shift < 64){
+		unsigned char c = *(*p)++;
+		*value |= (unsigned long long)(c & 0x7f) << shift;
+		if(!(c & 0x80)){
+			return 1;
+		}
+		shift += 7;
+	}
+	return 0;
+}
+
+void Journal_Record( int op, int index, int x, const char *text, int len )
+{
+	struct Journal *journal = config->journal;
+	if(!journal){
+		return;
+	}
+	char head[32];
+	int head_len = 0;
+	head[head_len++] = op;
+	head_len += Journal_Varint(&head[head_len], index);
+	if(op != JOURNAL_ROW_INSERT && op != JOURNAL_ROW_DELETE){
+		head_len += Journal_Varint(&head[head_len], x);
+	}
+	if(op == JOURNAL_INSERT || op == JOURNAL_ROW_INSERT || op == JOURNAL_DELETE){
+		head_len += Journal_Varint(&head[head_len], len);
+	}
+	if(op == JOURNAL_DELETE){
+		len = 0;
+	}
+	int error = __atomic_load_n(&journal->error, __ATOMIC_RELAXED);
+	if(error){
+		/**	the file stops at the failed batch, logged no longer says where	**/
+		Journal_Close(0);
+		Set_Status_Message("Journal Failed: %s, Off Until Next Save.", strerror(error));
+		return;
+	}
+	pthread_mutex_lock(&journal->lock);
+	Append_Buffer(&journal->pending, head, head_len);
+	if(len){
+		Append_Buffer(&journal->pending, text, len);
+	}
+	if(journal->pending.length >= JOURNAL_FLUSH_BYTES){
+		pthread_cond_signal(&journal->wake);
+	}
+	pthread_mutex_unlock(&journal->lock);
+	journal->logged += head_len + len;
+}
+
+void Journal_Row( int op, File_row *row, int x, const char *text, int len )
+{
+	if(config->journal){
+		Journal_Record(op, Row_Index(row), x, text, len);
+	}
+}
+
+int Journal_Write( int fd, const char *data, size_t len )
+{
+	while(len > 0){
+		ssize_t n = write(fd, data, len);
+		if(n == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**	Commits whatever has been logged. Called with journal->lock held,	**/
+/**	which is dropped while writing so logging never waits on the disk.	**/
+void Journal_Commit( struct Journal *journal )
+{
+	if(journal->pending.length == 0){
+		return;
+	}
+	pthread_mutex_lock(&journal->io);
+	struct Buffer batch = journal->pending;
+	journal->pending = journal->writing;
+	journal->writing = batch;
+	pthread_mutex_unlock(&journal->lock);
+	if(!__atomic_load_n(&journal->error, __ATOMIC_RELAXED)
+	   && (Journal_Write(journal->fd, batch.string, batch.length) == -1 || fdatasync(journal->fd) == -1)){
+		__atomic_store_n(&journal->error, errno ? errno : EIO, __ATOMIC_RELAXED);
+	}
+	journal->writing.length = 0;
+	pthread_mutex_unlock(&journal->io);
+	pthread_mutex_lock(&journal->lock);
+}
+
+void *Journal_Writer( void *arg )
+{
+	struct Journal *journal = arg;
+	pthread_mutex_lock(&journal->lock);
+	while(!journal->stop){
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += JOURNAL_COMMIT_MS * 1000000L;
+		if(until.tv_nsec >= 1000000000L){
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&journal->wake, &journal->lock, &until);
+		Journal_Commit(journal);
+	}
+	Journal_Commit(journal);
+	pthread_mutex_unlock(&journal->lock);
+	return NULL;
+}
+
+/**	Identifies the saved file, so ops are only replayed onto the file	**/
+/**	they were made against.							**/
+int Journal_Header_Fill( struct Journal_Header *header )
+{
+	struct stat st;
+	memset(header, 0, sizeof(struct Journal_Header));
+	if(stat(config->filename, &st) == -1){
+		return -1;
+	}
+	memcpy(header->magic, JOURNAL_MAGIC, 4);
+	header->version = JOURNAL_VERSION;
+	header->size = st.st_size;
+	header->inode = st.st_ino;
+	header->mtime_sec = st.st_mtim.tv_sec;
+	header->mtime_nsec = st.st_mtim.tv_nsec;
+	return 0;
+}
+
+/**	Applies one op, 0 when the record is cut short or does not fit	**/
+/**	the rows, which ends the replay. The mapping is only indexed as far	**/
+/**	as the ops reach, like it was when they were logged. *last caches	**/
+/**	the row of the previous op, since runs of ops hit the same row.	**/
+int Journal_Apply( const unsigned char **p, const unsigned char *end, File_row **last, int *last_index )
+{
+	unsigned long long index = 0, x = 0, len = 0;
+	int op = *(*p)++;
+	if(!Journal_Read_Varint(p, end, &index)){
+		return 0;
+	}
+	if(op != JOURNAL_ROW_INSERT && op != JOURNAL_ROW_DELETE && !Journal_Read_Varint(p, end, &x)){
+		return 0;
+	}
+	if((op == JOURNAL_INSERT || op == JOURNAL_ROW_INSERT || op == JOURNAL_DELETE)
+	   && !Journal_Read_Varint(p, end, &len)){
+		return 0;
+	}
+	if(op != JOURNAL_DELETE && len > (unsigned long long)(end - *p)){
+		return 0;
+	}
+	if(index >= INT_MAX || len >= INT_MAX){
+		return 0;
+	}
+	Map_Index_Until(index + 1);
+	int rows = *config->num_of_rows;
+	File_row *row = *last;
+	if(!row || *last_index != (int)index){
+		row = (index < (unsigned long long)rows) ? Row_At(index) : NULL;
+	}
+	*last = row;
+	*last_index = index;
+	switch(op){
+		case JOURNAL_INSERT:
+			if(!row || x > (unsigned long long)row->size){
+				return 0;
+			}
+			Row_Insert_String(row, x, (const char *)*p, len);
+			break;
+		case JOURNAL_DELETE:
+			if(!row || x + len > (unsigned long long)row->size){
+				return 0;
+			}
+			Row_Delete_Span(row, x, len);
+			len = 0;
+			break;
+		case JOURNAL_TRUNCATE:
+			if(!row || x > (unsigned long long)row->size){
+				return 0;
+			}
+			Row_Truncate(row, x);
+			break;
+		case JOURNAL_ROW_INSERT:
+			if(index > (unsigned long long)rows){
+				return 0;
+			}
+			Insert_Row(index, (char *)*p, len);
+			*last = NULL;
+			break;
+		case JOURNAL_ROW_DELETE:
+			if(!row){
+				return 0;
+			}
+			Del_Whole_Row(index);
+			*last = NULL;
+			break;
+		default:
+			return 0;
+	}
+	*p += len;
+	return 1;
+}
+
+/**	Replays the journal at 'path' if it belongs to the file as it is on	**/
+/**	disk and is newer than it. Returns the ops applied, -1 when there is	**/
+/**	nothing to recover, or -2 when the journal holds ops that cannot be	**/
+/**	replayed onto this file; *end is where the last whole op stopped.	**/
+int Journal_Replay( const char *path, const struct Journal_Header *current, off_t *end )
+{
+	struct stat st, file;
+	int fd = open(path, O_RDONLY);
+	if(fd == -1){
+		return -1;
+	}
+	if(fstat(fd, &st) == -1 || st.st_size <= (off_t)sizeof(struct Journal_Header)){
+		close(fd);
+		return -1;
+	}
+	if(stat(config->filename, &file) == -1 || st.st_mtim.tv_sec < file.st_mtim.tv_sec){
+		close(fd);
+		return -2;
+	}
+	unsigned char *data = malloc(st.st_size);
+	Check_Mem(data, "journal");
+	off_t got = 0;
+	while(got < st.st_size){
+		ssize_t n = read(fd, &data[got], st.st_size - got);
+		if(n == -1 && errno == EINTR){
+			continue;
+		}
+		if(n <= 0){
+			break;
+		}
+		got += n;
+	}
+	close(fd);
+	if(got != st.st_size || memcmp(data, current, sizeof(struct Journal_Header)) != 0){
+		free(data);
+		return -2;
+	}
+
+	File_row *last = NULL;
+	int last_index = -1;
+	const unsigned char *p = data + sizeof(struct Journal_Header);
+	const unsigned char *stop = data + st.st_size;
+	int ops = 0;
+	while(p < stop){
+		const unsigned char *start = p;
+		if(!Journal_Apply(&p, stop, &last, &last_index)){
+			p = start;
+			break;
+		}
+		ops++;
+	}
+	*end = p - data;
+	free(data);
+	return ops;
+}
+
+/**	Moves a journal that cannot be replayed out of the way, to the first	**/
+/**	free name of path.old, path.old1, ..., so its ops are never lost.	**/
+/**	Returns the new name, or NULL when it could not be moved.		**/
+char *Journal_Set_Aside( const char *path )
+{
+	char *aside = malloc(strlen(path) + 16);
+	Check_Mem(aside, "journal aside");
+	int n = 0;
+	for(n = 0; n < 100; n++){
+		if(n){
+			sprintf(aside, "%s.old%d", path, n);
+		}else{
+			sprintf(aside, "%s.old", path);
+		}
+		if(link(path, aside) == 0){
+			unlink(path);
+			return aside;
+		}
+		if(errno != EEXIST){
+			break;
+		}
+	}
+	free(aside);
+	return NULL;
+}
+
+/**	Starts journaling config->filename, first replaying what a previous	**/
+/**	session left behind. Without a writable journal the editor just	**/
+/**	runs unjournaled.							**/
+void Journal_Open()
+{
+	if(!config->filename || config->journal){
+		return;
+	}
+	struct Journal_Header header;
+	if(Journal_Header_Fill(&header) == -1){
+		return;
+	}
+	char *path = Journal_Path(config->filename);
+	off_t end = 0;
+	int recovered = Journal_Replay(path, &header, &end);
+	int fd = -1;
+	if(recovered == -2){
+		char *aside = Journal_Set_Aside(path);
+		if(!aside){
+			Set_Status_Message("Journal %s does not match the file, not journaling.", path);
+			free(path);
+			return;
+		}
+		Set_Status_Message("Journal did not match the file, kept as %s.", aside);
+		free(aside);
+	}
+	if(recovered >= 0){
+		fd = open(path, O_WRONLY);
+		if(fd != -1 && (ftruncate(fd, end) == -1 || lseek(fd, end, SEEK_SET) == -1)){
+			close(fd);
+			fd = -1;
+		}
+	}else{
+		end = sizeof(struct Journal_Header);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if(fd != -1 && Journal_Write(fd, (const char *)&header, sizeof(header)) == -1){
+			close(fd);
+			unlink(path);
+			fd = -1;
+		}
+	}
+	if(fd == -1){
+		free(path);
+		return;
+	}
+
+	struct Journal *journal = calloc(1, sizeof(struct Journal));
+	Check_Mem(journal, "journal");
+	journal->pending.kind = HEAP_JOURNAL;
+	journal->writing.kind = HEAP_JOURNAL;
+	journal->path = path;
+	journal->fd = fd;
+	journal->logged = end - sizeof(struct Journal_Header);
+	pthread_mutex_init(&journal->lock, NULL);
+	pthread_mutex_init(&journal->io, NULL);
+	pthread_cond_init(&journal->wake, NULL);
+	if(pthread_create(&journal->thread, NULL, Journal_Writer, journal) != 0){
+		close(fd);
+		free(path);
+		free(journal);
+		return;
+	}
+	config->journal = journal;
+	if(recovered > 0){
+		Set_Status_Message("Recovered %d edits from %s.", recovered, path);
+	}
+}
+
+/**	Stops the writer after a last commit. The journal is removed when	**/
+/**	asked to, or when it holds no ops.					**/
+void Journal_Close( int remove )
+{
+	struct Journal *journal = config->journal;
+	if(!journal){
+		return;
+	}
+	pthread_mutex_lock(&journal->lock);
+	journal->stop = 1;
+	pthread_cond_signal(&journal->wake);
+	pthread_mutex_unlock(&journal->lock);
+	pthread_join(journal->thread, NULL);
+	close(journal->fd);
+	if(remove || journal->logged == 0){
+		unlink(journal->path);
+	}
+	pthread_mutex_destroy(&journal->lock);
+	pthread_mutex_destroy(&journal->io);
+	pthread_cond_destroy(&journal->wake);
+	Free_Buffer(&journal->pending);
+	Free_Buffer(&journal->writing);
+	free_mem(journal->path, "journal path");
+	free_mem(journal, "journal");
+	config->journal = NULL;
+}
+
+/**	After a save: restarts the journal against the new file, keeping	**/
+/**	only the ops logged after 'mark', which the save did not include.	**/
+/**	A save under a new name moves the journal beside it. Returns -1	**/
+/**	with errno set when the old journal is left as it was.			**/
+int Journal_Rebase( long long mark )
+{
+	struct Journal *journal = config->journal;
+	struct Journal_Header header;
+	if(!journal || Journal_Header_Fill(&header) == -1){
+		return -1;
+	}
+	pthread_mutex_lock(&journal->lock);
+	pthread_mutex_lock(&journal->io);
+	if(journal->error){
+		/**	logged counts bytes that never reached the file		**/
+		int error = journal->error;
+		pthread_mutex_unlock(&journal->io);
+		pthread_mutex_unlock(&journal->lock);
+		errno = error;
+		return -1;
+	}
+	long long tail = journal->logged - mark;
+	int pending = journal->pending.length;
+	char *path = Journal_Path(config->filename);
+	char *temp = malloc(strlen(path) + 8);
+	Check_Mem(temp, "journal temp");
+	sprintf(temp, "%s.XXXXXX", path);
+	errno = 0;
+	int fd = mkstemp(temp);
+	int ok = (fd != -1) && Journal_Write(fd, (const char *)&header, sizeof(header)) == 0;
+	if(ok && tail > pending){
+		/**	the older part of the tail is already in the journal file	**/
+		off_t from = sizeof(struct Journal_Header) + mark;
+		char *ops = malloc(tail - pending);
+		Check_Mem(ops, "journal tail");
+		ok = pread(journal->fd, ops, tail - pending, from) == tail - pending
+		     && Journal_Write(fd, ops, tail - pending) == 0;
+		free(ops);
+	}
+	if(ok && tail > 0){
+		int skip = (tail < pending) ? pending - tail : 0;
+		ok = Journal_Write(fd, &journal->pending.string[skip], pending - skip) == 0;
+	}
+	int error = 0;
+	if(ok && fdatasync(fd) == 0 && rename(temp, path) == 0){
+		close(journal->fd);
+		journal->fd = fd;
+		journal->logged = tail;
+		journal->pending.length = 0;
+		if(strcmp(path, journal->path) != 0){
+			unlink(journal->path);
+			free_mem(journal->path, "journal path");
+			journal->path = path;
+			path = NULL;
+		}
+	}else{
+		error = errno ? errno : EIO;
+		if(fd != -1){
+			close(fd);
+		}
+		unlink(temp);
+	}
+	free(temp);
+	free(path);
+	pthread_mutex_unlock(&journal->io);
+	pthread_mutex_unlock(&journal->lock);
+	errno = error;
+	return error ? -1 : 0;
+}
+
+/* REGEX */
+int Regex_Fail( struct Regex_Parser *parser, const char *error )
+{
+	if(!parser->error){
+		parser->error = error;
+	}
+	return -1;
+}
+
+int Regex_Node_New( struct Regex_Parser *parser, int type, int left, int right )
+{
+	if(left < 0 || right < -1){
+		return -1;
+	}
+	if(parser->count == parser->cap){
+		int cap = parser->cap ? parser->cap * 2 : 64;
+		struct Regex_Node *nodes = realloc(parser->nodes, sizeof(struct Regex_Node) * cap);
+		Check_Mem(nodes, "regex nodes");
+		parser->nodes = nodes;
+		parser->cap = cap;
+	}
+	struct Regex_Node *node = &parser->nodes[parser->count];
+	node->type = type;
+	node->left = left;
+	node->right = right;
+	node->set = -1;
+	node->min = 0;
+	node->max = 0;
+	return parser->count++;
+}
+
+/**	A node matching one byte of [low, high].				**/
+int Regex_Bytes( struct Regex_Parser *parser, int low, int high )
+{
+	struct Regex *regex = parser->regex;
+	if(regex->set_count == regex->set_cap){
+		int cap = regex->set_cap ? regex->set_cap * 2 : 16;
+		unsigned char (*sets)[32] = realloc(regex->sets, 32 * cap);
+		Check_Mem(sets, "regex sets");
+		regex->sets = sets;
+		regex->set_cap = cap;
+	}
+	int set = regex->set_count++;
+	int c;
+	memset(regex->sets[set], 0, 32);
+	for(c = low; c <= high; c++){
+		regex->sets[set][c >> 3] |= 1 << (c & 7);
+	}
+	int node = Regex_Node_New(parser, REGEX_NODE_SET, 0, -1);
+	parser->nodes[node].set = set;
+	return node;
+}
+
+/**	Any character of two bytes or more, as a sequence of byte sets.	**/
+int Regex_Multi_Byte( struct Regex_Parser *parser )
+{
+	int tail = Regex_Bytes(parser, 0x80, 0xbf);
+	int two = Regex_Node_New(parser, REGEX_NODE_CAT, Regex_Bytes(parser, 0xc2, 0xdf), tail);
+	int three = Regex_Node_New(parser, REGEX_NODE_CAT, Regex_Bytes(parser, 0xe0, 0xef),
+	                           Regex_Node_New(parser, REGEX_NODE_CAT, tail, tail));
+	int four = Regex_Node_New(parser, REGEX_NODE_CAT, Regex_Bytes(parser, 0xf0, 0xf4),
+	                          Regex_Node_New(parser, REGEX_NODE_CAT, tail,
+	                                         Regex_Node_New(parser, REGEX_NODE_CAT, tail, tail)));
+	return Regex_Node_New(parser, REGEX_NODE_ALT, two, Regex_Node_New(parser, REGEX_NODE_ALT, three, four));
+}
+
+/**	The character at parser->at, all of its bytes in a row.		**/
+int Regex_Char( struct Regex_Parser *parser )
+{
+	unsigned int cp;
+	int n = Utf8_Decode(parser->at, parser->end - parser->at, &cp);
+	int node = -1, i;
+	for(i = 0; i < n; i++){
+		unsigned char c = parser->at[i];
+		int byte = Regex_Bytes(parser, c, c);
+		node = (node == -1) ? byte : Regex_Node_New(parser, REGEX_NODE_CAT, node, byte);
+	}
+	parser->at += n;
+	return node;
+}
+
+/**	Adds the ASCII bytes of \d, \w or \s to bits, or their complement	**/
+/**	for \D, \W and \S. Returns 0 when c names no class.			**/
+int Regex_Class_Escape( unsigned char *bits, char c )
+{
+	unsigned char class[16];
+	int lower = tolower((unsigned char)c);
+	int b;
+	if(lower != 'd' && lower != 'w' && lower != 's'){
+		return 0;
+	}
+	memset(class, 0, sizeof(class));
+	for(b = 0; b < 128; b++){
+		if((lower == 'd' && isdigit(b)) || (lower == 'w' && (isalnum(b) || b == '_'))
+		   || (lower == 's' && isspace(b))){
+			class[b >> 3] |= 1 << (b & 7);
+		}
+	}
+	for(b = 0; b < 16; b++){
+		bits[b] |= (c == lower) ? class[b] : (unsigned char)~class[b];
+	}
+	return 1;
+}
+
+/**	The byte an escape other than a class stands for, -1 for letters	**/
+/**	and digits that mean nothing.					**/
+int Regex_Escape_Byte( char c )
+{
+	switch(c){
+	case 't': return '\t';
+	case 'n': return '\n';
+	case 'r': return '\r';
+	case 'f': return '\f';
+	case 'v': return '\v';
+	}
+	return isalnum((unsigned char)c) ? -1 : (unsigned char)c;
+}
+
+/**	A bracket expression, parser->at just past the '['. Members are	**/
+/**	ASCII bytes, ranges of them and classes; other characters are	**/
+/**	alternatives of their own. [^...] is every character but the	**/
+/**	ASCII members.							**/
+int Regex_Class( struct Regex_Parser *parser )
+{
+	int node = Regex_Bytes(parser, 1, 0);
+	int set = (node < 0) ? 0 : parser->nodes[node].set;
+	int other = -1;
+	int negate = 0;
+	int first = 1;
+	if(parser->at < parser->end && *parser->at == '^'){
+		negate = 1;
+		parser->at++;
+	}
+	while(1){
+		unsigned char *bits = parser->regex->sets[set];
+		if(parser->at >= parser->end){
+			return Regex_Fail(parser, "missing ]");
+		}
+		int low = (unsigned char)*parser->at;
+		if(low == ']' && !first){
+			parser->at++;
+			break;
+		}
+		first = 0;
+		if(low >= 0x80){
+			if(negate){
+				return Regex_Fail(parser, "only ASCII in [^...]");
+			}
+			int c = Regex_Char(parser);
+			other = (other == -1) ? c : Regex_Node_New(parser, REGEX_NODE_ALT, other, c);
+			continue;
+		}
+		parser->at++;
+		if(low == '\\'){
+			if(parser->at >= parser->end){
+				return Regex_Fail(parser, "trailing \\");
+			}
+			if(Regex_Class_Escape(bits, *parser->at)){
+				parser->at++;
+				continue;
+			}
+			if((low = Regex_Escape_Byte(*parser->at++)) == -1){
+				return Regex_Fail(parser, "unknown escape");
+			}
+		}
+		int high = low;
+		if(parser->end - parser->at >= 2 && parser->at[0] == '-' && parser->at[1] != ']'){
+			high = (unsigned char)parser->at[1];
+			parser->at += 2;
+			if(high == '\\' && parser->at < parser->end){
+				high = Regex_Escape_Byte(*parser->at++);
+			}
+			if(high < low || high >= 0x80){
+				return Regex_Fail(parser, "bad range");
+			}
+		}
+		for(; low <= high; low++){
+			bits[low >> 3] |= 1 << (low & 7);
+		}
+	}
+	if(negate){
+		unsigned char *bits = parser->regex->sets[set];
+		int b;
+		for(b = 0; b < 16; b++){
+			bits[b] = ~bits[b];
+		}
+		bits[1] &= ~(1 << 2);	/* never '\n' */
+		for(b = 16; b < 32; b++){
+			bits[b] = 0;
+		}
+		other = Regex_Multi_Byte(parser);
+	}
+	return (other == -1) ? node : Regex_Node_New(parser, REGEX_NODE_ALT, node, other);
+}
+
+int Regex_Alt( struct Regex_Parser *parser );
+
+int Regex_Atom( struct Regex_Parser *parser )
+{
+	char c = *parser->at++;
+	int node;
+	switch(c){
+	case '(':
+		node = Regex_Alt(parser);
+		if(parser->at >= parser->end || *parser->at != ')'){
+			return Regex_Fail(parser, "missing )");
+		}
+		parser->at++;
+		return node;
+	case '[':
+		return Regex_Class(parser);
+	case '.':
+		return Regex_Node_New(parser, REGEX_NODE_ALT, Regex_Bytes(parser, 0, 0x7f), Regex_Multi_Byte(parser));
+	case '^':
+		return Regex_Node_New(parser, REGEX_NODE_BOL, 0, -1);
+	case '$':
+		return Regex_Node_New(parser, REGEX_NODE_EOL, 0, -1);
+	case '*':
+	case '+':
+	case '?':
+		return Regex_Fail(parser, "nothing to repeat");
+	case '\\':
+		if(parser->at >= parser->end){
+			return Regex_Fail(parser, "trailing \\");
+		}
+		c = *parser->at;
+		if(strchr("dwsDWS", c)){
+			node = Regex_Bytes(parser, 1, 0);
+			if(node >= 0){
+				Regex_Class_Escape(parser->regex->sets[parser->nodes[node].set], c);
+			}
+			parser->at++;
+			if(isupper((unsigned char)c)){
+				node = Regex_Node_New(parser, REGEX_NODE_ALT, node, Regex_Multi_Byte(parser));
+			}
+			return node;
+		}
+		if(Regex_Escape_Byte(c) == -1){
+			return Regex_Fail(parser, "unknown escape");
+		}
+		parser->at++;
+		return Regex_Bytes(parser, Regex_Escape_Byte(c), Regex_Escape_Byte(c));
+	}
+	parser->at--;
+	return Regex_Char(parser);
+}
+
+/**	Reads a count of {m}, {m,} or {m,n}. Returns 0 and leaves the	**/
+/**	brace to be a literal when it does not start one.			**/
+int Regex_Count( struct Regex_Parser *parser, int *min, int *max )
+{
+	const char *at = parser->at + 1;
+	char *end;
+	if(at >= parser->end || !isdigit((unsigned char)*at)){
+		return 0;
+	}
+	long low = strtol(at, &end, 10), high = low;
+	if(*end == ','){
+		high = isdigit((unsigned char)end[1]) ? strtol(end + 1, &end, 10) : -1;
+		if(high == -1){
+			end++;
+		}
+	}
+	if(*end != '}'){
+		return 0;
+	}
+	parser->at = end + 1;
+	if(low > REGEX_REPEAT_MAX || high > REGEX_REPEAT_MAX || (high != -1 && high < low)){
+		Regex_Fail(parser, "bad count");
+	}
+	*min = low;
+	*max = high;
+	return 1;
+}
+
+int Regex_Repeat( struct Regex_Parser *parser )
+{
+	int node = Regex_Atom(parser);
+	while(node >= 0 && parser->at < parser->end){
+		int min, max;
+		char c = *parser->at;
+		if(c == '*' || c == '+' || c == '?'){
+			min = (c == '+');
+			max = (c == '?') ? 1 : -1;
+			parser->at++;
+		}else if(c != '{' || !Regex_Count(parser, &min, &max)){
+			break;
+		}
+		node = Regex_Node_New(parser, REGEX_NODE_REPEAT, node, -1);
+		if(node >= 0){
+			parser->nodes[node].min = min;
+			parser->nodes[node].max = max;
+		}
+	}
+	return node;
+}
+
+int Regex_Cat( struct Regex_Parser *parser )
+{
+	int node = -1;
+	while(!parser->error && parser->at < parser->end && *parser->at != '|' && *parser->at != ')'){
+		int next = Regex_Repeat(parser);
+		node = (node == -1) ? next : Regex_Node_New(parser, REGEX_NODE_CAT, node, next);
+	}
+	if(parser->error){
+		return -1;
+	}
+	return (node == -1) ? Regex_Node_New(parser, REGEX_NODE_EMPTY, 0, -1) : node;
+}
+
+int Regex_Alt( struct Regex_Parser *parser )
+{
+	int node = Regex_Cat(parser);
+	while(node >= 0 && parser->at < parser->end && *parser->at == '|'){
+		parser->at++;
+		node = Regex_Node_New(parser, REGEX_NODE_ALT, node, Regex_Cat(parser));
+	}
+	return node;
+}
+
+int Regex_Emit( struct Regex_Program *program, int op, int out, int out1, int set )
+{
+	if(program->count == program->cap){
+		if(program->cap >= REGEX_PROGRAM_MAX){
+			return -1;
+		}
+		int cap = program->cap ? program->cap * 2 : 64;
+		struct Regex_Inst *inst = realloc(program->inst, sizeof(struct Regex_Inst) * cap);
+		Check_Mem(inst, "regex program");
+		program->inst = inst;
+		program->cap = cap;
+	}
+	struct Regex_Inst *inst = &program->inst[program->count];
+	inst->op = op;
+	inst->out = out;
+	inst->out1 = out1;
+	inst->set = set;
+	return program->count++;
+}
+
+/**	Emits node so that it continues at next, back to front, and returns	**/
+/**	its entry, or -1 once the program is too big. In reverse, the parts	**/
+/**	of a sequence come last to first and ^ and $ trade places.		**/
+int Regex_Compile_Node( struct Regex_Parser *parser, struct Regex_Program *program, int index, int next, int reverse )
+{
+	struct Regex_Node node = parser->nodes[index];
+	int i;
+	if(next < 0){
+		return -1;
+	}
+	switch(node.type){
+	case REGEX_NODE_SET:
+		return Regex_Emit(program, REGEX_BYTE, next, -1, node.set);
+	case REGEX_NODE_BOL:
+		return Regex_Emit(program, reverse ? REGEX_EOL : REGEX_BOL, next, -1, -1);
+	case REGEX_NODE_EOL:
+		return Regex_Emit(program, reverse ? REGEX_BOL : REGEX_EOL, next, -1, -1);
+	case REGEX_NODE_CAT:
+		if(reverse){
+			return Regex_Compile_Node(parser, program, node.right,
+			                          Regex_Compile_Node(parser, program, node.left, next, reverse), reverse);
+		}
+		return Regex_Compile_Node(parser, program, node.left,
+		                          Regex_Compile_Node(parser, program, node.right, next, reverse), reverse);
+	case REGEX_NODE_ALT: {
+		int left = Regex_Compile_Node(parser, program, node.left, next, reverse);
+		int right = Regex_Compile_Node(parser, program, node.right, next, reverse);
+		if(left < 0 || right < 0){
+			return -1;
+		}
+		return Regex_Emit(program, REGEX_SPLIT, left, right, -1);
+	}
+	case REGEX_NODE_REPEAT:
+		if(node.max == -1){
+			int loop = Regex_Emit(program, REGEX_SPLIT, -1, next, -1);
+			int body = (loop < 0) ? -1 : Regex_Compile_Node(parser, program, node.left, loop, reverse);
+			if(body < 0){
+				return -1;
+			}
+			program->inst[loop].out = body;
+			next = loop;
+		}else{
+			for(i = node.min; i < node.max && next >= 0; i++){
+				int body = Regex_Compile_Node(parser, program, node.left, next, reverse);
+				next = (body < 0) ? -1 : Regex_Emit(program, REGEX_SPLIT, body, next, -1);
+			}
+		}
+		for(i = 0; i < node.min && next >= 0; i++){
+			next = Regex_Compile_Node(parser, program, node.left, next, reverse);
+		}
+		return next;
+	}
+	return next;
+}
+
+/**	The byte a set holds when it holds only one, or -1.		**/
+int Regex_Single( struct Regex *regex, int set )
+{
+	int byte = -1, c;
+	for(c = 0; c < 256; c++){
+		if(regex->sets[set][c >> 3] & (1 << (c & 7))){
+			if(byte != -1){
+				return -1;
+			}
+			byte = c;
+		}
+	}
+	return byte;
+}
+
+/**	Appends the literal bytes node starts with to prefix. Returns 1	**/
+/**	when all of node was literal and what follows may add more.		**/
+int Regex_Prefix( struct Regex_Parser *parser, int index, struct Buffer *prefix )
+{
+	struct Regex_Node *node = &parser->nodes[index];
+	switch(node->type){
+	case REGEX_NODE_CAT:
+		return Regex_Prefix(parser, node->left, prefix) && Regex_Prefix(parser, node->right, prefix);
+	case REGEX_NODE_BOL:
+	case REGEX_NODE_EMPTY:
+		return 1;
+	case REGEX_NODE_SET: {
+		int byte = Regex_Single(parser->regex, node->set);
+		if(byte == -1){
+			return 0;
+		}
+		char c = byte;
+		Append_Buffer(prefix, &c, 1);
+		return 1;
+	}
+	case REGEX_NODE_REPEAT:
+		if(node->min > 0){
+			Regex_Prefix(parser, node->left, prefix);
+		}
+		return 0;
+	}
+	return 0;
+}
+
+void Regex_Free( struct Regex *regex )
+{
+	free(regex->forward.inst);
+	free(regex->reverse.inst);
+	free(regex->sets);
+	Heap_Free(regex->prefix);
+	free_mem(regex, "regex");
+}
+
+/**	Compiles pattern, or returns NULL and sets error. Matches are	**/
+/**	leftmost-longest, within one line.					**/
+struct Regex *Regex_Compile( const char *pattern, const char **error )
+{
+	struct Regex *regex = calloc(1, sizeof(struct Regex));
+	Check_Mem(regex, "regex");
+	struct Regex_Parser parser;
+	memset(&parser, 0, sizeof(parser));
+	parser.at = pattern;
+	parser.end = pattern + strlen(pattern);
+	parser.regex = regex;
+	int root = Regex_Alt(&parser);
+	if(root >= 0 && parser.at < parser.end){
+		Regex_Fail(&parser, "unmatched )");
+	}
+	if(!parser.error){
+		int match = Regex_Emit(&regex->forward, REGEX_MATCH, -1, -1, -1);
+		regex->forward.start = Regex_Compile_Node(&parser, &regex->forward, root, match, 0);
+		match = Regex_Emit(&regex->reverse, REGEX_MATCH, -1, -1, -1);
+		regex->reverse.start = Regex_Compile_Node(&parser, &regex->reverse, root, match, 1);
+		if(regex->forward.start < 0 || regex->reverse.start < 0){
+			Regex_Fail(&parser, "too big");
+		}
+	}
+	if(!parser.error){
+		struct Buffer prefix = BUFFER_CONSTR;
+		Regex_Prefix(&parser, root, &prefix);
+		regex->prefix = prefix.string;
+		regex->prefix_len = prefix.length;
+	}
+	free(parser.nodes);
+	if(parser.error){
+		*error = parser.error;
+		Regex_Free(regex);
+		return NULL;
+	}
+	return regex;
+}
+
+void Regex_Dfa_Free( struct Regex_Dfa *dfa )
+{
+	free(dfa->next);
+	free(dfa->accept);
+	free(dfa->list_at);
+	free(dfa->list_len);
+	free(dfa->lists);
+	free(dfa->work);
+	free(dfa->stack);
+	free(dfa->seen);
+	memset(dfa, 0, sizeof(struct Regex_Dfa));
+}
+
+void Regex_Dfa_Flush( struct Regex_Dfa *dfa )
+{
+	int i;
+	for(i = 0; i < REGEX_TABLE; i++){
+		dfa->table[i] = -1;
+	}
+	dfa->count = 0;
+	dfa->lists_len = 0;
+	dfa->start[0] = -1;
+	dfa->start[1] = -1;
+	dfa->start[2] = -1;
+	dfa->epoch++;
+}
+
+void Regex_Dfa_Init( struct Regex_Dfa *dfa, struct Regex_Program *program, unsigned char (*sets)[32], int unanchored )
+{
+	Regex_Dfa_Free(dfa);
+	dfa->program = program;
+	dfa->sets = sets;
+	dfa->unanchored = unanchored;
+	dfa->work = malloc(sizeof(int) * program->count);
+	dfa->stack = malloc(sizeof(int) * (2 * program->count + 1));
+	dfa->seen = calloc(program->count, sizeof(int));
+	Check_Mem(dfa->work, "regex dfa");
+	Check_Mem(dfa->stack, "regex dfa");
+	Check_Mem(dfa->seen, "regex dfa");
+	Regex_Dfa_Flush(dfa);
+}
+
+int Regex_Int_Compare( const void *a, const void *b )
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/**	The state of the instructions in list, added when it is new. When	**/
+/**	the cache is full it is flushed first, which the caller sees as a	**/
+/**	new epoch.								**/
+int Regex_State( struct Regex_Dfa *dfa, int *list, int count )
+{
+	unsigned int hash = 2166136261u;
+	int i;
+	qsort(list, count, sizeof(int), Regex_Int_Compare);
+	for(i = 0; i < count; i++){
+		hash = (hash ^ list[i]) * 16777619u;
+	}
+	int slot = hash & (REGEX_TABLE - 1);
+	int state;
+	while((state = dfa->table[slot]) != -1){
+		if(dfa->list_len[state] == count
+		   && memcmp(&dfa->lists[dfa->list_at[state]], list, sizeof(int) * count) == 0){
+			return state;
+		}
+		slot = (slot + 1) & (REGEX_TABLE - 1);
+	}
+	if(dfa->count == REGEX_CACHE_STATES){
+		Regex_Dfa_Flush(dfa);
+		return Regex_State(dfa, list, count);
+	}
+	if(dfa->count == dfa->cap){
+		int cap = dfa->cap ? dfa->cap * 2 : 16;
+		dfa->next = realloc(dfa->next, sizeof(int) * 257 * cap);
+		dfa->accept = realloc(dfa->accept, cap);
+		dfa->list_at = realloc(dfa->list_at, sizeof(int) * cap);
+		dfa->list_len = realloc(dfa->list_len, sizeof(int) * cap);
+		Check_Mem(dfa->next, "regex states");
+		Check_Mem(dfa->accept, "regex states");
+		Check_Mem(dfa->list_at, "regex states");
+		Check_Mem(dfa->list_len, "regex states");
+		dfa->cap = cap;
+	}
+	if(dfa->lists_len + count > dfa->lists_cap){
+		int cap = dfa->lists_cap ? dfa->lists_cap : 256;
+		while(cap < dfa->lists_len + count){
+			cap *= 2;
+		}
+		dfa->lists = realloc(dfa->lists, sizeof(int) * cap);
+		Check_Mem(dfa->lists, "regex states");
+		dfa->lists_cap = cap;
+	}
+	state = dfa->count++;
+	if(count){
+		memcpy(&dfa->lists[dfa->lists_len], list, sizeof(int) * count);
+	}
+	dfa->list_at[state] = dfa->lists_len;
+	dfa->list_len[state] = count;
+	dfa->lists_len += count;
+	dfa->accept[state] = 0;
+	for(i = 0; i < count; i++){
+		if(dfa->program->inst[list[i]].op == REGEX_MATCH){
+			dfa->accept[state] = 1;
+		}
+	}
+	for(i = 0; i < 257; i++){
+		dfa->next[state * 257 + i] = -1;
+	}
+	dfa->table[slot] = state;
+	return state;
+}
+
+/**	Adds the instructions reachable from 'at' without reading a byte	**/
+/**	to work[count...] and returns the new count. ^ holds with 'bol' and	**/
+/**	$ with 'eol'; a $ that does not hold yet is kept for the end of the	**/
+/**	line. Instructions already seen since the last mark are skipped.	**/
+int Regex_Closure( struct Regex_Dfa *dfa, int at, int bol, int eol, int count )
+{
+	struct Regex_Inst *inst = dfa->program->inst;
+	int top = 0;
+	dfa->stack[top++] = at;
+	while(top){
+		int i = dfa->stack[--top];
+		if(dfa->seen[i] == dfa->mark){
+			continue;
+		}
+		dfa->seen[i] = dfa->mark;
+		switch(inst[i].op){
+		case REGEX_SPLIT:
+			dfa->stack[top++] = inst[i].out1;
+			dfa->stack[top++] = inst[i].out;
+			break;
+		case REGEX_BOL:
+			if(bol){
+				dfa->stack[top++] = inst[i].out;
+			}
+			break;
+		case REGEX_EOL:
+			if(eol){
+				dfa->stack[top++] = inst[i].out;
+			}else{
+				dfa->work[count++] = i;
+			}
+			break;
+		default:
+			dfa->work[count++] = i;
+		}
+	}
+	return count;
+}
+
+void Regex_Mark( struct Regex_Dfa *dfa )
+{
+	if(++dfa->mark == INT_MAX){
+		memset(dfa->seen, 0, sizeof(int) * dfa->program->count);
+		dfa->mark = 1;
+	}
+}
+
+/**	The state before the first byte read: where is 0 inside a line, 1	**/
+/**	at its start and 2 for an empty line, where ^ and $ both hold.	**/
+int Regex_Start( struct Regex_Dfa *dfa, int where )
+{
+	if(dfa->start[where] < 0){
+		Regex_Mark(dfa);
+		int count = Regex_Closure(dfa, dfa->program->start, where > 0, where == 2, 0);
+		int state = Regex_State(dfa, dfa->work, count);
+		dfa->start[where] = state;
+	}
+	return dfa->start[where];
+}
+
+/**	The state after reading byte, or the end of the line for 256.	**/
+int Regex_Next( struct Regex_Dfa *dfa, int state, int byte )
+{
+	int target = dfa->next[state * 257 + byte];
+	if(target >= 0){
+		return target;
+	}
+	struct Regex_Inst *inst = dfa->program->inst;
+	const int *list = &dfa->lists[dfa->list_at[state]];
+	int len = dfa->list_len[state];
+	int count = 0, i;
+	Regex_Mark(dfa);
+	for(i = 0; i < len; i++){
+		struct Regex_Inst *in = &inst[list[i]];
+		if(byte == 256){
+			if(in->op == REGEX_EOL){
+				count = Regex_Closure(dfa, in->out, 0, 1, count);
+			}else if(in->op == REGEX_MATCH){
+				count = Regex_Closure(dfa, list[i], 0, 1, count);
+			}
+		}else if(in->op == REGEX_BYTE && (dfa->sets[in->set][byte >> 3] & (1 << (byte & 7)))){
+			count = Regex_Closure(dfa, in->out, 0, 0, count);
+		}
+	}
+	if(dfa->unanchored && byte != 256){
+		count = Regex_Closure(dfa, dfa->program->start, 0, 0, count);
+	}
+	int epoch = dfa->epoch;
+	target = Regex_State(dfa, dfa->work, count);
+	if(epoch == dfa->epoch){
+		dfa->next[state * 257 + byte] = target;
+	}
+	return target;
+}
+
+void Regex_Matcher_Free( struct Regex_Matcher *matcher )
+{
+	Regex_Dfa_Free(&matcher->forward);
+	Regex_Dfa_Free(&matcher->reverse);
+	free(matcher->starts);
+	free(matcher->groups);
+	free(matcher->kept);
+	free(matcher->found);
+	matcher->starts = NULL;
+	matcher->starts_cap = 0;
+	matcher->groups = NULL;
+	matcher->groups_cap = 0;
+	matcher->kept = NULL;
+	matcher->kept_cap = 0;
+	matcher->found = NULL;
+	matcher->found_cap = 0;
+}
+
+void Regex_Matcher_Reset( struct Regex_Matcher *matcher, struct Regex *regex )
+{
+	Regex_Dfa_Init(&matcher->forward, &regex->forward, regex->sets, 0);
+	Regex_Dfa_Init(&matcher->reverse, &regex->reverse, regex->sets, 1);
+}
+
+void Regex_Add_Start( struct Regex_Matcher *matcher, int p )
+{
+	if(matcher->start_count == matcher->starts_cap){
+		int cap = matcher->starts_cap ? matcher->starts_cap * 2 : 64;
+		int *starts = realloc(matcher->starts, sizeof(int) * cap);
+		Check_Mem(starts, "regex starts");
+		matcher->starts = starts;
+		matcher->starts_cap = cap;
+	}
+	matcher->starts[matcher->start_count++] = p;
+}
+
+/**	Finds every byte of text a match starts at, reading the line	**/
+/**	backwards once with the reverse program. Returns how many there	**/
+/**	are, or -1 once cancel is set.					**/
+int Regex_Starts( struct Regex_Matcher *matcher, const char *text, int len, const int *cancel )
+{
+	struct Regex_Dfa *dfa = &matcher->reverse;
+	int state = Regex_Start(dfa, len ? 1 : 2);
+	int p;
+	matcher->start_count = 0;
+	for(p = len; p > 0; p--){
+		if((p & (REGEX_POLL - 1)) == 0 && __atomic_load_n(cancel, __ATOMIC_RELAXED)){
+			return -1;
+		}
+		if(dfa->accept[state]){
+			Regex_Add_Start(matcher, p);
+		}
+		int next = dfa->next[state * 257 + (unsigned char)text[p - 1]];
+		state = (next >= 0) ? next : Regex_Next(dfa, state, (unsigned char)text[p - 1]);
+	}
+	state = Regex_Next(dfa, state, 256);
+	if(dfa->accept[state]){
+		Regex_Add_Start(matcher, 0);
+	}
+	return matcher->start_count;
+}
+
+void Regex_Found( struct Regex_Matcher *matcher, int start, int end )
+{
+	if(2 * matcher->found_count == matcher->found_cap){
+		int cap = matcher->found_cap ? matcher->found_cap * 2 : 64;
+		int *found = realloc(matcher->found, sizeof(int) * cap);
+		Check_Mem(found, "regex matches");
+		matcher->found = found;
+		matcher->found_cap = cap;
+	}
+	matcher->found[2 * matcher->found_count] = start;
+	matcher->found[2 * matcher->found_count + 1] = end;
+	matcher->found_count++;
+}
+
+/**	Flushes the forward DFA and builds the states of the groups again	**/
+/**	in it. Done before a step that could fill it, since a flush in the	**/
+/**	middle would leave the other groups on states that are gone.	**/
+void Regex_Keep( struct Regex_Matcher *matcher )
+{
+	struct Regex_Dfa *dfa = &matcher->forward;
+	struct Regex_Group *groups = matcher->groups;
+	int need = 0, at = 0, a;
+	for(a = 0; a < matcher->alive_count; a++){
+		need += dfa->list_len[groups[matcher->alive[a]].state] + 1;
+	}
+	if(need > matcher->kept_cap){
+		int *kept = realloc(matcher->kept, sizeof(int) * need);
+		Check_Mem(kept, "regex groups");
+		matcher->kept = kept;
+		matcher->kept_cap = need;
+	}
+	for(a = 0; a < matcher->alive_count; a++){
+		int state = groups[matcher->alive[a]].state;
+		matcher->kept[at++] = dfa->list_len[state];
+		memcpy(&matcher->kept[at], &dfa->lists[dfa->list_at[state]], sizeof(int) * dfa->list_len[state]);
+		at += dfa->list_len[state];
+	}
+	Regex_Dfa_Flush(dfa);
+	at = 0;
+	for(a = 0; a < matcher->alive_count; a++){
+		int len = matcher->kept[at++];
+		groups[matcher->alive[a]].state = Regex_State(dfa, &matcher->kept[at], len);
+		at += len;
+	}
+}
+
+/**	Whether a growing group has not matched yet. It will, since it	**/
+/**	starts where a match does, and then ends every group started	**/
+/**	after it so far.							**/
+int Regex_Unmatched( struct Regex_Matcher *matcher )
+{
+	int a;
+	for(a = 0; a < matcher->alive_count; a++){
+		if(matcher->groups[matcher->alive[a]].end < 0){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**	Starts a group at byte i, at the end of the groups.			**/
+void Regex_Group_Add( struct Regex_Matcher *matcher, int i, int where )
+{
+	struct Regex_Dfa *dfa = &matcher->forward;
+	int a;
+	if(matcher->group_count == matcher->groups_cap){
+		if(matcher->group_head > matcher->group_count / 2){
+			memmove(matcher->groups, &matcher->groups[matcher->group_head],
+			        sizeof(struct Regex_Group) * (matcher->group_count - matcher->group_head));
+			for(a = 0; a < matcher->alive_count; a++){
+				matcher->alive[a] -= matcher->group_head;
+			}
+			matcher->group_count -= matcher->group_head;
+			matcher->group_head = 0;
+		}else{
+			int cap = matcher->groups_cap ? matcher->groups_cap * 2 : 64;
+			struct Regex_Group *groups = realloc(matcher->groups, sizeof(struct Regex_Group) * cap);
+			Check_Mem(groups, "regex groups");
+			matcher->groups = groups;
+			matcher->groups_cap = cap;
+		}
+	}
+	struct Regex_Group *group = &matcher->groups[matcher->group_count];
+	group->start = i;
+	group->state = Regex_Start(dfa, where);
+	group->end = dfa->accept[group->state] ? i : -1;
+	matcher->alive[matcher->alive_count++] = matcher->group_count++;
+}
+
+/**	Moves the growing groups over byte, 256 being the end of the line,	**/
+/**	which 'end' is the offset after. A group that matches there ends	**/
+/**	the ones after it: they start inside its match. A group in the	**/
+/**	same state as an earlier one can only end where that one does from	**/
+/**	here on, and the earlier one gets those ends, so it stops growing.	**/
+void Regex_Step( struct Regex_Matcher *matcher, int byte, int end )
+{
+	struct Regex_Dfa *dfa = &matcher->forward;
+	struct Regex_Group *groups = matcher->groups;
+	int a, b, n = 0;
+	for(a = 0; a < matcher->alive_count; a++){
+		struct Regex_Group *group = &groups[matcher->alive[a]];
+		int next = dfa->next[group->state * 257 + byte];
+		group->state = (next >= 0) ? next : Regex_Next(dfa, group->state, byte);
+		if(dfa->accept[group->state]){
+			group->end = end;
+			matcher->group_count = matcher->alive[a] + 1;
+			matcher->alive_count = a + 1;
+		}
+		if(byte == 256 || dfa->list_len[group->state] == 0){
+			group->state = -1;
+		}
+	}
+	for(a = 0; a < matcher->alive_count; a++){
+		struct Regex_Group *group = &groups[matcher->alive[a]];
+		if(group->state < 0){
+			continue;
+		}
+		for(b = 0; b < n && groups[matcher->alive[b]].state != group->state; b++);
+		if(b < n){
+			group->state = -1;
+			continue;
+		}
+		matcher->alive[n++] = matcher->alive[a];
+	}
+	matcher->alive_count = n;
+}
+
+/**	Moves the one growing group along text[i, stop), the same as	**/
+/**	Regex_Step byte by byte, until it can not grow. A start of the	**/
+/**	starts[0, *k) on the way is passed over when the group has not	**/
+/**	matched yet or matches on its byte, either of which ends the group	**/
+/**	started there; else it stops before it. Returns where it stopped.	**/
+int Regex_Run( struct Regex_Matcher *matcher, const char *text, int i, int stop, int *k )
+{
+	struct Regex_Dfa *dfa = &matcher->forward;
+	struct Regex_Group *group = &matcher->groups[matcher->alive[0]];
+	int state = group->state;
+	int end = group->end;
+	int start = (*k > 0) ? matcher->starts[*k - 1] : -1;
+	while(i < stop){
+		int next = dfa->next[state * 257 + (unsigned char)text[i]];
+		if(next >= 0 && dfa->list_len[next] == 0){
+			state = -1;		/* before the byte, so a group can start at it alone */
+			matcher->alive_count = 0;
+			break;
+		}
+		if(i == start){
+			if(end >= 0 && (next < 0 || !dfa->accept[next])){
+				break;		/* a move not built yet could flush under the group */
+			}
+			(*k)--;
+			start = (*k > 0) ? matcher->starts[*k - 1] : -1;
+		}
+		state = (next >= 0) ? next : Regex_Next(dfa, state, (unsigned char)text[i]);
+		i++;
+		if(dfa->accept[state]){
+			end = i;
+		}else if(dfa->list_len[state] == 0){
+			state = -1;
+			matcher->alive_count = 0;
+			break;
+		}
+	}
+	if(end != group->end){
+		group->end = end;
+		matcher->group_count = matcher->alive[0] + 1;
+	}
+	group->state = state;
+	return i;
+}
+
+/**	Takes out the first groups while they can not grow. Each is the	**/
+/**	leftmost-longest match from *at on, unless it is empty and inside	**/
+/**	a UTF-8 character or right after a match; the groups starting	**/
+/**	before it ends go with it.						**/
+void Regex_Resolve( struct Regex_Matcher *matcher, const char *text, int len, int *at, int *last )
+{
+	struct Regex_Group *groups = matcher->groups;
+	int head = matcher->group_head;
+	int a = 0;
+	while(head < matcher->group_count && groups[head].state < 0){
+		int start = groups[head].start;
+		int end = groups[head].end;
+		if(end > start || (end == start && start != *last && (start == len || (text[start] & 0xc0) != 0x80))){
+			Regex_Found(matcher, start, end);
+			*last = end;
+		}
+		*at = (end > start) ? end : start + 1;
+		for(head++; head < matcher->group_count && groups[head].start < *at; head++);
+	}
+	while(a < matcher->alive_count && matcher->alive[a] < head){
+		a++;
+	}
+	matcher->alive_count -= a;
+	memmove(matcher->alive, &matcher->alive[a], sizeof(int) * matcher->alive_count);
+	matcher->group_head = head;
+	if(head == matcher->group_count){
+		matcher->group_head = 0;
+		matcher->group_count = 0;
+	}
+}
+
+/**	Finds the matches in a line, leftmost-longest and not overlapping,	**/
+/**	into found. The reverse DFA gives the bytes they start at, then one	**/
+/**	forward pass follows a group from each with the forward DFA, so	**/
+/**	no byte is read twice. Past REGEX_GROUPS growing at once, the	**/
+/**	starts left out are gone over again. Returns how many there are,	**/
+/**	or -1 once cancel is set.						**/
+int Regex_Matches( struct Regex_Matcher *matcher, const char *text, int len, const int *cancel )
+{
+	struct Regex_Dfa *dfa = &matcher->forward;
+	int k = Regex_Starts(matcher, text, len, cancel);
+	int at = 0, last = -1, i = 0;
+	int polled = 0;		/* bytes read since cancel was */
+	int skipped = -1;	/* k before the first start left out */
+	matcher->found_count = 0;
+	matcher->group_head = 0;
+	matcher->group_count = 0;
+	matcher->alive_count = 0;
+	if(k < 0){
+		return -1;
+	}
+	while(1){
+		if(matcher->group_count == 0){
+			if(skipped >= 0){
+				k = skipped;
+				skipped = -1;
+			}
+			while(k > 0 && matcher->starts[k - 1] < at){
+				k--;
+			}
+			if(k == 0){
+				return matcher->found_count;
+			}
+			i = matcher->starts[k - 1];
+		}
+		if(polled >= REGEX_POLL){
+			if(__atomic_load_n(cancel, __ATOMIC_RELAXED)){
+				return -1;
+			}
+			polled = 0;
+		}
+		if(matcher->alive_count && dfa->count > REGEX_CACHE_STATES - 2 * (matcher->alive_count + 2)){
+			Regex_Keep(matcher);	/* room for each group's move and one more group */
+		}
+		int from = i;
+		int none = 0;
+		int stop = (len - i > REGEX_POLL) ? i + REGEX_POLL : len;
+		if(i < len && matcher->alive_count == 1){
+			i = Regex_Run(matcher, text, i, stop, skipped < 0 ? &k : &none);
+		}
+		if(i == from && k > 0 && matcher->starts[k - 1] == i){
+			k--;
+			if(i < at || Regex_Unmatched(matcher)){
+				/* inside a match, or one a group yet to match will cover */
+			}else if(matcher->alive_count == REGEX_GROUPS || skipped >= 0){
+				skipped = (skipped < 0) ? k + 1 : skipped;	/* and the rest, in order */
+			}else{
+				Regex_Group_Add(matcher, i, len == 0 ? 2 : i == 0);
+				if(i < len && matcher->alive_count == 1){
+					i = Regex_Run(matcher, text, i, stop, &k);
+				}
+			}
+		}
+		if(i == from){
+			if(i < len && matcher->alive_count){
+				Regex_Step(matcher, (unsigned char)text[i], i + 1);
+			}else if(matcher->alive_count){
+				Regex_Step(matcher, 256, len);
+			}
+			i++;
+		}
+		polled += i - from;
+		Regex_Resolve(matcher, text, len, &at, &last);
+	}
+}
+
+/* SEARCH */
+/**	Offset of the first copy of needle in hay, or -1. Candidates are	**/
+/**	picked 16 positions at a time by matching the first and the last	**/
+/**	byte of the needle together, then checked with memcmp. Needles	**/
+/**	over SEARCH_TWO_WAY bytes go to memmem, which is Two-Way and stays	**/
+/**	linear on repetitive text.						**/
+long Search_Bytes( const char *hay, size_t len, const char *needle, size_t n )
+{
+	size_t i = 0;
+	if(n == 0 || n > len){
+		return -1;
+	}
+	if(n == 1){
+		const char *hit = memchr(hay, needle[0], len);
+		return hit ? hit - hay : -1;
+	}
+#if defined(__SSE2__)
+	if(n <= SEARCH_TWO_WAY){
+		__m128i first = _mm_set1_epi8(needle[0]);
+		__m128i last = _mm_set1_epi8(needle[n - 1]);
+		for(; i + n - 1 + 16 <= len; i += 16){
+			__m128i head = _mm_loadu_si128((const __m128i *)&hay[i]);
+			__m128i tail = _mm_loadu_si128((const __m128i *)&hay[i + n - 1]);
+			int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first),
+			                                           _mm_cmpeq_epi8(tail, last)));
+			while(mask){
+				int bit = __builtin_ctz(mask);
+				if(memcmp(&hay[i + bit + 1], &needle[1], n - 2) == 0){
+					return i + bit;
+				}
+				mask &= mask - 1;
+			}
+		}
+	}
+#endif
+	const char *hit = memmem(&hay[i], len - i, needle, n);
+	return hit ? hit - hay : -1;
+}
+
+/**	Stops the scan and waits for the workers inside it. cancel stays	**/
+/**	set until the next Search_Scan, so a worker that wakes late for an	**/
+/**	old generation goes back to sleep instead of joining in.		**/
+void Search_Cancel()
+{
+	struct Search *search = config->search;
+	pthread_mutex_lock(&search->lock);
+	__atomic_store_n(&search->cancel, 1, __ATOMIC_RELAXED);
+	while(search->busy > 0){
+		pthread_cond_wait(&search->idle, &search->lock);
+	}
+	pthread_mutex_unlock(&search->lock);
+	search->running = 0;
+}
+
+/**	Drops the index and the snapshot. The workers are kept.		**/
+void Search_Clear()
+{
+	struct Search *search = config->search;
+	int i;
+	Search_Cancel();
+	if(search->regex){
+		Regex_Free(search->regex);
+		search->regex = NULL;
+	}
+	if(search->query){
+		free_mem(search->query, "search query");
+		search->query = NULL;
+	}
+	if(search->base){
+		free_mem(search->base, "search base");
+		search->base = NULL;
+	}
+	for(i = 0; i < search->block_count; i++){
+		Heap_Free(search->blocks[i].matches);
+	}
+	Heap_Free(search->blocks);
+	Heap_Free(search->spans);
+	Heap_Free(search->matches);
+	Heap_Free(search->candidates);
+	search->blocks = NULL;
+	search->spans = NULL;
+	search->matches = NULL;
+	search->candidates = NULL;
+	search->block_count = 0;
+	search->span_count = 0;
+	search->query_len = 0;
+	search->count = 0;
+	search->cap = 0;
+	search->candidate_count = 0;
+	search->current = -1;
+}
+
+void Search_Reserve( int count )
+{
+	struct Search *search = config->search;
+	if(count > search->cap){
+		int cap = search->cap ? search->cap : 256;
+		while(cap < count){
+			cap *= 2;
+		}
+		struct Search_Match *matches = Heap_Alloc(HEAP_SEARCH, search->matches, sizeof(struct Search_Match) * cap);
+		Check_Mem(matches, "search matches");
+		search->matches = matches;
+		search->cap = cap;
+	}
+}
+
+void Search_Add( struct Search_Block *block, int row, int x, int len )
+{
+	if(block->count == block->cap){
+		int cap = block->cap ? block->cap * 2 : 64;
+		struct Search_Match *matches = Heap_Alloc(HEAP_SEARCH, block->matches, sizeof(struct Search_Match) * cap);
+		Check_Mem(matches, "search block");
+		block->matches = matches;
+		block->cap = cap;
+	}
+	block->matches[block->count].row = row;
+	block->matches[block->count].x = x;
+	block->matches[block->count].len = len;
+	block->count++;
+}
+
+/**	Adds the matches in a span to block. Matches do not overlap.	**/
+void Search_Run( struct Search_Block *block, struct Search_Span *span )
+{
+	struct Search *search = config->search;
+	const char *data = span->data;
+	const char *line = data;
+	const char *end = data + span->len;
+	const char *line_end = memchr(line, '\n', span->len);
+	int row = span->row;
+	size_t at = 0;
+	long hit;
+	while((hit = Search_Bytes(&data[at], span->len - at, search->query, search->query_len)) != -1){
+		const char *match = &data[at + hit];
+		while(line_end && line_end < match){
+			row++;
+			line = line_end + 1;
+			line_end = memchr(line, '\n', end - line);
+		}
+		Search_Add(block, row, match - line, search->query_len);
+		at += hit + search->query_len;
+	}
+}
+
+/**	Adds the regex matches in a line. Returns -1 once the scan is	**/
+/**	cancelled.								**/
+int Search_Regex_Line( struct Search_Block *block, struct Regex_Matcher *matcher, const char *text, int len, int row )
+{
+	int count = Regex_Matches(matcher, text, len, &config->search->cancel);
+	int k;
+	for(k = 0; k < count; k++){
+		Search_Add(block, row, matcher->found[2 * k], matcher->found[2 * k + 1] - matcher->found[2 * k]);
+	}
+	return count;
+}
+
+/**	Adds the regex matches in a span to block. When the regex starts	**/
+/**	with literal bytes, only the lines Search_Bytes finds them in are	**/
+/**	matched.								**/
+void Search_Run_Regex( struct Search_Block *block, struct Search_Span *span, struct Regex_Matcher *matcher )
+{
+	struct Regex *regex = config->search->regex;
+	const char *line = span->data;
+	const char *end = span->data + span->len;
+	int row = span->row;
+	while(1){
+		const char *line_end;
+		if(regex->prefix_len){
+			long hit = Search_Bytes(line, end - line, regex->prefix, regex->prefix_len);
+			if(hit == -1){
+				return;
+			}
+			while((line_end = memchr(line, '\n', hit))){
+				hit -= line_end + 1 - line;
+				line = line_end + 1;
+				row++;
+			}
+		}
+		line_end = memchr(line, '\n', end - line);
+		if(!line_end){
+			line_end = end;
+		}
+		if(Search_Regex_Line(block, matcher, line, line_end - line, row) < 0 || line_end == end){
+			return;
+		}
+		line = line_end + 1;
+		row++;
+	}
+}
+
+/**	The next claim of generation, or -1 once no block is left or the	**/
+/**	scan has been cancelled or replaced.					**/
+int Search_Claim( struct Search *search, int generation )
+{
+	if(__atomic_load_n(&search->cancel, __ATOMIC_RELAXED)
+	   || __atomic_load_n(&search->generation, __ATOMIC_ACQUIRE) != generation){
+		return -1;
+	}
+	int k = __atomic_fetch_add(&search->next_block, 1, __ATOMIC_RELAXED);
+	return (k < search->block_count) ? k : -1;
+}
+
+/**	Scans the blocks it claims, counted from start, the block of the	**/
+/**	cursor, and wrapping, so the first match after the cursor tends to	**/
+/**	be found first. Regex scans use the worker's matcher, rebuilt once	**/
+/**	per generation.								**/
+void Search_Work( struct Search *search, struct Regex_Matcher *matcher, int generation, int start )
+{
+	int k;
+	if(search->regex && matcher->generation != generation){
+		Regex_Matcher_Reset(matcher, search->regex);
+		matcher->generation = generation;
+	}
+	while((k = Search_Claim(search, generation)) >= 0){
+		struct Search_Block *block = &search->blocks[(start + k) % search->block_count];
+		int i;
+		for(i = block->first; i < block->end; i++){
+			if(__atomic_load_n(&search->cancel, __ATOMIC_RELAXED)){
+				return;
+			}
+			if(search->regex){
+				Search_Run_Regex(block, &search->spans[i], matcher);
+			}else{
+				Search_Run(block, &search->spans[i]);
+			}
+		}
+		__atomic_store_n(&block->done, 1, __ATOMIC_RELEASE);
+		if(__atomic_add_fetch(&search->finished, 1, __ATOMIC_ACQ_REL) == search->block_count){
+			pthread_mutex_lock(&search->lock);
+			pthread_cond_broadcast(&search->idle);
+			pthread_mutex_unlock(&search->lock);
+		}
+	}
+}
+
+void *Search_Worker( void *arg )
+{
+	struct Search *search = arg;
+	struct Regex_Matcher matcher;
+	int seen = 0, start = 0;
+	memset(&matcher, 0, sizeof(matcher));
+	pthread_mutex_lock(&search->lock);
+	while(!search->stop){
+		if(search->generation == seen || search->cancel){
+			seen = search->generation;
+			pthread_cond_wait(&search->wake, &search->lock);
+			continue;
+		}
+		seen = search->generation;	/* both taken with the claim state they go with */
+		start = search->block_start;
+		search->busy++;
+		pthread_mutex_unlock(&search->lock);
+		Search_Work(search, &matcher, seen, start);
+		pthread_mutex_lock(&search->lock);
+		if(--search->busy == 0){
+			pthread_cond_broadcast(&search->idle);
+		}
+	}
+	pthread_mutex_unlock(&search->lock);
+	Regex_Matcher_Free(&matcher);
+	return NULL;
+}
+
+/**	One worker per online CPU, up to SEARCH_THREADS. With none, scans	**/
+/**	run on the input thread.						**/
+void Search_Pool_Start()
+{
+	struct Search *search = config->search;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int count = (cpus < 1) ? 1 : (cpus > SEARCH_THREADS) ? SEARCH_THREADS : cpus;
+	search->threads = malloc(sizeof(pthread_t) * count);
+	Check_Mem(search->threads, "search threads");
+	while(search->thread_count < count
+	      && pthread_create(&search->threads[search->thread_count], NULL, Search_Worker, search) == 0){
+		search->thread_count++;
+	}
+}
+
+void Search_Pool_Stop()
+{
+	struct Search *search = config->search;
+	int i;
+	Search_Clear();
+	pthread_mutex_lock(&search->lock);
+	search->stop = 1;
+	pthread_cond_broadcast(&search->wake);
+	pthread_mutex_unlock(&search->lock);
+	for(i = 0; i < search->thread_count; i++){
+		pthread_join(search->threads[i], NULL);
+	}
+	if(search->threads){
+		free_mem(search->threads, "search threads");
+	}
+	Regex_Matcher_Free(&search->matcher);
+	pthread_mutex_destroy(&search->lock);
+	pthread_cond_destroy(&search->wake);
+	pthread_cond_destroy(&search->idle);
+}
+
+/**	Takes the snapshot the workers scan, once per prompt: the buffer	**/
+/**	cannot change until Find returns. Runs of rows that are back to	**/
+/**	back in the mapping become one span, like Save_Start writes them,	**/
+/**	up to SEARCH_BLOCK bytes so each span knows its first row. Spans	**/
+/**	are then grouped into blocks of about SEARCH_BLOCK bytes.		**/
+void Search_Snapshot()
+{
+	struct Search *search = config->search;
+	if(search->spans){
+		return;
+	}
+	Map_Index_Lines(INT_MAX);
+	search->spans = Heap_Alloc(HEAP_SEARCH, NULL, sizeof(struct Search_Span) * (*config->num_of_rows + 1));
+	Check_Mem(search->spans, "search spans");
+	int merge = 0;
+	int index = 0;
+	struct Row_Iter iter;
+	File_row *row = Row_Iter_Seek(&iter, 0);
+	for(; row; row = Row_Iter_Next(&iter), index++){
+		const char *text = Row_Text(row);
+		if(row->flags & ROW_MAPPED){
+			struct Search_Span *last = &search->spans[search->span_count - 1];
+			if(merge && last->data + last->len + 1 == text && last->data[last->len] == '\n'
+			   && last->len < SEARCH_BLOCK){
+				last->len += row->size + 1;
+				continue;
+			}
+			merge = 1;
+		}else{
+			merge = 0;
+		}
+		search->spans[search->span_count].data = text;
+		search->spans[search->span_count].len = row->size;
+		search->spans[search->span_count].row = index;
+		search->span_count++;
+	}
+
+	size_t bytes = 0;
+	int i, first = 0;
+	search->blocks = Heap_Alloc(HEAP_SEARCH, NULL, sizeof(struct Search_Block) * (search->span_count + 1));
+	Check_Mem(search->blocks, "search blocks");
+	for(i = 0; i < search->span_count; i++){
+		bytes += search->spans[i].len + 1;
+		if(bytes >= SEARCH_BLOCK || i == search->span_count - 1){
+			struct Search_Block *block = &search->blocks[search->block_count++];
+			memset(block, 0, sizeof(struct Search_Block));
+			block->first = first;
+			block->end = i + 1;
+			first = i + 1;
+			bytes = 0;
+		}
+	}
+}
+
+/**	Index of the block holding row, or -1 before the first one.	**/
+int Search_Block_Of( int row )
+{
+	struct Search *search = config->search;
+	int low = 0, high = search->block_count;
+	while(low < high){
+		int mid = low + (high - low) / 2;
+		if(search->spans[search->blocks[mid].first].row <= row){
+			low = mid + 1;
+		}else{
+			high = mid;
+		}
+	}
+	return low - 1;
+}
+
+/**	Starts scanning the snapshot for query on the workers. Results are	**/
+/**	picked up by Search_Poll. The claim state is reset under the lock,	**/
+/**	with no worker busy, in the same step that bumps the generation.	**/
+void Search_Scan()
+{
+	struct Search *search = config->search;
+	int i;
+	Search_Cancel();
+	Search_Snapshot();
+	if(!search->threads){
+		Search_Pool_Start();
+	}
+	int start = Search_Block_Of(search->origin_row);
+	search->reported = -1;
+	search->have_first = 0;
+	search->running = 1;
+	pthread_mutex_lock(&search->lock);
+	while(search->busy > 0){
+		pthread_cond_wait(&search->idle, &search->lock);
+	}
+	for(i = 0; i < search->block_count; i++){
+		search->blocks[i].count = 0;
+		search->blocks[i].done = 0;
+	}
+	search->block_start = (start < 0) ? 0 : start;
+	search->next_block = 0;
+	search->finished = 0;
+	search->cancel = 0;
+	__atomic_store_n(&search->generation, search->generation + 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&search->wake);
+	pthread_mutex_unlock(&search->lock);
+	if(search->thread_count == 0){
+		Search_Work(search, &search->matcher, search->generation, search->block_start);
+	}
+}
+
+int Search_Pending()
+{
+	return config->search->running;
+}
+
+/**	Index of the first of matches[0, count) at or after (row, x).	**/
+int Search_Lower( struct Search_Match *matches, int count, int row, int x )
+{
+	int low = 0, high = count;
+	while(low < high){
+		int mid = low + (high - low) / 2;
+		if(matches[mid].row < row || (matches[mid].row == row && matches[mid].x < x)){
+			low = mid + 1;
+		}else{
+			high = mid;
+		}
+	}
+	return low;
+}
+
+/**	Index of the first match at or after (row, x), wrapping to 0.	**/
+int Search_Select( int row, int x )
+{
+	struct Search *search = config->search;
+	int at = Search_Lower(search->matches, search->count, row, x);
+	return (at == search->count) ? 0 : at;
+}
+
+/**	Whether two copies of s can overlap: a proper prefix of s is also	**/
+/**	a suffix of it. When they cannot, a scan finds every copy.		**/
+int Search_Overlaps( const char *s, int len )
+{
+	int k;
+	for(k = 1; k < len; k++){
+		if(memcmp(s, &s[len - k], k) == 0){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**	Fills matches with the entries of from[0, count) that the whole	**/
+/**	query starts at, its first 'known' bytes being there already.	**/
+/**	from may be matches itself, it is compacted in place.		**/
+void Search_Narrow( struct Search_Match *from, int count, int known )
+{
+	struct Search *search = config->search;
+	struct Row_Iter iter;
+	File_row *row = NULL;
+	int index = -1;
+	int kept = 0;
+	int i;
+	Search_Reserve(count);
+	for(i = 0; i < count; i++){
+		struct Search_Match match = from[i];
+		if(match.row != index){
+			row = Row_Iter_Reach(&iter, &index, match.row);
+		}
+		if(match.x + search->query_len > row->size
+		   || memcmp(&Row_Text(row)[match.x + known], &search->query[known], search->query_len - known) != 0){
+			continue;
+		}
+		if(kept && search->matches[kept - 1].row == match.row
+		   && match.x < search->matches[kept - 1].x + search->query_len){
+			continue;	/* overlaps the match before it */
+		}
+		match.len = search->query_len;
+		search->matches[kept++] = match;
+	}
+	search->count = kept;
+}
+
+/**	Joins the blocks of a finished scan into matches, in buffer order,	**/
+/**	and keeps them as the candidates of the new base, unless the query	**/
+/**	is a regex.								**/
+void Search_Collect()
+{
+	struct Search *search = config->search;
+	int i, total = 0;
+	for(i = 0; i < search->block_count; i++){
+		total += search->blocks[i].count;
+	}
+	Search_Reserve(total);
+	search->count = 0;
+	for(i = 0; i < search->block_count; i++){
+		struct Search_Block *block = &search->blocks[i];
+		if(block->count){
+			memcpy(&search->matches[search->count], block->matches, sizeof(struct Search_Match) * block->count);
+			search->count += block->count;
+		}
+	}
+	search->running = 0;
+
+	if(!search->regex){
+		if(search->base){
+			free_mem(search->base, "search base");
+		}
+		search->base = strdup(search->query);
+		Check_Mem(search->base, "search base");
+		search->base_len = search->query_len;
+		search->base_overlap = search->overlap;
+		Heap_Free(search->candidates);
+		search->candidates = Heap_Alloc(HEAP_SEARCH, NULL, sizeof(struct Search_Match) * (search->count + 1));
+		Check_Mem(search->candidates, "search candidates");
+		if(search->count){
+			memcpy(search->candidates, search->matches, sizeof(struct Search_Match) * search->count);
+		}
+		search->candidate_count = search->count;
+	}
+
+	if(search->have_first){
+		search->current = Search_Select(search->first.row, search->first.x);
+	}else{
+		search->current = search->count ? Search_Select(search->origin_row, search->origin_x) : -1;
+	}
+}
+
+/**	The first match after the origin among the blocks finished so far,	**/
+/**	in claim order. Stops at the first block still being scanned.	**/
+int Search_Find_First()
+{
+	struct Search *search = config->search;
+	int k;
+	for(k = 0; k <= search->block_count; k++){
+		struct Search_Block *block = &search->blocks[(search->block_start + k) % search->block_count];
+		if(!__atomic_load_n(&block->done, __ATOMIC_ACQUIRE)){
+			return 0;
+		}
+		int from = 0, to = block->count;
+		if(k == 0){
+			from = Search_Lower(block->matches, block->count, search->origin_row, search->origin_x);
+		}else if(k == search->block_count){
+			to = Search_Lower(block->matches, block->count, search->origin_row, search->origin_x);
+		}
+		if(from < to){
+			search->first = block->matches[from];
+			search->have_first = 1;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void Search_Status()
+{
+	struct Search *search = config->search;
+	const char *mode = search->regex_mode ? "Regex" : "Search";
+	const char *other = search->regex_mode ? "TEXT" : "REGEX";
+	if(search->running){
+		int i, found = 0;
+		for(i = 0; i < search->block_count; i++){
+			if(__atomic_load_n(&search->blocks[i].done, __ATOMIC_ACQUIRE)){
+				found += search->blocks[i].count;
+			}
+		}
+		Set_Status_Message("%s %s (searching, %d found)", mode, search->query, found);
+	}else if(search->current == -1){
+		if(search->query_len){
+			Set_Status_Message("%s %s (no matches)", mode, search->query);
+		}else{
+			Set_Status_Message("%s  (USE ESC/ARROWS/ENTER, CTRL + R = %s)", mode, other);
+		}
+	}else{
+		Set_Status_Message("%s %s (%d of %d, USE ESC/ARROWS/ENTER)", mode, search->query, search->current + 1, search->count);
+	}
+}
+
+/**	Steps from the cursor to the next match, or the previous one, among	**/
+/**	the blocks already scanned, so arrows work while the scan runs.	**/
+/**	The match becomes the one the collected index lands on.		**/
+int Search_Step_Partial( int step )
+{
+	struct Search *search = config->search;
+	int row = *config->cursor_y, x = *config->cursor_x;
+	int n = search->block_count;
+	int b = Search_Block_Of(row);
+	int k;
+	if(b < 0){
+		b = 0;
+	}
+	for(k = 0; n && k <= n; k++){
+		struct Search_Block *block = &search->blocks[((b + step * k) % n + n) % n];
+		if(!__atomic_load_n(&block->done, __ATOMIC_ACQUIRE)){
+			continue;
+		}
+		int at;
+		if(step > 0){
+			at = (k == 0) ? Search_Lower(block->matches, block->count, row, x + 1) : 0;
+		}else{
+			at = ((k == 0) ? Search_Lower(block->matches, block->count, row, x) : block->count) - 1;
+		}
+		if(at >= 0 && at < block->count){
+			search->first = block->matches[at];
+			search->have_first = 1;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**	Puts the cursor on a match, scrolled to the top of the screen.	**/
+void Search_Show( struct Search_Match *match )
+{
+	*config->cursor_y = match->row;
+	*config->cursor_x = match->x;
+	*config->current_row = *config->num_of_rows;
+	Scroll();
+}
+
+/**	Picks up what the workers have found since the last call, and with	**/
+/**	'wait', lets the scan finish first. Returns 1 when the screen needs	**/
+/**	to be redrawn.								**/
+int Search_Poll( int wait )
+{
+	struct Search *search = config->search;
+	if(!search->running){
+		return 0;
+	}
+	if(wait && search->thread_count){
+		pthread_mutex_lock(&search->lock);
+		while(__atomic_load_n(&search->finished, __ATOMIC_ACQUIRE) < search->block_count){
+			pthread_cond_wait(&search->idle, &search->lock);
+		}
+		pthread_mutex_unlock(&search->lock);
+	}
+	int finished = __atomic_load_n(&search->finished, __ATOMIC_ACQUIRE);
+	if(finished == search->block_count){
+		Search_Collect();
+		if(search->current != -1){
+			Search_Show(&search->matches[search->current]);
+		}
+	}else if(!search->have_first && Search_Find_First()){
+		Search_Show(&search->first);
+	}else if(finished == search->reported){
+		return 0;
+	}
+	search->reported = finished;
+	Search_Status();
+	return 1;
+}
+
+/**	Indexes every match of query. A query that extends the last one, or	**/
+/**	base, only rechecks that one's matches, as long as it has no	**/
+/**	overlapping copies that a scan would have skipped. Anything else	**/
+/**	is a full scan on the workers, which becomes the new base. Regexes	**/
+/**	are always a full scan.						**/
+void Search_Build( const char *query )
+{
+	struct Search *search = config->search;
+	int len = strlen(query);
+	int literal = !search->regex_mode;
+	int from_last = literal && !search->regex && !search->running && search->query && search->query_len
+	                && !search->overlap && len >= search->query_len && memcmp(query, search->query, search->query_len) == 0;
+	int from_base = literal && search->base && search->base_len && !search->base_overlap
+	                && len >= search->base_len && memcmp(query, search->base, search->base_len) == 0;
+	int known = search->query_len;
+	const char *error = NULL;
+	Search_Cancel();
+	if(search->regex){
+		Regex_Free(search->regex);
+		search->regex = NULL;
+	}
+	if(search->query){
+		free_mem(search->query, "search query");
+	}
+	search->query = strdup(query);
+	Check_Mem(search->query, "search query");
+	search->query_len = len;
+	search->overlap = Search_Overlaps(query, len);
+	search->current = -1;
+	if(len && !literal && !(search->regex = Regex_Compile(query, &error))){
+		search->count = 0;
+		Set_Status_Message("Regex %s (%s)", query, error);
+		return;
+	}
+	if(len == 0){
+		search->count = 0;
+		Search_Status();
+		return;
+	}else if(from_last){
+		Search_Narrow(search->matches, search->count, known);
+	}else if(from_base){
+		Search_Narrow(search->candidates, search->candidate_count, search->base_len);
+	}else{
+		Search_Scan();
+		Search_Poll(0);
+		return;
+	}
+	if(search->count){
+		search->current = Search_Select(search->origin_row, search->origin_x);
+		Search_Show(&search->matches[search->current]);
+	}
+	Search_Status();
+}
+
+/**	The matches found so far in a row, and how many there are. During	**/
+/**	a scan they come from the row's block once it is done.		**/
+struct Search_Match *Search_Row( int row, int *count )
+{
+	struct Search *search = config->search;
+	struct Search_Match *matches = search->matches;
+	int total = search->count;
+	*count = 0;
+	if(!search->query_len){
+		return NULL;
+	}
+	if(search->running){
+		int b = Search_Block_Of(row);
+		if(b < 0 || !__atomic_load_n(&search->blocks[b].done, __ATOMIC_ACQUIRE)){
+			return NULL;
+		}
+		matches = search->blocks[b].matches;
+		total = search->blocks[b].count;
+	}
+	int from = Search_Lower(matches, total, row, 0);
+	int to = from;
+	while(to < total && matches[to].row == row){
+		to++;
+	}
+	*count = to - from;
+	return &matches[from];
+}
+
+/**	Marks the matches of a drawn row in its screen attributes; attr	**/
+/**	holds len columns starting at current_col.				**/
+void Search_High_Light( File_row *row, int at, unsigned char *attr, int len )
+{
+	int count = 0, i;
+	struct Search_Match *matches = Search_Row(at, &count);
+	for(i = 0; i < count; i++){
+		int from = Row_Cursor_2_Render(row, matches[i].x) - *config->current_col;
+		if(from >= len){
+			break;
+		}
+		int to = Row_Cursor_2_Render(row, matches[i].x + matches[i].len) - *config->current_col;
+		if(from < 0){
+			from = 0;
+		}
+		if(to > len){
+			to = len;
+		}
+		if(to > from){
+			memset(&attr[from], HL_MATCH, to - from);
+		}
+	}
+}
+
+void Find_Call_Back( char *query, int key_press )
+{
+	struct Search *search = config->search;
+
+	if(key_press == '\r' && search->running){
+		Search_Poll(1);		/* land on the match that was accepted */
+		Set_Status_Message("");
+	}
+	if(key_press == '\r' || key_press == '\x1b'){
+		return;
+	}
+	if(key_press == CTRL_KEY('r')){
+		search->regex_mode = !search->regex_mode;
+		Search_Build(query);
+		return;
+	}
+	if(!search->query || strcmp(query, search->query) != 0){
+		Search_Build(query);
+		return;
+	}
+	int step = 0;
+	if(key_press == ARROW_RIGHT || key_press == ARROW_DOWN){
+		step = 1;
+	}else if(key_press == ARROW_LEFT || key_press == ARROW_UP){
+		step = -1;
+	}
+	if(step && search->running){
+		Search_Poll(0);
+	}
+	if(step && search->running){
+		if(Search_Step_Partial(step)){
+			Search_Show(&search->first);
 		}
-		rx++;
+	}else if(step && search->count){
+		search->current = (search->current + search->count + step) % search->count;
+		Search_Show(&search->matches[search->current]);
 	}
-	return rx;
+	Search_Status();
 }
 
-int Row_Rx_2_Cx( File_row *row, int rx )
+/**	Replaces every match in the index with text. Each row holding	**/
+/**	matches is rebuilt once, by a single splice from its first match	**/
+/**	to the end of its last, and the whole replace is one undo group.	**/
+void Replace_All( const char *text, int len )
 {
-	int cur_rx = 0;
-	int cx = 0;
-	for( cx = 0; cx < *row->size; cx++ ){
-		if(row->string[cx] == '\t'){
-			cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP);
+	struct Search *search = config->search;
+	struct Buffer spliced = BUFFER_CONSTR;
+	struct Row_Iter iter;
+	struct timespec start;
+	File_row *row;
+	int index = -1;
+	int rows = 0;
+	int i = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	Search_Poll(1);
+	Undo_Boundary(UNDO_OTHER);
+	while(i < search->count){
+		struct Search_Match *first = &search->matches[i];
+		int end = i + 1;
+		while(end < search->count && search->matches[end].row == first->row){
+			end++;
 		}
-		cur_rx++;
-		if(cur_rx > rx){
-			return cx;
+		row = Row_Iter_Reach(&iter, &index, first->row);
+		const char *old = Row_Text(row);
+		int to = first->x;
+		int k;
+		spliced.length = 0;
+		for(k = i; k < end; k++){
+			if(search->matches[k].x > to){
+				Append_Buffer(&spliced, &old[to], search->matches[k].x - to);
+			}
+			Append_Buffer(&spliced, text, len);
+			to = search->matches[k].x + search->matches[k].len;
 		}
+		Row_Splice(row, index, first->x, to - first->x, spliced.string, spliced.length);
+		rows++;
+		i = end;
 	}
-
-	return cx;
+	Undo_Boundary(UNDO_OTHER);
+	Free_Buffer(&spliced);
+	Set_Status_Message("Replaced %d matches in %d rows (%.1f ms)", search->count, rows, Save_Seconds(&start) * 1000);
 }
 
-void Update_Row( File_row *row )
+void Replace()
 {
-	int j = 0, idx = 0, tabs = 0;
+	struct Search *search = config->search;
+	int saved_cursor_x = *config->cursor_x;
+	int saved_cursor_y = *config->cursor_y;
+	int saved_current_col = *config->current_col;
+	int saved_current_row = *config->current_row;
 
-	for( j = 0; j < *row->size; j++){
-		if(row->string[j] == '\t'){
-			tabs++;
+	search->origin_row = saved_cursor_y;
+	search->origin_x = saved_cursor_x;
+	char *query = Prompt(search->regex_mode ? "Replace regex %s (USE ESC/ARROWS/ENTER, CTRL + R = TEXT)"
+	                     : "Replace %s (USE ESC/ARROWS/ENTER, CTRL + R = REGEX)",Find_Call_Back);
+	char *with = query ? Prompt("Replace with: %s (ESC to cancel)",NULL) : NULL;
+	*config->cursor_x = saved_cursor_x;
+	*config->cursor_y = saved_cursor_y;
+	*config->current_col = saved_current_col;
+	*config->current_row = saved_current_row;
+	if(with){
+		Replace_All(with, strlen(with));
+		File_row *row = Row_At(saved_cursor_y);
+		if(row && *config->cursor_x > 0){
+			*config->cursor_x = (*config->cursor_x < row->size) ? Row_Char_Start(row, *config->cursor_x) : row->size;
 		}
+		free_mem(with,"with");
 	}
-
-	free( row->render );						
-	row->render = malloc( *row->size + (tabs * (TAB_STOP - 1)) + 1 );
-	
-	for( j = 0; j < *row->size; j++ ){
-		if(row->string[j] == '\t'){
-			row->render[idx++] = ' ';
-			while( ( idx % TAB_STOP )!= 0){
-				row->render[idx++] = ' ';
-			}
-		}else{
-			row->render[idx++] = row->string[j];
-		}
+	Search_Clear();
+	if(query){
+		free_mem(query,"query");
 	}
-	row->render[idx] = '\0';
-	*row->render_size = idx;
-	Update_Syntax(row);
 }
 
-void Insert_Row( int index, char *line, size_t linelen )
-{			
-	if(index < 0 || index > *config->num_of_rows){
-		return;
-	}
-	
-	config->row = realloc(config->row, sizeof(File_row) * (*config->num_of_rows + 1));
-	Check_Mem(config->row,"config->row");
+void Find()
+{
+	int saved_cursor_x = *config->cursor_x;
+	int saved_cursor_y = *config->cursor_y;
+	int saved_current_col = *config->current_col;
+	int saved_current_row = *config->current_row;
 
-	memmove(&config->row[index + 1], &config->row[index], sizeof(File_row) * (*config->num_of_rows - index));
-	config->row[index].idx = malloc(sizeof(int));
-	for(int j = index + 1; j <= *config->num_of_rows; j++ ){
-		(*config->row[j].idx)++; 
+	config->search->origin_row = saved_cursor_y;
+	config->search->origin_x = saved_cursor_x;
+	char *query = Prompt(config->search->regex_mode ? "Regex %s (USE ESC/ARROWS/ENTER, CTRL + R = TEXT)"
+	                     : "Search %s (USE ESC/ARROWS/ENTER, CTRL + R = REGEX)",Find_Call_Back);
+	Search_Clear();
+	if(query){
+		free_mem(query,"query");
+	}else{
+		*config->cursor_x = saved_cursor_x;
+		*config->cursor_y = saved_cursor_y;
+		*config->current_col = saved_current_col;
+		*config->current_row = saved_current_row;
 	}
-
-	*config->row[index].idx = index;	
-
-	config->row[index].size = malloc(sizeof(int));
-	*config->row[index].size = linelen;
-
-	config->row[index].string = malloc((linelen + 1));
-	memcpy(config->row[index].string, line, linelen);
-	config->row[index].string[linelen] = '\0';
-
-	config->row[index].render_size = malloc(sizeof(int));
-	*config->row[index].render_size = 0;
-
-	config->row[index].hl_open_comment = malloc(sizeof(int));
-	*config->row[index].hl_open_comment = 0;	
-	
-	config->row[index].render = NULL;
-	config->row[index].high_lighted = NULL;
-
-	Update_Row( &config->row[index] );
-	(*config->num_of_rows)++;
-	(*config->dirty_flag)++;
-}
-
-void Row_Free( File_row *row )
-{
-	free_mem(row->idx,"row->idx");
-	free_mem(row->hl_open_comment,"row->hl_open_comment");
-	free_mem(row->high_lighted,"row->high_lighted");
-	free_mem(row->render,"row->render");
-	free_mem(row->render_size,"row->render_size");
-	free_mem(row->string,"row->string");
-	free_mem(row->size,"row->size");
 }
 
-void Del_Whole_Row( int row_num )
+/* APPEND BUFFER */
+/**	Grows the buffer geometrically so appends are amortised O(1).	**/
+int Reserve_Buffer( struct Buffer *buff, int size )
 {
-	if(row_num < 0 || row_num >= *config->num_of_rows){
-		return;
+	if(buff->length + size <= buff->capacity){
+		return 0;
 	}
-	Row_Free(&config->row[row_num]);
-	memmove(&config->row[row_num], &config->row[row_num + 1], 
-          sizeof(File_row) * (*config->num_of_rows - row_num - 1));
-          
-	for(int j = row_num; j < *config->num_of_rows - 1; j++){
-		(*config->row[j].idx)--;
+	int capacity = buff->capacity ? buff->capacity * 2 : 256;
+	while(capacity < buff->length + size){
+		capacity *= 2;
 	}
-	(*config->num_of_rows)--;
-	(*config->dirty_flag)++;
+	char *new_buff = Heap_Alloc(buff->kind, buff->string, capacity);
+	Trace_Count(TRACE_ALLOCS, 1);
+	if( new_buff == NULL){
+		return -1;
+	}
+	buff->string = new_buff;
+	buff->capacity = capacity;
+	return 0;
 }
 
-void Row_Insert_Char( File_row *row, int x, int input )
+void Append_Buffer( struct Buffer *buff, const char *key_press, int size )
 {	
-	row->string = realloc(row->string, *row->size + 2);
-	if(x < 0 || x > *row->size){
-		x = *row->size;	
+	if(Reserve_Buffer(buff, size) == -1){
+		return;							
 	}
-
-	memmove(&row->string[x + 1], &row->string[x], *row->size - x + 1);
-	(*row->size)++;
-	row->string[x] = input;
-	Update_Row(row);
-	(*config->dirty_flag)++;
-}
-
-void Row_Append_String( File_row *row, char *string, size_t len	)
-{
-	row->string = realloc(row->string, *row->size + len + 1);
-	memcpy(&row->string[*row->size],string, len);
-	*row->size += len;
-	row->string[*row->size] = '\0';
-	Update_Row(row);
-	(*config->dirty_flag)++;
+	memcpy(&buff->string[buff->length],key_press,size);
+	buff->length += size;
 }
 
-void Row_Delete_Char( File_row *row, int x )
+void Free_Buffer( struct Buffer *buff )
 {
-	if(x < 0 || x >= *row->size){					
-		return;	
-	}
-	memmove(&row->string[x],&row->string[x + 1], *row->size - x);
-	(*row->size)--;
-	Update_Row(row);
-	(*config->dirty_flag)++;
+	Heap_Free(buff->string);
+	buff->string = NULL;
+	buff->length = 0;
+	buff->capacity = 0;
 }
 
-/* EDITOR OPERATIONS */
-void Editor_Insert_Char( int key_press )
+/**	Writes the whole buffer, retrying after short writes and signals.	**/
+int Write_Buffer( int fd, struct Buffer *buff )
 {
-	if(*config->cursor_y == *config->num_of_rows){
-		Insert_Row(*config->num_of_rows, "",0);
+	int done = 0;
+	while(done < buff->length){
+		ssize_t n = write(fd, &buff->string[done], buff->length - done);
+		Trace_Count(TRACE_SYSCALLS, 1);
+		if(n == -1 && errno == EINTR){
+			continue;
+		}
+		if(n <= 0){
+			return -1;
+		}
+		done += n;
 	}
-	Row_Insert_Char( &config->row[*config->cursor_y],*config->cursor_x, key_press);
-	(*config->cursor_x)++;
+	return 0;
 }
 
-void Editor_Insert_Newline()
+/* SCREEN */
+void Screen_Resize( struct Screen *screen, int rows, int cols )
 {
-	if(*config->cursor_x == 0){
-		Insert_Row(*config->cursor_y, "", 0);
-	}else{
-		File_row *row = &config->row[*config->cursor_y];
-		Insert_Row(*config->cursor_y + 1, &row->string[*config->cursor_x], 
-                *row->size - *config->cursor_x);
-		row = &config->row[*config->cursor_y];	
-		*row->size = *config->cursor_x;
-		row->string[*row->size] = '\0';
-		Update_Row(row);
+	if(screen->text){
+		Heap_Free(screen->text);
+		Heap_Free(screen->attr);
+		Heap_Free(screen->back_text);
+		Heap_Free(screen->back_attr);
+		screen->text = NULL;
+		screen->attr = NULL;
+		screen->back_text = NULL;
+		screen->back_attr = NULL;
 	}
-	(*config->cursor_y)++;
-	*config->cursor_x = 0;
-}
-
-void Editor_Delete_Char()
-{
-	if(*config->cursor_y == *config->num_of_rows){
+	Free_Buffer(&screen->frame);
+	screen->rows = rows;
+	screen->cols = cols;
+	screen->valid = 0;
+	if(rows * cols == 0){
 		return;
 	}
 
-	if(*config->cursor_x == 0 && *config->cursor_y == 0){
-		return;
+	int attr = 0;
+	for(attr = 0; attr < 256; attr++){
+		int color = attr & ~ATTR_INVERSE;
+		const char *inverse = (attr & ATTR_INVERSE) ? ";7" : "";
+		if(color == HL_NORMAL){
+			screen->sgr_len[attr] = snprintf(screen->sgr[attr],sizeof(screen->sgr[attr]),"\x1b[0%sm", inverse);
+		}else{
+			screen->sgr_len[attr] = snprintf(screen->sgr[attr],sizeof(screen->sgr[attr]),"\x1b[0%s;%dm", inverse, Syntax_Color(color));
+		}
 	}
-	File_row *row = &config->row[*config->cursor_y];
-	if(*config->cursor_x > 0){
-		Row_Delete_Char(row,*config->cursor_x - 1);
-		(*config->cursor_x)--;
-	}else{
-		*config->cursor_x = *config->row[*config->cursor_y - 1].size;
-		Row_Append_String(&config->row[*config->cursor_y - 1], row->string, *row->size);
-		Del_Whole_Row(*config->cursor_y);
-		(*config->cursor_y)--;	
+	/* a full redraw: every cell plus a colour change and a cursor move every few cells */
+	if(Reserve_Buffer(&screen->frame, rows * cols * 4 + rows * 16) == -1){
+		die("screen->frame");
 	}
+	screen->text = Heap_Alloc(HEAP_SCREEN, NULL, rows * cols * sizeof(unsigned int));
+	Check_Mem(screen->text,"screen->text");
+	screen->attr = Heap_Alloc(HEAP_SCREEN, NULL, rows * cols);
+	Check_Mem(screen->attr,"screen->attr");
+	screen->back_text = Heap_Alloc(HEAP_SCREEN, NULL, rows * cols * sizeof(unsigned int));
+	Check_Mem(screen->back_text,"screen->back_text");
+	screen->back_attr = Heap_Alloc(HEAP_SCREEN, NULL, rows * cols);
+	Check_Mem(screen->back_attr,"screen->back_attr");
 }
-							
-/* FILE INPUT/OUTPUT */
-char *Rows_To_String( int *buff_len )
+
+void Screen_Fill( struct Screen *screen, int y, int x, char c, unsigned char attr, int len )
 {
-	int total_len = 0, i = 0;
-	for(i = 0; i < *config->num_of_rows; i++){	
-		total_len += *config->row[i].size + 1;
-		*buff_len = total_len;
+	if(x + len > screen->cols){
+		len = screen->cols - x;
 	}
-
-	char *buff = malloc(total_len);
-	char *p	 = buff;
-	for(i = 0; i < *config->num_of_rows; i++){
-		memcpy(p,config->row[i].string,*config->row[i].size);
-		p += *config->row[i].size;
-		*p = '\n';
-		p++;
+	if(len > 0){
+		unsigned int *cell = &screen->text[y * screen->cols + x];
+		int i = 0;
+		for(i = 0; i < len; i++){
+			cell[i] = (unsigned char)c;
+		}
+		memset(&screen->attr[y * screen->cols + x], attr, len);
 	}
-	return buff;
 }
 
-void Open_File( char *filename )
+/**	Puts len bytes of UTF-8 text at column x, as many as fit.		**/
+void Screen_Put( struct Screen *screen, int y, int x, const char *text, unsigned char attr, int len )
 {
-	char *line = NULL;
-	size_t fn_len = 0;
-	size_t linecap = 0;
-	ssize_t linelen = 0;
-
-	FILE *fp = fopen(filename,"r+");
-	if(!fp){
-		fp = fopen(filename,"w+");
-		if(!fp){
-			perror("fopen: ");
-			exit(1);		
+	unsigned int *cell = &screen->text[y * screen->cols];
+	unsigned char *cell_attr = &screen->attr[y * screen->cols];
+	int i = 0;
+	while(i < len && x < screen->cols){
+		unsigned int cp = 0;
+		i += Utf8_Decode(&text[i], len - i, &cp);
+		int width = Char_Width(cp);
+		if(width == 0){
+			continue;
+		}
+		if(x + width > screen->cols){
+			break;
+		}
+		cell[x] = (cp < 0x20 || cp == 0x7f) ? '?' : cp;
+		cell_attr[x++] = attr;
+		if(width == 2){
+			cell[x] = 0;
+			cell_attr[x++] = attr;
 		}
 	}
-	fn_len = strlen(filename);
-	config->filename = strndup(filename, fn_len + 1);
+}
 
-	Select_Syntax_High_Light();
-	
-	while((linelen = getline(&line,&linecap,fp)) != -1){
-		if(linelen != -1){
-			while(linelen > 0 && (line[linelen - 1 ] == '\n' || line[linelen - 1] == '\r')){
-				linelen--;
-			}
-			Insert_Row(*config->num_of_rows, line, linelen);
-		} 
+/**	Emits the SGR sequence for attr unless the terminal already uses it.	**/
+void Screen_Pen( struct Screen *screen, struct Buffer *buff, int *pen, int attr )
+{
+	if(*pen == attr){
+		return;
 	}
-	free(line);
-	fclose(fp);
-	*config->dirty_flag = 0;
+	Append_Buffer(buff, screen->sgr[attr], screen->sgr_len[attr]);
+	*pen = attr;
 }
 
-void Save_File()
+void Screen_Cells( struct Screen *screen, struct Buffer *buff, int *pen, int y, int from, int to )
 {
-	if( config->filename == NULL){
-		config->filename = Prompt("Save as: %s",NULL);
-		if(!config->filename){
-			Set_Status_Message("Save Cancelled.");
+	unsigned int *text = &screen->text[y * screen->cols];
+	unsigned char *attr = &screen->attr[y * screen->cols];
+	while(from < to){
+		int run = from + 1;
+		while(run < to && attr[run] == attr[from]){
+			run++;
+		}
+		Screen_Pen(screen, buff, pen, attr[from]);
+		if(Reserve_Buffer(buff, (run - from) * 4) == -1){
 			return;
 		}
-		
-		Select_Syntax_High_Light();
-	}
-	int len = 0;
-	char *buff = Rows_To_String(&len);
-
-	int fd = open(config->filename, O_RDWR | O_CREAT, 0644);
-	if(fd != -1){						//ERROR HANDLING.
-		if(ftruncate(fd,len) != -1){
-			if(write(fd, buff, len) == len){
-				close(fd);
-				free(buff);
-				Set_Status_Message("%s Filename Saved, %d Bytes Written.",config->filename,len);
-				*config->dirty_flag = 0;
-				return;
+		char *out = &buff->string[buff->length];
+		for(; from < run; from++){
+			if(text[from] == 0){
+				continue;	/* right half of a wide character */
+			}
+			if(text[from] < 0x80){
+				*out++ = text[from];
+			}else{
+				out += Utf8_Encode(text[from], out);
 			}
 		}
-		close(fd);
+		buff->length = out - buff->string;
 	}
-	Set_Status_Message("Error Saving: %s",strerror(errno));
-	free(buff);
 }
 
-/* SEARCH */
-void Find_Call_Back( char *query, int key_press )
+/**	Moves what the terminal shows for the text rows by top - screen->top	**/
+/**	lines with a scroll region, and the back buffer along with it.	**/
+void Screen_Scroll( struct Screen *screen, struct Buffer *buff, int *pen, int text_rows, int top )
 {
-	static int last_match = -1;
-	static int direction = 1;
-
-	static int saved_hl_line;
-	static char *saved_hl = NULL;
-
-	if(saved_hl){
-		memcpy(config->row[saved_hl_line].high_lighted, saved_hl, 
-           *config->row[saved_hl_line].render_size);
-		free_mem(saved_hl,"saved_hl");
-		saved_hl = NULL;
+	int delta = top - screen->top;
+	int cols = screen->cols;
+	if(!screen->valid || delta == 0 || abs(delta) > text_rows / 2){
+		return;
 	}
+	char seq[32];
+	int len = snprintf(seq,sizeof(seq),"\x1b[1;%dr\x1b[%d%c\x1b[r", text_rows, abs(delta), delta > 0 ? 'S' : 'T');
+	Screen_Pen(screen, buff, pen, HL_NORMAL);
+	Append_Buffer(buff,seq,len);
 
-	if(key_press == '\r' || key_press == '\x1b'){
-		last_match = -1;
-		direction = 1;
-		return;
-	}else if(key_press == ARROW_RIGHT || key_press == ARROW_DOWN){
-		direction = 1;
-	}else if(key_press == ARROW_LEFT || key_press == ARROW_UP){
-		direction = -1;
+	int keep = (text_rows - abs(delta)) * cols;
+	int blank = (delta > 0) ? keep : 0;
+	int i = 0;
+	if(delta > 0){
+		memmove(screen->back_text, &screen->back_text[delta * cols], keep * sizeof(unsigned int));
+		memmove(screen->back_attr, &screen->back_attr[delta * cols], keep);
 	}else{
-		last_match = -1;
-		direction = 1;
+		memmove(&screen->back_text[-delta * cols], screen->back_text, keep * sizeof(unsigned int));
+		memmove(&screen->back_attr[-delta * cols], screen->back_attr, keep);
 	}
-	
-	if(last_match == -1){
-		direction = 1;
+	for(i = 0; i < abs(delta) * cols; i++){
+		screen->back_text[blank + i] = ' ';
 	}
+	memset(&screen->back_attr[blank], HL_NORMAL, abs(delta) * cols);
+	screen->top = top;
+}
 
-	int current = last_match;
-	int i = 0;
-	for( i = 0; i < *config->num_of_rows; i++){
-		current += direction;
-		if(current == -1){
-			current = *config->num_of_rows -1;
-		}else if(current == *config->num_of_rows){
-			current = 0;
-		}
-		File_row *row = &config->row[current];
-		char *match = strstr(row->render,query);
-		if(match){
-			last_match = current;
-			*config->cursor_y = current;
-			*config->cursor_x = Row_Rx_2_Cx(row, match - row->render);
-			*config->current_row = *config->num_of_rows;
-
-			saved_hl_line = current;
-			saved_hl = malloc(*row->render_size);
-			memcpy(saved_hl, row->high_lighted, *row->render_size);
-			
-			memset(&row->high_lighted[match - row->render], HL_MATCH, strlen(query));
-			break;
-		}
-
+/**	Number of cells of row y left once trailing blanks are dropped.	**/
+int Screen_Row_End( const unsigned int *text, const unsigned char *attr, int cols )
+{
+	while(cols > 0 && text[cols - 1] == ' ' && attr[cols - 1] == HL_NORMAL){
+		cols--;
 	}
+	return cols;
 }
 
-void Find()
+/**	Writes the cells that differ from the back buffer. Changed cells	**/
+/**	less than SCREEN_GAP apart are sent as one span, since rewriting a	**/
+/**	few cells is cheaper than another cursor move.				**/
+void Screen_Flush( struct Screen *screen, struct Buffer *buff, int text_rows, int top )
 {
-	int saved_cursor_x = *config->cursor_x;
-	int saved_cursor_y = *config->cursor_y;
-	int saved_current_col = *config->current_col;
-	int saved_current_row = *config->current_row;
-
-	char *query = Prompt("Search %s (USE ESC/ARROWS/ENTER)",Find_Call_Back);
-	if(query){
-		free_mem(query,"query");
+	int pen = -1;
+	int cols = screen->cols;
+	int y = 0;
+	if(!screen->valid){
+		Append_Buffer(buff,"\x1b[0m\x1b[2J",8);
+		pen = HL_NORMAL;
+		for(y = 0; y < screen->rows * cols; y++){
+			screen->back_text[y] = ' ';
+		}
+		memset(screen->back_attr, HL_NORMAL, screen->rows * cols);
 	}else{
-		*config->cursor_x = saved_cursor_x;
-		*config->cursor_y = saved_cursor_y;
-		*config->current_col = saved_current_col;
-		*config->current_row = saved_current_row;
+		Screen_Scroll(screen, buff, &pen, text_rows, top);
 	}
-}
 
-/* APPEND BUFFER */
-void Append_Buffer( struct Buffer *buff, const char *key_press, int size )
-{	
-	char *new_buff = realloc(buff->string, buff->length + size);
-	int length = buff->length;
-	if( new_buff == NULL){
-		return;							
+	for(y = 0; y < screen->rows; y++){
+		unsigned int *text = &screen->text[y * cols];
+		unsigned char *attr = &screen->attr[y * cols];
+		unsigned int *back_text = &screen->back_text[y * cols];
+		unsigned char *back_attr = &screen->back_attr[y * cols];
+		if(!memcmp(text, back_text, cols * sizeof(unsigned int)) && !memcmp(attr, back_attr, cols)){
+			continue;
+		}
+		int end = Screen_Row_End(text, attr, cols);
+		int back_end = Screen_Row_End(back_text, back_attr, cols);
+		char move[32];
+		int x = 0;
+		while(x < end){
+			if(text[x] == back_text[x] && attr[x] == back_attr[x]){
+				x++;
+				continue;
+			}
+			int last = x;
+			int i = x + 1;
+			for(; i < end && i - last <= SCREEN_GAP; i++){
+				if(text[i] != back_text[i] || attr[i] != back_attr[i]){
+					last = i;
+				}
+			}
+			if(text[x] == 0){
+				x--;		/* right half: redraw the wide character */
+			}
+			Append_Buffer(buff, move, snprintf(move,sizeof(move),"\x1b[%d;%dH", y + 1, x + 1));
+			Screen_Cells(screen, buff, &pen, y, x, last + 1);
+			x = last + 1;
+		}
+		if(back_end > end){
+			Append_Buffer(buff, move, snprintf(move,sizeof(move),"\x1b[%d;%dH", y + 1, end + 1));
+			Screen_Pen(screen, buff, &pen, HL_NORMAL);
+			Append_Buffer(buff,"\x1b[K",3);
+		}
+		memcpy(back_text, text, cols * sizeof(unsigned int));
+		memcpy(back_attr, attr, cols);
 	}
-	memcpy(&new_buff[length],key_press,size);
-	buff->string = new_buff;
-	buff->length += size;
-}
+	Screen_Pen(screen, buff, &pen, HL_NORMAL);
 
-void Free_Buffer( struct Buffer *buff )
-{
-	if(buff->string){
-		free_mem(buff->string,"buff->string");
-	}
+	screen->top = top;
+	screen->valid = 1;
 }
 
 /* INPUT */
 char *Prompt( char *prompt, void( *callback )( char *, int ) )
 {
 	size_t buff_size = 128;
-	char *buff = malloc(sizeof(buff_size));
+	char *buff = malloc(buff_size);
 	
 	size_t buff_len = 0;
 	buff[0] = '\0';
 	
+	Set_Status_Message(prompt,buff);
 	while(1){
-		Set_Status_Message(prompt,buff);
 		Refresh_Screen();
 		
 		int key_press = Read_Key();
@@ -1024,7 +7493,22 @@ char *Prompt( char *prompt, void( *callback )( char *, int ) )
 			}
 			buff[buff_len++] = key_press;
 			buff[buff_len] = '\0';
+		}else if(key_press == PASTE_KEY){
+			struct Buffer *paste = &config->input->paste;
+			int i = 0;
+			for(i = 0; i < paste->length; i++){
+				if(iscntrl((unsigned char)paste->string[i])){
+					continue;
+				}
+				if(buff_len == buff_size - 1){
+					buff_size *= 2;
+					buff = realloc(buff,buff_size);
+				}
+				buff[buff_len++] = paste->string[i];
+				buff[buff_len] = '\0';
+			}
 		}
+		Set_Status_Message(prompt,buff);
 		if(callback){
 			callback(buff,key_press);	
 		}
@@ -1033,7 +7517,8 @@ char *Prompt( char *prompt, void( *callback )( char *, int ) )
 
 void Move_Cursor( int key_press )
 {
-	File_row *mc_row = (*config->cursor_y >= *config->num_of_rows ? NULL : &config->row[*config->cursor_y]);
+	Map_Index_Until(*config->cursor_y + 1);
+	File_row *mc_row = Row_At(*config->cursor_y);
 	switch(key_press){
 	case ARROW_UP:
 		if(*config->cursor_y != 0){
@@ -1042,10 +7527,10 @@ void Move_Cursor( int key_press )
 		break;
 	case ARROW_LEFT:
 		if(*config->cursor_x != 0){
-			(*config->cursor_x)--;
+			*config->cursor_x = Row_Char_Start(mc_row, *config->cursor_x - 1);
 		}else if(*config->cursor_y > 0){
 			(*config->cursor_y)--;
-			*config->cursor_x = *config->row[*config->cursor_y].size;
+			*config->cursor_x = Row_At(*config->cursor_y)->size;
 		}
 		break;
 	case ARROW_DOWN:
@@ -1054,9 +7539,9 @@ void Move_Cursor( int key_press )
 		}	
 		break;
 	case ARROW_RIGHT:
-		if(mc_row && *config->cursor_x < *mc_row->size){
-			(*config->cursor_x)++;
-		}else if(mc_row && *config->cursor_x == *mc_row->size){
+		if(mc_row && *config->cursor_x < mc_row->size){
+			*config->cursor_x += Row_Char_Len(mc_row, *config->cursor_x);
+		}else if(mc_row && *config->cursor_x == mc_row->size){
 			(*config->cursor_y)++;
 			*config->cursor_x = 0;
 		}
@@ -1065,11 +7550,25 @@ void Move_Cursor( int key_press )
 		printf("UNKNOWN INPUT\r\n");
 		break;
 	}
-	mc_row = (*config->cursor_y >= *config->num_of_rows) ? NULL : &config->row[*config->cursor_y];
-	int row_len = mc_row ? *mc_row->size : 0;
+	mc_row = Row_At(*config->cursor_y);
+	int row_len = mc_row ? mc_row->size : 0;
 	if(*config->cursor_x > row_len){
 		*config->cursor_x = row_len;	
+	}else if(*config->cursor_x < row_len){
+		*config->cursor_x = Row_Char_Start(mc_row, *config->cursor_x);
+	}
+}
+
+/**	Which keys extend the current undo group instead of closing it.	**/
+int Undo_Kind( int key_press )
+{
+	if(key_press == BACK_SPACE || key_press == CTRL_KEY('h') || key_press == DEL_KEY){
+		return UNDO_ERASE;
 	}
+	if(key_press == '\t' || (key_press < 256 && !iscntrl(key_press))){
+		return UNDO_TYPING;
+	}
+	return UNDO_OTHER;
 }
 
 void Process_Key_Press()
@@ -1077,6 +7576,7 @@ void Process_Key_Press()
 	static int quit_times = TEDIT_QUIT;
 	int times = 0; 
 	int key_press = Read_Key();
+	Undo_Boundary(Undo_Kind(key_press));
 	switch(key_press){
 		case '\r':
 			Editor_Insert_Newline();
@@ -1087,11 +7587,13 @@ void Process_Key_Press()
 			break;	
 
 		case CTRL_KEY('q'):
+			Save_Poll(1);
 			if( *config->dirty_flag && quit_times > 0){
 				Set_Status_Message("WARNING UNSAVED DATA WILL BE LOST. Press CTRL + Q %d More Times to Quit.",quit_times);
 				quit_times--;
 				return;
 			}
+			Journal_Close(1);
 			if(write(STDOUT,"\x1b[2J",4) == -1){
 				die("switch[q]");
 			}
@@ -1106,7 +7608,7 @@ void Process_Key_Press()
 
 		case END_KEY:
 			if(*config->cursor_y < *config->num_of_rows){
-				*config->cursor_x = *config->row[*config->cursor_y].size;
+				*config->cursor_x = Row_At(*config->cursor_y)->size;
 			}
 			break;
 
@@ -1114,11 +7616,31 @@ void Process_Key_Press()
 			Find();
 			break;
 
+		case CTRL_KEY('r'):
+			Replace();
+			break;
+
+		case CTRL_KEY('z'):
+			Editor_Undo();
+			break;
+
+		case CTRL_KEY('y'):
+			Editor_Redo();
+			break;
+
+		case CTRL_KEY('t'):
+			config->trace->overlay = (config->trace->overlay + 1) % TRACE_OVERLAY_COUNT;
+			break;
+
+		case CTRL_KEY('d'):
+			Trace_Dump_Prompt();
+			break;
+
 		case BACK_SPACE:
 		case CTRL_KEY('h'):
 		case DEL_KEY:
 			if(key_press == DEL_KEY ){
-				if(*config->cursor_y == *config->num_of_rows - 1 && *config->cursor_x >= *config->row[*config->cursor_y].size){
+				if(*config->cursor_y == *config->num_of_rows - 1 && *config->cursor_x >= Row_At(*config->cursor_y)->size){
 					return;
 				}
 				Set_Status_Message("num: %d",*config->num_of_rows);
@@ -1133,6 +7655,7 @@ void Process_Key_Press()
 				*config->cursor_y = *config->current_row;
 			}else if( key_press == PAGE_DOWN){
 				*config->cursor_y = *config->current_row + *config->screen_rows - 1;
+				Map_Index_Until(*config->cursor_y + *config->screen_rows + 1);
 			}
 
 			if(*config->cursor_y > *config->num_of_rows){
@@ -1152,6 +7675,10 @@ void Process_Key_Press()
 			Move_Cursor(key_press);
 			break;
 
+		case PASTE_KEY:
+			Editor_Insert_Text(config->input->paste.string, config->input->paste.length);
+			break;
+
 		case CTRL_KEY('l'):
 		case '\x1b':
 			break;
@@ -1174,42 +7701,41 @@ void Set_Status_Message( const char *fmt, ... )
 	config->status_time = time(NULL);
 }
 
-void Draw_Status_Bar( struct Buffer *buff )
+void Draw_Status_Bar( struct Screen *screen )
 {
-	Append_Buffer(buff,"\x1b[7m",4);	// 7m for inverted colors
-
-	char status_bar[80], render_bar[80];
-	int len = snprintf(status_bar,sizeof(status_bar),"%.20s - %d lines %s", 
+	int y = *config->screen_rows;
+	char status_bar[160], render_bar[80];
+	int len = snprintf(status_bar,sizeof(status_bar),"%.20s - %d%s lines %s", 
 					   config->filename ? config->filename : "[No Name]", 
-					   *config->num_of_rows, *config->dirty_flag ? "(Modified)": "");
+					   *config->num_of_rows, Map_Pending() ? "+" : "", *config->dirty_flag ? "(Modified)": "");
 	int rlen = snprintf(render_bar,sizeof(render_bar), "%s | %d%d",
 						config->syntax ?  config->syntax->file_type : "no ft", 
 						*config->cursor_y,*config->num_of_rows);
+	if(config->trace->overlay != TRACE_OVERLAY_OFF){
+		len = config->trace->overlay == TRACE_OVERLAY_HEAP ? Heap_Summary(status_bar, sizeof(status_bar))
+								   : Trace_Summary(status_bar, sizeof(status_bar));
+		rlen = *config->screen_cols + 1;		/* the overlay takes the whole bar */
+	}
 	if(len > *config->screen_cols){
 		len = *config->screen_cols;	
 	}
-	Append_Buffer(buff,status_bar,len);
-	for(; len < *config->screen_cols; len++){
-		if(*config->screen_cols - len == rlen){
-			Append_Buffer(buff,render_bar,rlen);
-			break;
-		}else{
-			Append_Buffer(buff," ", 1);
-		}
+	Screen_Fill(screen, y, 0, ' ', ATTR_INVERSE, *config->screen_cols);	// inverted colors
+	Screen_Put(screen, y, 0, status_bar, ATTR_INVERSE, len);
+	if(len <= *config->screen_cols - rlen){
+		Screen_Put(screen, y, *config->screen_cols - rlen, render_bar, ATTR_INVERSE, rlen);
 	}
-	Append_Buffer(buff,"\x1b[m",3);	
-	Append_Buffer(buff,"\r\n",2);
 }
 
-void Draw_Message_Bar( struct Buffer *buff )
+void Draw_Message_Bar( struct Screen *screen )
 {
-	Append_Buffer(buff,"\x1b[K",3);
+	int y = *config->screen_rows + 1;
+	Screen_Fill(screen, y, 0, ' ', HL_NORMAL, *config->screen_cols);
 	int msg_len = strlen(config->status_msg);
 	if( msg_len > *config->screen_cols){
 		msg_len  = *config->screen_cols;
 	}
 	if( msg_len && time(NULL) - config->status_time < 5){
-		Append_Buffer(buff, config->status_msg, msg_len);
+		Screen_Put(screen, y, 0, config->status_msg, HL_NORMAL, msg_len);
 	}
 }
 
@@ -1217,7 +7743,7 @@ void Scroll()
 {
 	*config->render_x = *config->cursor_x;
 	if(*config->cursor_y < *config->num_of_rows){
-		*config->render_x = Row_Cursor_2_Render( &config->row[*config->cursor_y],*config->cursor_x);
+		*config->render_x = Row_Cursor_2_Render( Row_At(*config->cursor_y),*config->cursor_x);
 	}
 	if(*config->cursor_y < *config->current_row){
 		*config->current_row = *config->cursor_y;		
@@ -1233,12 +7759,17 @@ void Scroll()
 	}
 }
 	
-void Draw_Rows( struct Buffer *buff )
+void Draw_Rows( struct Screen *screen )
 {
 	int y = 0;
-	for( y = 0 ; y < *config->screen_rows ; y++){
+	struct Row_Iter iter;
+	Map_Index_Until(*config->current_row + *config->screen_rows);
+	Syntax_Validate(*config->current_row + *config->screen_rows - 1);
+	File_row *row = Row_Iter_Seek(&iter, *config->current_row);
+	for( y = 0 ; y < *config->screen_rows ; y++, row = Row_Iter_Next(&iter)){
 		int file_row = y + *config->current_row;
 		if( file_row >= *config->num_of_rows){
+			Screen_Fill(screen, y, 0, ' ', HL_NORMAL, *config->screen_cols);
 			if( *config->num_of_rows == 0 && y == *config->screen_rows / 3){
 				char welcome[64];		//welcome buffer
 				int welcome_len = snprintf(welcome,sizeof(welcome),"Tedit-or Version %s",TEDIT_VERSION);
@@ -1248,91 +7779,96 @@ void Draw_Rows( struct Buffer *buff )
 				}
 				int padding = (*config->screen_cols - welcome_len) / 2;
 				if(padding){
-					Append_Buffer(buff,"~",1);
-					padding--;
+					Screen_Put(screen, y, 0, "~", HL_NORMAL, 1);
 				}
-				while(padding != 0){
-					Append_Buffer(buff," ",1);
-					padding--;
-				}
-				Append_Buffer(buff,welcome,welcome_len);
+				Screen_Put(screen, y, padding, welcome, HL_NORMAL, welcome_len);
 			}else{
-				Append_Buffer(buff,"~",1);
+				Screen_Put(screen, y, 0, "~", HL_NORMAL, 1);
 			}
 		}else{
-			int len = *config->row[file_row].render_size - *config->current_col;
+			Row_Materialize(row, file_row);
+			int first = *config->current_col - (row->chunks ? row->chunks->render_rx : 0);
+			int len = row->columns - first;
 			if(len < 0){
 				len = 0;
 			}
 			if(len > *config->screen_cols){
 				len = *config->screen_cols;
 			}
-			char *c = &config->row[file_row].render[*config->current_col];
-			unsigned char *highlight = &config->row[file_row].high_lighted[*config->current_col];
-			int current_color = -1;
+			unsigned int *cell = &screen->text[y * screen->cols];
+			unsigned char *attr = &screen->attr[y * screen->cols];
 
 			int i = 0;
-			for(i = 0; i < len ; i++){
-				if(iscntrl(c[i])){
-					char sym = (c[i] <= 26) ? '@' + c[i] : '?';
-					Append_Buffer(buff,"\x1b[7m",4);
-					Append_Buffer(buff,&sym,1);
-					Append_Buffer(buff,"\x1b[m",3);
-					if(current_color != -1){
-						char b_buf[16];
-						int clen = snprintf(b_buf,sizeof(b_buf),"\x1b[%dm", current_color);
-						Append_Buffer(buff,b_buf,clen);
-					}	
-				}else if(highlight[i] == HL_NORMAL){	
-					if(current_color != -1){
-						Append_Buffer(buff,"\x1b[39m",5);
-						current_color = -1;
-					}
-					Append_Buffer(buff,&c[i],1);
-				}else{
-					int color = Syntax_Color( highlight[i] );
-					if(color != current_color){
-						current_color = color;
-						char c_buf[16];
-						int c_len = snprintf(c_buf,sizeof(c_buf),"\x1b[%dm",color);
-						Append_Buffer(buff,c_buf,c_len);
-					}
-					Append_Buffer(buff,&c[i],1);
+			memcpy(attr, &row->high_lighted[first], len);
+			Search_High_Light(row, file_row, attr, len);
+			if(row->flags & ROW_GLYPHS){
+				memcpy(cell, &row->glyph[first], len * sizeof(unsigned int));
+				/* wide characters cut by either edge of the screen */
+				if(len && cell[0] == 0){
+					cell[0] = ' ';
+				}
+				if(len && first + len < row->columns && row->glyph[first + len] == 0){
+					cell[len - 1] = ' ';
+				}
+			}else{
+				for(i = 0; i < len; i++){
+					cell[i] = (unsigned char)row->render[first + i];
 				}
 			}
-			Append_Buffer(buff,"\x1b[39m",5);
+			Screen_Fill(screen, y, len, ' ', HL_NORMAL, *config->screen_cols - len);
 		}
-		Append_Buffer(buff,"\x1b[K",3);
-		Append_Buffer(buff,"\r\n",2);
 	}
 }
 
-void Refresh_Screen()
+/**	Builds the bytes that bring the terminal up to date in		**/
+/**	config->screen->frame, without writing them.				**/
+void Draw_Frame()
 {
+	long long trace = Trace_Now();
 	Scroll();
 
-	struct Buffer buff = BUFFER_CONSTR;
+	struct Screen *screen = config->screen;
+	if(screen->rows != *config->screen_rows + 2 || screen->cols != *config->screen_cols){
+		Screen_Resize(screen, *config->screen_rows + 2, *config->screen_cols);
+	}
+	Draw_Rows(screen);
+	Draw_Status_Bar(screen);
+	Draw_Message_Bar(screen);
+	Trace_End(TRACE_DRAW, trace);
 
-	Append_Buffer(&buff,"\x1b[?25l",6);
-	Append_Buffer(&buff,"\x1b[H",3);
+	trace = Trace_Now();
+	struct Buffer *buff = &screen->frame;
+	buff->length = 0;
 
-	Draw_Rows(&buff);
-	Draw_Status_Bar(&buff);
-	Draw_Message_Bar(&buff);
+	Append_Buffer(buff,"\x1b[?25l",6);
+	Screen_Flush(screen, buff, *config->screen_rows, *config->current_row);
 
 	char curs_buff[32];
-	snprintf(curs_buff,sizeof(curs_buff),"\x1b[%d;%dH", 
+	int curs_len = snprintf(curs_buff,sizeof(curs_buff),"\x1b[%d;%dH", 
 			 (*config->cursor_y - *config->current_row) + 1, (*config->render_x - *config->current_col )+ 1 );
-	Append_Buffer(&buff,curs_buff,strlen(curs_buff));
-	
-	Append_Buffer(&buff,"\x1b[?25h",6);
+	Append_Buffer(buff,curs_buff,curs_len);
 	
-	write(STDOUT,buff.string,buff.length);
-	Free_Buffer(&buff);
+	Append_Buffer(buff,"\x1b[?25h",6);
+	Trace_End(TRACE_FLUSH, trace);
+}
+
+void Refresh_Screen()
+{
+	struct Trace_Frame *frame = &config->trace->frames[config->trace->next];
+	if(frame->key){
+		Trace_End(TRACE_KEYS, frame->key);
+	}
+	Draw_Frame();
+	long long trace = Trace_Now();
+	Write_Buffer(STDOUT, &config->screen->frame);
+	Trace_End(TRACE_WRITE, trace);
+	Trace_Count(TRACE_BYTES_WRITTEN, config->screen->frame.length);
+	Trace_Frame_End();
 }
 
 /* INIT */
-void Init_Editor()
+/**	Editor state without a terminal; Init_Editor adds the window size.	**/
+void Reset_Editor()
 {
 	*config->cursor_x = 0;	
 	*config->cursor_y = 0;
@@ -1341,34 +7877,47 @@ void Init_Editor()
 	*config->current_col = 0;
 	*config->render_x = 0;
 	*config->dirty_flag = 0;
+	*config->syntax_valid = 0;
+	*config->hot_next = 0;
+	*config->undo_budget = UNDO_BUDGET;
 	config->status_msg[0] = '\0';
 	config->status_time = 0;
-	config->row = NULL;
+	config->lines = NULL;
+	config->map = NULL;
 	config->filename = NULL;
 	config->syntax = NULL;
+	config->save = NULL;
+	config->journal = NULL;
+}
 
+void Init_Editor()
+{
+	Reset_Editor();
 	if(Get_Win_Size(config->screen_cols,config->screen_rows) == -1){
 		die("Get_Win_size");
 	}
 	*config->screen_rows -= 2;
 }
 
+#ifndef TEDIT_NO_MAIN
 int main( int argc, char **argv )
 {
 	
 	Enable_Raw_Mode();
 	Init_Editor();
+	Set_Status_Message("CTRL + Q = Quit || CTRL + S = Save || CTRL + f = Find || CTRL + Z = Undo");	
 	if(argc >= 2){
-		Open_File(argv[1]);
+		Open_File(argv[1]);		/* may replace it with a recovery notice */
 	}
 	char key_press = '\0';
-	
-	Set_Status_Message("CTRL + Q = Quit || CTRL + S = Save || CTRL + f = Find");	
 
 	while(1){
 		Refresh_Screen();
-		Process_Key_Press();
+		do{
+			Process_Key_Press();		/* one redraw per batch of keys read */
+		}while(Input_Pending());
 	}
 	
 	return 0;
 }
+#endif